@@ -0,0 +1,172 @@
+/* ahrs.cpp
+ *
+ * Mahony attitude filter; see ahrs.h
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <math.h>
+
+#include "ahrs.h"
+
+// sensor units to g, rad/s and gauss
+#define ACCEL_SCALE (1.0f / 256)
+#define GYRO_SCALE ((float)(M_PI / 180 / 14.375))
+#define COMPASS_SCALE (1.0f / 1300)
+
+// hard-iron offset of the compass in robot axes (gauss); flat calibration
+static const Vector3 compass_offset = { -0.036923f, -0.107692f, -0.03775f };
+
+// feedback gains: proportional (rad/s per unit error) and integral
+#define KP 1.0f
+#define KI 0.02f
+
+/* the accelerometer is used only within this of 1g; beyond it, most of
+ *  what it reads is the robot speeding up, slowing down or turning */
+#define ACCEL_GATE 0.15f
+
+void ahrs_init(ahrs & a) {
+   a.q0 = 1;
+   a.q1 = a.q2 = a.q3 = 0;
+   a.bias.x = a.bias.y = a.bias.z = 0;
+   a.started = 0;
+}
+
+// scale v to unit length; returns its old length
+static float normalize(Vector3 & v) {
+   float n = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+   if( n > 0 ) {
+      float r = 1.0f / n;
+      v.x *= r;
+      v.y *= r;
+      v.z *= r;
+   }
+   return n;
+}
+
+// orientation straight from the accelerometer and compass
+static void ahrs_start(ahrs & a, const Vector3 & acc, const Vector3 & mag) {
+   float roll = atan2(acc.y, acc.z);
+   float pitch = atan2(-acc.x, sqrt(acc.y*acc.y + acc.z*acc.z));
+
+   // the compass, levelled
+   float sr = sin(roll), cr = cos(roll);
+   float sp = sin(pitch), cp = cos(pitch);
+   float mx = mag.x * cp + (mag.y * sr + mag.z * cr) * sp;
+   float my = mag.y * cr - mag.z * sr;
+   float yaw = atan2(-my, mx);
+
+   // yaw, pitch, roll to a quaternion
+   float c1 = cos(roll/2), s1 = sin(roll/2);
+   float c2 = cos(pitch/2), s2 = sin(pitch/2);
+   float c3 = cos(yaw/2), s3 = sin(yaw/2);
+   a.q0 = c1*c2*c3 + s1*s2*s3;
+   a.q1 = s1*c2*c3 - c1*s2*s3;
+   a.q2 = c1*s2*c3 + s1*c2*s3;
+   a.q3 = c1*c2*s3 - s1*s2*c3;
+   a.started = 1;
+}
+
+void ahrs_update(ahrs & a, const imu_sample & s) {
+   Vector3 acc, gyro, mag;
+   acc.x = s.accel[0] * ACCEL_SCALE;
+   acc.y = s.accel[1] * ACCEL_SCALE;
+   acc.z = s.accel[2] * ACCEL_SCALE;
+   gyro.x = s.gyro[0] * GYRO_SCALE;
+   gyro.y = s.gyro[1] * GYRO_SCALE;
+   gyro.z = s.gyro[2] * GYRO_SCALE;
+   mag.x = s.compass[0] * COMPASS_SCALE - compass_offset.x;
+   mag.y = s.compass[1] * COMPASS_SCALE - compass_offset.y;
+   mag.z = s.compass[2] * COMPASS_SCALE - compass_offset.z;
+
+   /* the accelerometer also feels the robot turning at speed: take out
+    *  gyro x (speed, 0, 0), in g */
+   float v = s.speed * (0.001f / 9.81f);
+   acc.y -= gyro.z * v;
+   acc.z += gyro.y * v;
+
+   float an = normalize(acc);
+   if( !a.started ) {
+      // still, and the compass has been read
+      if( fabs(an - 1.0f) < ACCEL_GATE &&
+            (s.compass[0] || s.compass[1] || s.compass[2]) ) {
+         ahrs_start(a, acc, mag);
+      }
+      return;
+   }
+
+   float q0 = a.q0, q1 = a.q1, q2 = a.q2, q3 = a.q3;
+   float q0q0 = q0*q0, q0q1 = q0*q1, q0q2 = q0*q2, q0q3 = q0*q3;
+   float q1q1 = q1*q1, q1q2 = q1*q2, q1q3 = q1*q3;
+   float q2q2 = q2*q2, q2q3 = q2*q3;
+   float q3q3 = q3*q3;
+
+   // up, in robot axes
+   float vx = 2 * (q1q3 - q0q2);
+   float vy = 2 * (q0q1 + q2q3);
+   float vz = q0q0 - q1q1 - q2q2 + q3q3;
+
+   // error: the rotation from what the sensors see to what the orientation
+   //  predicts they should
+   Vector3 e = { 0, 0, 0 };
+
+   if( an > 0 && fabs(an - 1.0f) < ACCEL_GATE ) {
+      e.x = acc.y * vz - acc.z * vy;
+      e.y = acc.z * vx - acc.x * vz;
+      e.z = acc.x * vy - acc.y * vx;
+   }
+
+   /* the compass only corrects heading, so that a magnetic disturbance
+    *  can't tilt the estimate: the field's bearing in world axes, from
+    *  north, applied about up */
+   float hx = 2 * (mag.x * (0.5f - q2q2 - q3q3) + mag.y * (q1q2 - q0q3) +
+         mag.z * (q1q3 + q0q2));
+   float hy = 2 * (mag.x * (q1q2 + q0q3) + mag.y * (0.5f - q1q1 - q3q3) +
+         mag.z * (q2q3 - q0q1));
+   float hn = sqrt(hx*hx + hy*hy);
+   if( hn > 0 ) {
+      float ez = -hy / hn;
+      e.x += ez * vx;
+      e.y += ez * vy;
+      e.z += ez * vz;
+   }
+
+   a.bias.x += KI * e.x * AHRS_DT;
+   a.bias.y += KI * e.y * AHRS_DT;
+   a.bias.z += KI * e.z * AHRS_DT;
+   gyro.x += a.bias.x + KP * e.x;
+   gyro.y += a.bias.y + KP * e.y;
+   gyro.z += a.bias.z + KP * e.z;
+
+   // integrate: q' = q * (0, gyro) / 2
+   float h = 0.5f * AHRS_DT;
+   gyro.x *= h;
+   gyro.y *= h;
+   gyro.z *= h;
+   a.q0 = q0 - q1 * gyro.x - q2 * gyro.y - q3 * gyro.z;
+   a.q1 = q1 + q0 * gyro.x + q2 * gyro.z - q3 * gyro.y;
+   a.q2 = q2 + q0 * gyro.y - q1 * gyro.z + q3 * gyro.x;
+   a.q3 = q3 + q0 * gyro.z + q1 * gyro.y - q2 * gyro.x;
+
+   float r = 1.0f / sqrt(a.q0*a.q0 + a.q1*a.q1 + a.q2*a.q2 + a.q3*a.q3);
+   a.q0 *= r;
+   a.q1 *= r;
+   a.q2 *= r;
+   a.q3 *= r;
+}
+
+Vector3 ahrs_rpy(const ahrs & a) {
+   Vector3 rpy;
+   rpy.x = atan2(2 * (a.q0*a.q1 + a.q2*a.q3),
+         1 - 2 * (a.q1*a.q1 + a.q2*a.q2));
+   float sp = 2 * (a.q0*a.q2 - a.q3*a.q1);
+   if( sp > 1 ) sp = 1;
+   if( sp < -1 ) sp = -1;
+   rpy.y = asin(sp);
+   // from north to from east
+   float yaw = atan2(2 * (a.q0*a.q3 + a.q1*a.q2),
+         1 - 2 * (a.q2*a.q2 + a.q3*a.q3)) + (float)(M_PI / 2);
+   if( yaw > M_PI ) yaw -= (float)(2 * M_PI);
+   rpy.z = yaw;
+   return rpy;
+}
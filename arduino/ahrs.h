@@ -0,0 +1,56 @@
+/* ahrs.h
+ *
+ * Attitude and heading from the 9dof IMU: a Mahony filter. The gyro rates
+ *  are integrated into an orientation quaternion at every sample; the
+ *  error between where that orientation says gravity and magnetic north
+ *  should be and where the accelerometer and compass see them is fed back
+ *  into the rates, proportionally (which pulls the orientation in) and
+ *  integrally (which learns the gyro's bias). The compass corrects heading
+ *  only; the accelerometer corrects roll and pitch, once the acceleration
+ *  of cornering at the robot's speed is taken out, and not at all while it
+ *  reads far from 1g.
+ *
+ * Single precision, so that the AVR and the host replay (data/ahrs.cpp)
+ *  run the same code.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef AHRS_H
+#define AHRS_H
+
+#include <stdint.h>
+#include "twist.h"
+
+/* one reading of each sensor, in robot axes (x forward, y left, z up) and
+ *  the sensors' own units: accelerometer 256 per g of specific force (up
+ *  at rest), gyro 14.375 per deg/s less its zero, compass 1300 per gauss;
+ *  and the forward speed from odometry (mm/s), to take the acceleration of
+ *  cornering out of the accelerometer */
+struct imu_sample {
+   int16_t accel[3];
+   int16_t gyro[3];
+   int16_t compass[3];
+   int16_t speed;
+};
+
+// fixed step: the sensors' 50Hz data rate (s)
+#define AHRS_DT 0.02f
+
+struct ahrs {
+   float q0, q1, q2, q3; // robot to world (x north, y west, z up)
+   Vector3 bias;         // integral feedback; the gyro bias, negated (rad/s)
+   uint8_t started;
+};
+
+void ahrs_init(ahrs & a);
+
+/* one step; the first sets the orientation straight from the accelerometer
+ *  and compass */
+void ahrs_update(ahrs & a, const imu_sample & s);
+
+/* roll, pitch and yaw (rad), as the IMU message has them: yaw is
+ *  counter-clockwise from east, in (-pi, pi] */
+Vector3 ahrs_rpy(const ahrs & a);
+
+#endif
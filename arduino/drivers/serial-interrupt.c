@@ -5,23 +5,36 @@
 #include <avr/interrupt.h>
 
 
-/* recieve circular fifo (10 bytes total 20% overhead) */
-extern uint8_t rx_head[4]; /* points to next writeable byte */
-extern volatile uint8_t rx_size[4]; /* number of byts in buffer */
+/* recieve rings; see serial.c */
 extern uint8_t rx_buf[4][BUF_SZ];
+extern volatile uint8_t rx_head[4];
+extern volatile uint8_t rx_tail[4];
+extern volatile uint8_t rx_lost[4];
 
-/* send circular fifo (10 bytes total, 20% overhead) */
-extern uint8_t tx_head[4]; /* next writeable buffer */
-extern volatile uint8_t tx_size[4]; /* number of buffers in queue */
+/* send queues, one per class */
+extern uint8_t tx_head[4][TX_CLASSES]; /* next writeable buffer */
+extern volatile uint8_t tx_tail[4][TX_CLASSES]; /* next buffer to send */
 
-extern const uint8_t * tx_ptrs[4][PTR_SZ];
-extern uint16_t * tx_szs[4][PTR_SZ];
+extern const uint8_t * tx_ptrs[4][TX_CLASSES][PTR_SZ];
+extern uint16_t * tx_szs[4][TX_CLASSES][PTR_SZ];
 extern uint16_t tx_pos[4];
+extern uint8_t tx_cur[4];
 
+extern volatile uint16_t tx_window[4];
+extern uint8_t tx_held[4];
+extern volatile uint16_t tx_defers[4];
+
+/* store a byte unless the ring is full; only the head moves here, so the
+ * reader never has to lock us out */
 #define RX(port, udr, p) ISR(port) { \
-   rx_buf[p][rx_head[p]++] = udr;\
-   rx_head[p] %= BUF_SZ;\
-   rx_size[p]++;\
+   uint8_t b = udr; \
+   uint8_t h = rx_head[p]; \
+   if( (uint8_t)(h - rx_tail[p]) < BUF_SZ - 1 ) { \
+      rx_buf[p][h & (BUF_SZ - 1)] = b; \
+      rx_head[p] = h + 1; \
+   } else { \
+      rx_lost[p]++; \
+   } \
 }
 
 RX(USART0_RX_vect, UDR0, 0);
@@ -33,20 +46,51 @@ RX(USART3_RX_vect, UDR3, 3);
  * rather than copying buffers around
  *
  * Implementation:
- * store a circular buffer of pointers to buffers and buffer sizes; when the
- * interrupt is done transmitting, set the buffer size to 0
+ * store a circular buffer of pointers to buffers and buffer sizes for each
+ * class; when the interrupt is done transmitting, set the buffer size to 0
+ *
+ * Frames are never interleaved; between frames, a real-time frame goes
+ * first, and a bulk frame only if it fits in the window before the next
+ * real-time slot. A bulk frame that doesn't fit is counted as deferred once,
+ * and tx_slot() re-enables the interrupt to try again.
  */
 
+/* the buffer to send next in class c, and whether there is one */
+#define TX_HEAD(pn, c) (tx_tail[pn][c] & (PTR_SZ - 1))
+#define TX_QUEUED(pn, c) (tx_head[pn][c] != tx_tail[pn][c])
+
+/* class to send next, or TX_NONE */
+static inline uint8_t tx_next(uint8_t pn) {
+   if( TX_QUEUED(pn, TX_RT) ) return TX_RT;
+   if( TX_QUEUED(pn, TX_BULK) ) {
+      if( *tx_szs[pn][TX_BULK][TX_HEAD(pn, TX_BULK)] <= tx_window[pn] ) {
+         tx_held[pn] = 0;
+         return TX_BULK;
+      }
+      if( !tx_held[pn] ) {
+         tx_held[pn] = 1;
+         tx_defers[pn]++;
+      }
+   }
+   return TX_NONE;
+}
+
 #define TX(port, ucsr, udr, pn) ISR(port) { \
-   if( tx_size[pn]) { \
-      uint8_t p = (PTR_SZ + tx_head[pn] - tx_size[pn]) % PTR_SZ; \
-      uint8_t b = tx_ptrs[pn][p][tx_pos[pn]]; \
+   if( tx_cur[pn] == TX_NONE ) tx_cur[pn] = tx_next(pn); \
+   if( tx_cur[pn] != TX_NONE ) { \
+      uint8_t c = tx_cur[pn]; \
+      uint8_t p = TX_HEAD(pn, c); \
+      uint8_t b = tx_ptrs[pn][c][p][tx_pos[pn]]; \
       udr = b; \
       tx_pos[pn]++; \
-      if( tx_pos[pn] >= (*tx_szs[pn][p]) ) { \
-         *tx_szs[pn][p] = 0; \
+      if( tx_window[pn] != TX_NO_SLOTS && tx_window[pn] > 0 ) { \
+         tx_window[pn]--; \
+      } \
+      if( tx_pos[pn] >= (*tx_szs[pn][c][p]) ) { \
+         *tx_szs[pn][c][p] = 0; \
          tx_pos[pn] = 0; \
-         tx_size[pn]--; \
+         tx_tail[pn][c]++; \
+         tx_cur[pn] = TX_NONE; \
       } \
    } else { \
 	   ucsr &= ~(1 << 5); /* disable send interrupt */ \
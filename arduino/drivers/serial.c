@@ -12,10 +12,23 @@
 #include <avr/interrupt.h>
 
 
-/* recieve circular fifo */
-uint8_t rx_head[4]; /* points to next writeable byte */
-volatile uint8_t rx_size[4]; /* number of byts in buffer */
+/* recieve rings. single producer (the receive interrupt, which only writes
+ * rx_head) and single consumer (the reader, which only writes rx_tail), so
+ * the reader never needs to mask interrupts. the indices are free-running
+ * bytes; BUF_SZ divides 256, so they wrap cleanly and head - tail is the
+ * number of bytes waiting */
 uint8_t rx_buf[4][BUF_SZ];
+volatile uint8_t rx_head[4]; /* next byte to write */
+volatile uint8_t rx_tail[4]; /* next byte to read */
+volatile uint8_t rx_lost[4];
+
+/* compile-time checks on the ring sizes */
+typedef char buf_sz_is_power_of_two[(BUF_SZ & (BUF_SZ - 1)) == 0 &&
+   BUF_SZ <= 256 ? 1 : -1];
+typedef char ptr_sz_is_power_of_two[(PTR_SZ & (PTR_SZ - 1)) == 0 ? 1 : -1];
+
+/* keep the compiler from moving buffer accesses across index updates */
+#define barrier() __asm__ __volatile__("" ::: "memory")
 
 volatile uint8_t * ucsr[] = {&UCSR0A, &UCSR1A, &UCSR2A, &UCSR3A};
 #define A 0
@@ -24,86 +37,124 @@ volatile uint8_t * ucsr[] = {&UCSR0A, &UCSR1A, &UCSR2A, &UCSR3A};
 
 /* determine if there is data in the rx buffer */
 uint8_t rx_ready(uint8_t port) {
-   return rx_size[port] > 0;
+   return rx_head[port] != rx_tail[port];
 }
 
 /* get a byte from recieve buffer. block until data recieved */
 uint8_t rx_byte(uint8_t port) {
-   while(!rx_size[port]);
+   uint8_t t = rx_tail[port];
+   while( rx_head[port] == t );
+   barrier();
 
-   ucsr[port][B] &= ~(1 << 7); /* disable receive interrupt */
+   uint8_t res = rx_buf[port][t & (BUF_SZ - 1)];
+   barrier();
+   rx_tail[port] = t + 1;
+   return res;
+}
 
-   uint8_t res = rx_buf[port][(rx_head[port] - rx_size[port] + BUF_SZ) % BUF_SZ];
-   rx_size[port]--;
+/* copy up to n received bytes without blocking */
+uint8_t rx_read(uint8_t port, uint8_t * buf, uint8_t n) {
+   uint8_t t = rx_tail[port];
+   uint8_t avail = rx_head[port] - t;
+   barrier();
+   if( avail > n ) avail = n;
+
+   const uint8_t * ring = rx_buf[port];
+   uint8_t i;
+   for( i=0; i<avail; i++ ) {
+      buf[i] = ring[(uint8_t)(t + i) & (BUF_SZ - 1)];
+   }
+   barrier();
+   rx_tail[port] = t + avail;
+   return avail;
+}
 
-   ucsr[port][B] |= (1 << 7); /* enable receive interrupt */
-   return res;
+uint8_t rx_overruns(uint8_t port) {
+   return rx_lost[port];
 }
 
-/* send circular fifo */
-uint8_t tx_head[4]; /* next writeable byte */
-volatile uint8_t tx_size[4]; /* number of bytes in buffer */
-const uint8_t * tx_ptrs[4][PTR_SZ];
-uint16_t * tx_szs[4][PTR_SZ];
+/* send queues of buffer pointers, one per class. consumed by the send
+ * interrupt, like the receive rings, but with several producers (the main
+ * loop and other interrupts), so queueing masks interrupts briefly */
+uint8_t tx_head[4][TX_CLASSES]; /* next writeable buffer */
+volatile uint8_t tx_tail[4][TX_CLASSES]; /* next buffer to send */
+const uint8_t * tx_ptrs[4][TX_CLASSES][PTR_SZ];
+uint16_t * tx_szs[4][TX_CLASSES][PTR_SZ];
 uint16_t tx_pos[4] = {0, 0, 0, 0};
+uint8_t tx_cur[4]; /* class of the buffer being sent, or TX_NONE */
 
-/* transmit an entire buffer */
-void tx_buffer(uint8_t port, const uint8_t * buf, uint16_t * bufsz) {
-   /*
-   uint8_t lock_fail = 0;
-wait:
-   while(tx_size[port] >= PTR_SZ);
-   */
-   if(tx_size[port] >= PTR_SZ) {
+/* bytes that can be sent before the next real-time slot */
+volatile uint16_t tx_window[4];
+uint8_t tx_bytes_per_ms[4];
+uint8_t tx_held[4]; /* the head of the bulk queue has been deferred */
+
+volatile uint16_t tx_drops[4];
+volatile uint16_t tx_defers[4];
+
+/* transmit an entire buffer in class cls */
+void tx_buffer_class(uint8_t port, const uint8_t * buf, uint16_t * bufsz,
+      uint8_t cls) {
+   uint8_t sreg = SREG;
+   cli(); /* lock everything before we modify the send queue */
+
+   uint8_t h = tx_head[port][cls];
+   if( (uint8_t)(h - tx_tail[port][cls]) >= PTR_SZ ) {
       *bufsz = 0;
+      tx_drops[port]++;
+      SREG = sreg;
       return;
    }
 
-   //ucsr[port][B] &= ~(1 << 5); /* diable send interrupt (locking) */
-   cli(); /* lock everything before we modify the send queue */
+   tx_ptrs[port][cls][h & (PTR_SZ - 1)] = buf;
+   tx_szs[port][cls][h & (PTR_SZ - 1)] = bufsz;
+   tx_head[port][cls] = h + 1;
 
-   /*
-   if( tx_size[port] >= PTR_SZ ) {
-     //led_on(); // failed to lock TX queue
-     lock_fail = 1;
-     // if we didn't get a good lock, unlock and go back to waiting
-     sei(); // we MUST enable interrupts here so that the tx interrupt can
-            // empty the transmit queue 
-     goto wait;
-   }
-   if( lock_fail ) {
-      //led_off(); // successful lock on tx queue
+   ucsr[port][B] |= (1 << 5); /* enable and trigger send interrupt */
+   SREG = sreg; /* unlock */
+}
+
+/* transmit an entire buffer */
+void tx_buffer(uint8_t port, const uint8_t * buf, uint16_t * bufsz) {
+   tx_buffer_class(port, buf, bufsz, TX_BULK);
+}
+
+/* the next real-time slot starts in ms milliseconds */
+void tx_slot(uint8_t port, uint8_t ms) {
+   /* we may be anywhere in the current millisecond, so it doesn't count */
+   uint16_t w = ms > 0 ? (ms - 1) * tx_bytes_per_ms[port] : 0;
+
+   uint8_t sreg = SREG;
+   cli();
+   tx_window[port] = w;
+   /* a deferred bulk frame may fit now; the send interrupt decides */
+   if( tx_head[port][TX_BULK] != tx_tail[port][TX_BULK] ) {
+      ucsr[port][B] |= (1 << 5);
    }
-   */
+   SREG = sreg;
+}
 
-   tx_ptrs[port][tx_head[port]] = buf;
-   tx_szs[port][tx_head[port]] = bufsz;
-   tx_head[port]++;
-   tx_head[port] %= PTR_SZ;
-   tx_size[port]++;
+void tx_drop(uint8_t port) {
+   uint8_t sreg = SREG;
+   cli();
+   tx_drops[port]++;
+   SREG = sreg;
+}
 
-   ucsr[port][B] |= (1 << 5); /* enable and trigger send interrupt */
-   sei(); /* unlock */
+uint16_t tx_dropped(uint8_t port) {
+   uint8_t sreg = SREG;
+   cli();
+   uint16_t d = tx_drops[port];
+   SREG = sreg;
+   return d;
 }
 
-/* priority tx: push to front of tx queue
- */
-//void priority_tx(uint8_t port, uint8_t * buf, uint16_t bufsz) {
-//   while(tx_size[port] >= PTR_SZ); // TODO: consider dropping this check
-//
-//   ucsr[port][B] &= ~(1 << 5); /* diable send interrupt (locking) */
-//
-//   uint8_t p = (tx_head[port] - tx_size[port] - 1) % PTR_SZ;
-//   // TODO: push onto other end of circular fifo
-//   tx_ptrs[port][p] = buf;
-//   tx_szs[port][p] = bufsz;
-//   tx_pos[port] = 0;
-//   //tx_head[port]++;
-//   //tx_head[port] %= PTR_SZ;
-//   tx_size[port]++;
-//
-//   ucsr[port][B] |= (1 << 5); /* enable send interrupt */
-//}
+uint16_t tx_deferred(uint8_t port) {
+   uint8_t sreg = SREG;
+   cli();
+   uint16_t d = tx_defers[port];
+   SREG = sreg;
+   return d;
+}
 
 volatile uint8_t * rxtx[] = {&DDRE, &DDRD, &DDRH, &DDRJ};
 uint8_t rxbit[] = {0, 2, 0, 0};
@@ -121,11 +172,22 @@ void serial_init_tx(uint8_t port) {
   ucsr[port][A] |= 0x20; /* set UDRE flag; don't enable interrupt */
 
   /* buffer init */
-  tx_head[port] = 0;
-  tx_size[port] = 0;
+  uint8_t c;
+  for( c=0; c<TX_CLASSES; c++ ) {
+     tx_head[port][c] = 0;
+     tx_tail[port][c] = 0;
+  }
 
   /* tx pos init */
   tx_pos[port] = 0;
+  tx_cur[port] = TX_NONE;
+
+  /* no real-time slots until tx_slot() is called */
+  tx_window[port] = TX_NO_SLOTS;
+  tx_bytes_per_ms[port] = 1;
+  tx_held[port] = 0;
+  tx_drops[port] = 0;
+  tx_defers[port] = 0;
 }
 
 /* initialize serial rx */
@@ -145,7 +207,8 @@ void serial_init_rx(uint8_t port) {
 
   /* buffer init */
   rx_head[port] = 0;
-  rx_size[port] = 0;
+  rx_tail[port] = 0;
+  rx_lost[port] = 0;
 
   /* set the USART_RXC interrupt enable bit */
   ucsr[port][B] |= (1 << 7);
@@ -174,6 +237,9 @@ void serial_baud(uint8_t port, uint32_t baud) {
   // FIXME: deal with baud rates that are too high here
   ucsr[port][A] |= (1 << U2X0); // double-speed mode
   *ubrr[port] = ubr;
+
+  // 10 bits per byte
+  tx_bytes_per_ms[port] = baud < 10000 ? 1 : baud / 10000;
 }
 
 /* stops the serial interrupts */
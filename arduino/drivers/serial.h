@@ -10,10 +10,26 @@
 
 #include <avr/io.h>
 
-#define BUF_SZ 200
+/* receive ring per port; a power of two, at most 256 so that the ring
+ *  indices are single bytes. holds BUF_SZ-1 bytes */
+#define BUF_SZ 256
 
+/* frames queued per transmit class; a power of two */
 #define PTR_SZ 8
 
+/* transmit classes; see io-scheduling.txt
+ *  real-time frames always go next. a bulk frame only starts if it will be
+ *  sent before the next real-time slot; if it won't, it is deferred until
+ *  after the slot.
+ */
+#define TX_RT 0
+#define TX_BULK 1
+#define TX_CLASSES 2
+#define TX_NONE 0xFF
+
+/* transmit window when there are no real-time slots */
+#define TX_NO_SLOTS 0xFFFF
+
 #define BRAIN 0
 #define BT 3
 #define GPS 2
@@ -40,9 +56,26 @@ void serial_stop(uint8_t port);
 /* put a byte in the transmit buffer. block until space available */
 void tx_byte(uint8_t port, uint8_t b);
 
-/* transmit an entire buffer */
+/* transmit an entire buffer in the bulk class */
 void tx_buffer(uint8_t port, const uint8_t * buf, uint16_t * bufsz);
 
+/* transmit an entire buffer in class cls. if its queue is full, the buffer
+ *  is dropped: *bufsz is set to 0 */
+void tx_buffer_class(uint8_t port, const uint8_t * buf, uint16_t * bufsz,
+      uint8_t cls);
+
+/* the next real-time slot on port starts in ms milliseconds. call every
+ *  millisecond; until the first call, bulk frames are never deferred */
+void tx_slot(uint8_t port, uint8_t ms);
+
+/* count a frame dropped before it was queued (its buffer was still busy) */
+void tx_drop(uint8_t port);
+
+/* frames dropped, and bulk frames deferred for a real-time slot; these
+ *  count up and wrap */
+uint16_t tx_dropped(uint8_t port);
+uint16_t tx_deferred(uint8_t port);
+
 /* determine if there is space for another byte in the transmit buffer */
 uint8_t tx_ready(uint8_t port);
 
@@ -52,4 +85,11 @@ uint8_t rx_ready(uint8_t port);
 /* get a byte from recieve buffer. block until data recieved */
 uint8_t rx_byte(uint8_t port);
 
+/* copy up to n received bytes into buf without blocking; returns the number
+ *  copied */
+uint8_t rx_read(uint8_t port, uint8_t * buf, uint8_t n);
+
+/* bytes lost because the receive ring was full; counts up and wraps */
+uint8_t rx_overruns(uint8_t port);
+
 #endif
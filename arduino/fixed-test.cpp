@@ -0,0 +1,114 @@
+/* fixed-test.cpp
+ *
+ * Accuracy of the fixed-point odometry against the float code it replaced,
+ *  on the host. Build with
+ *   g++ -I. fixed-test.cpp fixed.cpp odom.cpp steer.cpp -o fixed-test
+ *
+ * Both are compared to the float code run in double precision. Pass "table"
+ *  to print odom.cpp's table of turn per count instead.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fixed.h"
+#include "odom.h"
+#include "steer.h"
+#include "tests/odom_float.h"
+
+// 50Hz updates
+#define RUN 30000
+#define RUNS 100
+
+// difference of two headings, rad, in (-pi, pi]
+double yaw_err(double a, double b) {
+   return fabs(remainder(a - b, 2*M_PI));
+}
+
+int main(int argc, char ** argv) {
+   if( argc > 1 && strcmp(argv[1], "table") == 0 ) {
+      for( int i=0; i<128; i++ ) {
+         long t = i ? lround(Q_SCALE / (2*M_PI * steer2radius(i)) *
+                  4294967296.0) : 0;
+         if( i % 6 == 0 ) printf("/* %3d */ ", i);
+         printf("%8ld%s", t, i == 127 ? " };\n" : i % 6 == 5 ? ",\n" : ", ");
+      }
+      return 0;
+   }
+
+   // sine and cosine, in Q1.15 units
+   double sin_err = 0;
+   for( long a=0; a<65536; a++ ) {
+      double t = a * 2*M_PI / 65536;
+      double e = fabs(fx_sin(a) - 32768 * sin(t));
+      if( e > sin_err ) sin_err = e;
+      e = fabs(fx_cos(a) - 32768 * cos(t));
+      if( e > sin_err ) sin_err = e;
+   }
+   printf("sin/cos: max error %.2f / 32768\n", sin_err);
+
+   /* random drives: RUNS runs of RUN updates, with a new steering setting
+    *  and speed every 2s; the error is the largest of any update */
+   srand(1);
+   double fixed_pos = 0, fixed_yaw = 0, float_pos = 0, float_yaw = 0;
+   int fixed_msg = 0, float_msg = 0, angular = 0;
+   for( int r=0; r<RUNS; r++ ) {
+      pose p = { 0, 0, 0 };
+      float_pose<float> f;
+      float_pose<double> d;
+      int8_t steer = 0;
+      int16_t counts = 0;
+      for( int i=0; i<RUN; i++ ) {
+         if( i % 100 == 0 ) {
+            steer = rand() % 241 - 120;
+            if( rand() % 4 == 0 ) steer = 0;
+            counts = rand() % 5 - 1; // up to 4m/s, forward or back
+         }
+         pose_move(p, counts, steer);
+         float_move(f, counts, steer);
+         float_move(d, counts, steer);
+
+         double px = p.x / 65536.0, py = p.y / 65536.0;
+         double pyaw = (int32_t)p.yaw * (M_PI / 2147483648.0);
+         double e = hypot(px - d.x, py - d.y);
+         if( e > fixed_pos ) fixed_pos = e;
+         e = yaw_err(pyaw, d.yaw);
+         if( e > fixed_yaw ) fixed_yaw = e;
+         e = hypot(f.x - d.x, f.y - d.y);
+         if( e > float_pos ) float_pos = e;
+         e = yaw_err(f.yaw, d.yaw);
+         if( e > float_yaw ) float_yaw = e;
+
+         // message fields: x (mm) and yaw (mrad)
+         int m = abs(mul_q16(p.x, 1000) - (int32_t)(d.x * 1000));
+         if( m > fixed_msg ) fixed_msg = m;
+         m = abs(pose_yaw_mrad(p) - float_yaw_mrad(d));
+         if( m > 3141 ) m = 6283 - m;
+         if( m > fixed_msg ) fixed_msg = m;
+         m = abs((int32_t)(f.x * 1000) - (int32_t)(d.x * 1000));
+         if( m > float_msg ) float_msg = m;
+         m = abs(float_yaw_mrad(f) - float_yaw_mrad(d));
+         if( m > 3141 ) m = 6283 - m;
+         if( m > float_msg ) float_msg = m;
+
+         // the float code's angular speed is unsigned
+         int16_t speed = counts * 16 * 50;
+         m = abs(abs(angular_speed(speed, steer)) -
+               abs(float_angular(speed, steer)));
+         if( m > angular ) angular = m;
+      }
+   }
+   printf("%d drives of %ds, error against double precision:\n", RUNS,
+         RUN / 50);
+   printf("  fixed: position %.2fmm, yaw %.3fmrad, message %d\n",
+         fixed_pos * 1000, fixed_yaw * 1000, fixed_msg);
+   printf("  float: position %.2fmm, yaw %.3fmrad, message %d\n",
+         float_pos * 1000, float_yaw * 1000, float_msg);
+   printf("angular speed: max difference %d mrad/s\n", angular);
+
+   return 0;
+}
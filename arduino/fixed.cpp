@@ -0,0 +1,42 @@
+/* fixed.cpp
+ *
+ * Table-driven sine and cosine; see fixed.h
+ *
+ * Author: Austin Hendrix
+ */
+
+#include "fixed.h"
+
+/* sin over a quarter turn, every 1/256 turn, Q1.15; scaled up by 1 + h^2/16
+ *  (h the step in rad) to center the error of interpolating along chords */
+static const uint16_t sin_table[65] PROGMEM = {
+       0,   804,  1608,  2411,  3212,  4011,  4808,  5602,
+    6393,  7180,  7962,  8740,  9512, 10279, 11040, 11793,
+   12540, 13279, 14011, 14733, 15447, 16152, 16847, 17531,
+   18206, 18869, 19521, 20161, 20789, 21404, 22006, 22596,
+   23171, 23733, 24280, 24813, 25331, 25834, 26320, 26792,
+   27247, 27685, 28107, 28512, 28900, 29270, 29623, 29958,
+   30275, 30573, 30854, 31115, 31358, 31582, 31787, 31973,
+   32140, 32287, 32415, 32523, 32611, 32680, 32730, 32759,
+   32767 };
+
+q15_t fx_sin(angle_t a) {
+   // fold into the first quarter: 0 to 0x4000
+   uint16_t q = a & 0x3FFF;
+   if( a & 0x4000 ) q = 0x4000 - q;
+
+   uint8_t i = q >> 8;
+   uint8_t f = q & 0xFF;
+   uint16_t s = pgm_read_word(&sin_table[i]);
+   if( f ) {
+      uint16_t next = pgm_read_word(&sin_table[i+1]);
+      s += ((uint32_t)(next - s) * f + 128) >> 8;
+   }
+
+   // the second half turn is the first, negated
+   return (a & 0x8000) ? -(q15_t)s : (q15_t)s;
+}
+
+q15_t fx_cos(angle_t a) {
+   return fx_sin(a + 0x4000);
+}
@@ -0,0 +1,61 @@
+/* fixed.h
+ *
+ * Fixed-point math for the AVR, which has no FPU: a float multiply costs
+ *  well over a hundred cycles and sin or cos several thousand, where a
+ *  16x16 multiply is a handful.
+ *
+ * q16_t is Q16.16 (lengths in metres, to 15um, out to 32km) and q15_t is
+ *  Q1.15 (sines and cosines, and other values in [-1, 1)). Angles are binary:
+ *  an angle_t is a fraction of a turn, 65536 to the turn, so they wrap
+ *  around by themselves and need no normalizing; a uint32_t holds one to
+ *  2^-32 turn for accumulating small changes.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+#include <math.h>
+
+// tables live in flash
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+// for the host tests
+#define PROGMEM
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#endif
+
+typedef int32_t q16_t;
+typedef int16_t q15_t;
+typedef uint16_t angle_t;
+
+/* constants, with n fractional bits; x must be a compile-time constant, or
+ *  this is a float multiply */
+#define FIX(x, n) \
+   ((int32_t)((x) * (double)(1L << (n)) + ((x) < 0 ? -0.5 : 0.5)))
+#define Q16(x) ((q16_t)FIX(x, 16))
+#define Q15(x) ((q15_t)FIX(x, 15))
+#define ANGLE(rad) ((angle_t)(int32_t)((rad) * (32768.0 / M_PI)))
+
+/* a * b, rounded down to an integer; exact for any a, without a 64-bit
+ *  multiply: a is split into whole and fractional halves and each is
+ *  multiplied by b separately */
+static inline int32_t mul_q16(q16_t a, int16_t b) {
+   return (a >> 16) * (int32_t)b + (((int32_t)(uint16_t)a * b) >> 16);
+}
+
+// a * b, in Q16.16; as mul_q16
+static inline q16_t mul_q15(q16_t a, q15_t b) {
+   return (a >> 16) * (int32_t)b * 2 + (((int32_t)(uint16_t)a * b) >> 15);
+}
+
+/* sine and cosine, to within 1 part in 10000; from a quarter-wave table,
+ *  interpolated */
+q15_t fx_sin(angle_t a);
+q15_t fx_cos(angle_t a);
+
+#endif
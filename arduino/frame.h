@@ -0,0 +1 @@
+../protocol/frame.h
\ No newline at end of file
@@ -12,13 +12,14 @@ extern "C" {
 }
 
 #include "publish.h"
+#include "interrupt.h"
 #include "TinyGPS.h"
 
 uint8_t gps_port;
 //gps_simple::SimpleGPS gps_msg;
 //ros::Publisher gps_pub("gps", &gps_msg);
 //char gps_frame[] = "";
-Publisher<16> gps_pub('G');
+Publisher<gps_msg> gps_pub;
 
 /* initialize GPS listener on serial port */
 void gps_init(uint8_t port) {
@@ -38,17 +39,17 @@ int32_t lon;
 
 /* GPS listen thread */
 void gps_spinOnce(void) {
-   if(rx_ready(gps_port)) {
-      gps_input = rx_byte(gps_port);
-
+   while(rx_read(gps_port, &gps_input, 1)) {
       if(gps.encode(gps_input)) {
          gps.get_position(&lat, &lon);
 
          if( gps_pub.reset() ) {
-            gps_pub.append(lat);
-            gps_pub.append(lon);
+            gps_msg m;
+            m.lat = lat;
+            m.lon = lon;
+            m.ticks = get_ticks();
             // TODO: fill in rest of GPS message
-            gps_pub.finish();
+            gps_pub.publish(m);
          }
       } 
    }
@@ -8,8 +8,9 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/delay.h>
 
-#include "drivers/led.h"
+#include "i2c.h"
 
 /* design notes:
  * This library is designed to take the waiting out of dealing with I2C devices
@@ -52,264 +53,167 @@
  *  driven I2C interface for AVR
  *
  * Addresses:
- *    input addresses to function calls are 7 bits, left-aligned. the library
- *    functions override the LSB to provide the read/write address bit
+ *    input addresses are 7 bits, left-aligned. the library overrides the
+ *    LSB to provide the read/write address bit
  *
- * Read buffer:
- *    the read buffer must be supplied by the caller, and must be of adequate
- *    size. It will be passed to the callback when the read is complete.
+ * Queue:
+ *    transfers are a linked list through i2c_xfer::next; the head is the
+ *    one on the bus. When one finishes, the interrupt sends a stop and a
+ *    start together and goes straight on to the next, so a burst of queued
+ *    reads costs one interrupt per byte and nothing in between. Buffers
+ *    belong to the caller and must stay put until the status changes.
  *
- * Callbacks:
- *    callbacks will be called when the associated read or write is complete.
- *    callbacks will be called with global interrupts enabled
- *    the I2C library will be ready for another I2C operation when the callback
- *       is called
+ * Failures:
+ *    a NAK or a bus error fails the transfer and the queue moves on. A
+ *    slave that was reset or glitched part way through a read may hold SDA
+ *    low for the rest of its byte, and then every start fails or never
+ *    completes; so after a timeout, or a few failures in a row,
+ *    i2c_poll() takes the pins off the TWI, clocks SCL until SDA is free,
+ *    sends a stop, and restarts the TWI.
  */
 
-// interface code is at the bottom of the file.
-
-// state machine variables.
-//
-// state machine mode
-volatile enum { READ = 1, WRITE = 0 } i2c_mode; 
-
-uint8_t i2c_state = 0;
-uint8_t i2c_twsr = 0;
-
-uint8_t i2c_address;  // i2c slave address
-uint8_t i2c_register; // i2c slave register
-uint8_t * i2c_data;   // data to read/write from slave
-uint8_t i2c_data_sz;  // size of data to write
-uint8_t i2c_data_pos; // position in incoming data buffer
-
-uint8_t i2c_errflag;
-volatile uint8_t i2c_ready;
-
-// function pointer to use on data read completion
-void (* i2c_w_callback)(void) = 0;
-void (* i2c_r_callback)(uint8_t*) = 0;
-
-// i2c state machine functions
-void i2c_none();
-void i2cf_read();
-void i2cf_address();
-void i2cf_raddress();
-void i2cf_wstop();
-void i2cf_wdata();
-void i2cf_rstart();
-void i2cf_register();
-
-void (*i2c_next)(void) = i2c_none;
-
-// the magic ISR that makes all of this go round
-ISR(TWI_vect) {
-   //led_on();
-   // disable TWI interrupt and enable general interrupts.
-   //TWCR &= ~((1 << TWINT) | (1 << TWIE));
-   //sei();
-
-   i2c_twsr = TWSR;
-
-
-   /*
-   if( i2c_next ) {
-      i2c_next();
-   }
-   */
-   // validate i2c_next function pointer
-   if( i2c_none == i2c_next) {
-      i2c_none();
-   } else if( i2cf_read == i2c_next) {
-      i2cf_read();
-   } else if( i2cf_address == i2c_next) {
-      i2cf_address();
-   } else if( i2cf_raddress == i2c_next) {
-      i2cf_raddress();
-   } else if( i2cf_wstop == i2c_next) {
-      i2cf_wstop();
-   } else if( i2cf_wdata == i2c_next) {
-      i2cf_wdata();
-   } else if( i2cf_rstart == i2c_next) {
-      i2cf_rstart();
-   } else if( i2cf_register == i2c_next) {
-      i2cf_register();
-   } else {
-      led_on();
-   }
-
-
-   // re-enable TWI interrupts
-   //TWCR = (TWCR | (1 << TWIE)) & ~(1 << TWINT);
-   //if( ! i2c_errflag ) led_off();
-   //led_off();
-   /*
-   if( TWCR & (1 << TWINT) ) {
-      TWCR = TWCR; // reset interrupt flag if set
-   }
-   */
-}
-
-// do nothing
-void i2c_none() {
-   i2c_next = i2c_none;
-   i2c_state = 1;
-   TWCR = (1 << TWINT); // reset interrupt flag if set
-   i2c_ready = 1;
-}
-
-// error
-void i2c_err() {
-   i2c_next = i2c_none;
-   i2c_state = 2;
-   i2c_errflag = 1;
-   i2c_ready = 1;
-}
-
-void i2cf_address();
-
-void i2cf_read() {
-   if( (TWSR & 0xF8) == 0x40 ) {
-      // if we sent an address, wait for data
-      --i2c_data_sz;
-      if( i2c_data_sz > 0 ) {
-         // we want more data; transmit ack
-         TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA) | (1<<TWIE);
-      } else {
-         // the next byte will be the last
-         TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
-      }
-      i2c_next = i2cf_read;
-      i2c_state = 3;
-   } else if( (TWSR & 0xF8) == 0x50 ) {
-      // if we received data, wait for more data or nak
-      i2c_data[i2c_data_pos++] = TWDR;
-      --i2c_data_sz;
-      if( i2c_data_sz > 0 ) {
-         // we want more data; transmit ack
-         TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA) | (1<<TWIE);
-      } else {
-         // the next byte will be the last
-         TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
-      }
-      i2c_next = i2cf_read;
-      i2c_state = 4;
-   } else if( (TWSR & 0xF8) == 0x58 ) {
-      // we got our last byte and sent nak
-      i2c_data[i2c_data_pos] = TWDR;
-      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO) | (1<<TWIE);
-      i2c_ready = 1;
-      i2c_next = i2c_none;
-      i2c_state = 5;
-      sei();
-      if(i2c_r_callback) {
-         void (*tmp_callback)(uint8_t*) = i2c_r_callback;
-         i2c_r_callback = 0;
-         tmp_callback(i2c_data);
-      } else {
-         i2c_err();
-      }
-   } else if( (TWSR & 0xF8) == 0x08 ) {
-      // Start sent. shouldn't happen
-      i2c_err();
-   } else if( (TWSR & 0xF8) == 0x10 ) {
-      // repeated start sent. shouldn't happen
-      //led_on();
-      i2c_err();
-   } else if( (TWSR & 0xF8) == 0x38 ) {
-      // arbitration lost or NAK
-      i2c_err();
-   } else if( (TWSR & 0xF8) == 0x48 ) {
-      // SLA+R sent; NAK received
-      // generate a stop condition
-      //TWCR = (1<<TWSTA) | (1<<TWSTO) | (1<<TWINT);
-      //i2c_next = i2cf_address;
-      i2c_err();
-      i2c_state = 6;
-   } else {
-      i2c_err();
+#define SCL (1 << 0) // PD0
+#define SDA (1 << 1) // PD1
+
+#define TWCR_GO ((1<<TWINT) | (1<<TWEN) | (1<<TWIE))
+
+uint8_t i2c_fail = 0;
+uint8_t i2c_resets = 0;
+
+// the queue; head is on the bus
+struct i2c_xfer * volatile i2c_head = 0;
+struct i2c_xfer * i2c_tail = 0;
+
+uint8_t i2c_pos; // bytes of the head transfer read or written
+
+// the head was queued while the last stop was still going out, and has not
+//  been started
+volatile uint8_t i2c_waiting = 0;
+
+// for i2c_poll: transfers started and failures in a row, kept by the
+//  interrupt, and when the start count last changed
+volatile uint8_t i2c_starts = 0;
+volatile uint8_t i2c_fails_run = 0;
+uint8_t i2c_poll_starts = 0;
+uint32_t i2c_poll_since = 0;
+
+/* start the head transfer; interrupts off. Not while a stop is still going
+ *  out: that takes a bit time or two (2.5us each at 400kHz), so wait a
+ *  little, and past that leave it for i2c_poll to start once the stop has
+ *  gone, or to reset the bus if it never does */
+static void i2c_start(void) {
+   uint8_t i;
+   for( i=0; i<10 && (TWCR & (1<<TWSTO)); i++ ) _delay_us(2);
+   if( TWCR & (1<<TWSTO) ) {
+      i2c_waiting = 1;
+      return;
    }
+   i2c_waiting = 0;
+   i2c_pos = 0;
+   ++i2c_starts;
+   TWCR = TWCR_GO | (1<<TWSTA);
 }
 
-// send i2c read address
-void i2cf_raddress() {
-   if( (TWSR & 0xF8) == 0x10 ) {
-      TWDR = i2c_address | 1;
-      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
-      i2c_next = i2cf_read;
-      i2c_state = 7;
+// finish the head transfer and start the next, if any; interrupts off
+static void i2c_finish(uint8_t status) {
+   struct i2c_xfer * x = i2c_head;
+   if( status == I2C_DONE ) {
+      i2c_fails_run = 0;
    } else {
-      i2c_err();
+      ++i2c_fail;
+      ++i2c_fails_run;
    }
-}
-
-// send repeated start condition
-void i2cf_rstart() {
-   if( (TWSR & 0xF8) == 0x28 ) {
-      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTA) | (1<<TWIE);
-      i2c_next = i2cf_raddress;
-      i2c_state = 8;
+   i2c_head = x->next;
+   x->status = status;
+
+   if( i2c_head && i2c_fails_run < I2C_MAX_FAILS ) {
+      // stop, then start
+      i2c_pos = 0;
+      ++i2c_starts;
+      TWCR = TWCR_GO | (1<<TWSTO) | (1<<TWSTA);
    } else {
-      i2c_err();
+      // stop; the queue waits for i2c_poll if it is failing
+      TWCR = TWCR_GO | (1<<TWSTO);
    }
 }
 
-// send stop condition
-void i2cf_wstop() {
-   TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO) | (1<<TWIE);
-   i2c_ready = 1;
-   i2c_next = i2c_none;
-   i2c_state = 9;
-   sei();
-   if(i2c_w_callback) {
-      void (*tmp_cb)(void) = i2c_w_callback;
-      i2c_w_callback = 0;
-      tmp_cb();
-   } 
-}
-
-// write i2c data
-void i2cf_wdata() {
-   if( (TWSR & 0xF8) == 0x28 ) {
-      TWDR = *i2c_data;
-      ++i2c_data;
-      --i2c_data_sz;
-      if( i2c_data_sz == 0 ) {
-         i2c_next = i2cf_wstop;
-         i2c_state = 10;
-      }
-      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
-   } else {
-      i2c_err();
+ISR(TWI_vect) {
+   struct i2c_xfer * x = i2c_head;
+   if( !x ) {
+      TWCR = TWCR_GO | (1<<TWSTO);
+      return;
    }
-}
 
-// write i2c register
-void i2cf_register() {
-   if( (TWSR & 0xF8) == 0x18 ) {
-      TWDR = i2c_register;
-      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
-      if( i2c_mode == WRITE ) {
-         i2c_next = i2cf_wdata;
-         i2c_state = 11;
-      } else {
-         i2c_next = i2cf_rstart;
-         i2c_state = 12;
-      }
-   } else {
-      i2c_err();
+   switch( TWSR & 0xF8 ) {
+      case 0x08: // start sent; address the device to write the register
+         TWDR = x->addr & ~1;
+         TWCR = TWCR_GO;
+         break;
+      case 0x18: // SLA+W acked; send the register
+         TWDR = x->reg;
+         TWCR = TWCR_GO;
+         break;
+      case 0x28: // byte acked
+         if( x->read ) {
+            // the register is set; repeated start to read from it
+            TWCR = TWCR_GO | (1<<TWSTA);
+         } else if( i2c_pos < x->size ) {
+            TWDR = x->buf[i2c_pos++];
+            TWCR = TWCR_GO;
+         } else {
+            i2c_finish(I2C_DONE);
+         }
+         break;
+      case 0x10: // repeated start sent
+         TWDR = x->addr | 1;
+         TWCR = TWCR_GO;
+         break;
+      case 0x40: // SLA+R acked; ack every byte but the last
+         TWCR = x->size > 1 ? TWCR_GO | (1<<TWEA) : TWCR_GO;
+         break;
+      case 0x50: // byte received and acked
+         x->buf[i2c_pos++] = TWDR;
+         TWCR = i2c_pos + 1 < x->size ? TWCR_GO | (1<<TWEA) : TWCR_GO;
+         break;
+      case 0x58: // last byte received and naked
+         x->buf[i2c_pos] = TWDR;
+         i2c_finish(I2C_DONE);
+         break;
+      default:
+         // 0x20, 0x30, 0x48: NAK; 0x38: arbitration lost; 0x00: bus error
+         i2c_finish(I2C_FAILED);
+         break;
    }
 }
 
-// write i2c address
-void i2cf_address() {
-   if( (TWSR & 0xF8) == 0x08 ) {
-      TWDR = i2c_address;
-      TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
-      i2c_next = i2cf_register;
-      i2c_state = 13;
-   } else {
-      i2c_err();
+// free a stuck bus, and restart the TWI; interrupts off
+static void i2c_recover(void) {
+   uint8_t i;
+   TWCR = 0; // the pins are plain I/O again
+
+   /* the pins are open drain: low is output (PORTD is low), high is input,
+    *  pulled up */
+   DDRD &= ~(SCL | SDA);
+   _delay_us(5);
+   // a slave holding SDA low has at most a byte and its ack left to send
+   for( i=0; i<9 && !(PIND & SDA); i++ ) {
+      DDRD |= SCL;
+      _delay_us(5);
+      DDRD &= ~SCL;
+      _delay_us(5);
    }
+   // stop: SDA rises while SCL is high
+   DDRD |= SCL;
+   DDRD |= SDA;
+   _delay_us(5);
+   DDRD &= ~SCL;
+   _delay_us(5);
+   DDRD &= ~SDA;
+   _delay_us(5);
+
+   ++i2c_resets;
+   i2c_fails_run = 0;
+   TWCR = (1<<TWEN);
 }
 
 void i2c_init() {
@@ -323,97 +227,56 @@ void i2c_init() {
    TWSR = 1; // prescaler /4
 
    // set up I/O pins
-   DDRD &= ~(3);
-   PORTD &= ~(3);
+   DDRD &= ~(SCL | SDA);
+   PORTD &= ~(SCL | SDA);
 
-   TWCR = 0;
+   TWCR = (1<<TWEN);
 
-   i2c_next = i2c_none;
-   i2c_state = 14;
-   i2c_ready = 1;
+   i2c_head = 0;
+   i2c_tail = 0;
+   i2c_waiting = 0;
 }
 
-// overall bus functions should wait for TWSTO to become unset before writing
-// to TWCR
-
-// write a single byte to a register in an I2C device
-void i2c_write(uint8_t addr, uint8_t reg, uint8_t data) {
-   while(!i2c_ready); // wait for I2C to become ready
-   while(TWCR & (1<<TWSTO) ); // wait for stop bit to become clear
-   i2c_mode = WRITE;
-   i2c_address = addr;
-   i2c_register = reg;
-
-   // use i2c_data_pos as temporary
-   i2c_data_pos = data;
-   i2c_data = &i2c_data_pos;
-   i2c_data_sz = 1;
-
-   //led_off();
-   i2c_errflag = 0;
-   i2c_ready = 0;
-
-   i2c_next = i2cf_address;
-   i2c_state = 15;
+int8_t i2c_submit(struct i2c_xfer * x) {
+   if( x->status == I2C_QUEUED || (x->read && x->size == 0) ) return -1;
+   x->status = I2C_QUEUED;
+   x->next = 0;
 
-   // start I2C mode by sending start bit
-   TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTA) | (1<<TWIE);
-}
-
-// write multiple bytes and call a callback when done
-void i2c_writem( uint8_t addr, uint8_t reg, uint8_t * data, uint8_t size, 
-      void(*cb)(void)) {
-   while(!i2c_ready); // wait for I2C to become ready
-   while(TWCR & (1<<TWSTO) ); // wait for stop bit to become clear
-   i2c_mode = WRITE;
-   i2c_address = addr;
-   i2c_register = reg;
-   i2c_data = data;
-   i2c_data_sz = size;
-   i2c_w_callback = cb;
-
-   //led_off();
-   i2c_errflag = 0;
-   i2c_ready = 0;
-
-   i2c_next = i2cf_address;
-   i2c_state = 16;
-
-   // start I2C mode by sending start bit
-   TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTA) | (1<<TWIE);
+   uint8_t sreg = SREG;
+   cli();
+   if( i2c_head ) {
+      i2c_tail->next = x;
+      i2c_tail = x;
+   } else {
+      i2c_head = i2c_tail = x;
+      i2c_start();
+   }
+   SREG = sreg;
+   return 0;
 }
 
-// read bytes from an I2C device into a buffer and call a callback when done
-int8_t i2c_read(uint8_t addr, uint8_t reg, uint8_t * buf, uint8_t size, 
-      void(*cb)(uint8_t *)) {
-   uint16_t timeout = 0x0FFF;
-   // wait for I2C to become ready
-   while(!i2c_ready && timeout > 0) {
-      --timeout;
+void i2c_poll(uint32_t now) {
+   uint8_t sreg = SREG;
+   cli();
+   if( i2c_waiting ) i2c_start();
+   if( !i2c_head || i2c_starts != i2c_poll_starts ) {
+      // idle, or moving
+      i2c_poll_starts = i2c_starts;
+      i2c_poll_since = now;
    }
-   if(!i2c_ready) {
-      led_on();
-      return -1;
+   if( i2c_head && (i2c_fails_run >= I2C_MAX_FAILS ||
+            now - i2c_poll_since >= I2C_TIMEOUT) ) {
+      struct i2c_xfer * x = i2c_head;
+      if( i2c_fails_run < I2C_MAX_FAILS && !i2c_waiting ) {
+         // the head hung part way; what's left has had no chance to fail
+         i2c_head = x->next;
+         x->status = I2C_FAILED;
+         ++i2c_fail;
+      }
+      i2c_recover();
+      if( i2c_head ) i2c_start();
+      i2c_poll_starts = i2c_starts;
+      i2c_poll_since = now;
    }
-   led_off();
-   while(TWCR & (1<<TWSTO) ); // wait for stop bit to become clear
-   i2c_mode = READ;
-   i2c_address = addr;
-   i2c_register = reg;
-   i2c_data = buf;
-   i2c_data_sz = size;
-   i2c_data_pos = 0;
-   i2c_r_callback = cb;
-
-   //led_off();
-   i2c_errflag = 0;
-   i2c_ready = 0;
-
-   i2c_next = i2cf_address;
-   i2c_state = 17;
-
-   // start I2C mode by sending start bit
-   TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTA) | (1<<TWIE);
-   return 0;
+   SREG = sreg;
 }
-
@@ -1,7 +1,10 @@
 /* i2c.h
  *
- * custom I2C library based on function pointers. mostly becuase I'm crazy. 
- *  Of course, it _might_ be more efficient. It's hard to say at this point.
+ * Queued, interrupt-driven I2C master. Callers describe each transfer with
+ *  an i2c_xfer, which they own along with its buffer, and queue it with
+ *  i2c_submit(); the driver works through the queue in order from the TWI
+ *  interrupt, and sets each transfer's status when it finishes. Nothing
+ *  waits on the bus, and nothing runs in the interrupt but the transfers.
  *
  * Author: Austin Hendrix
  */
@@ -11,17 +14,41 @@
 
 #include <stdint.h>
 
+// i2c_xfer status
+#define I2C_IDLE 0   // never queued
+#define I2C_QUEUED 1 // waiting or in progress; the driver owns the transfer
+#define I2C_DONE 2
+#define I2C_FAILED 3 // NAK, bus error, or timed out
+
+/* a write of size bytes from buf to registers reg and up of the device at
+ *  addr (7 bits, left-aligned), or a read of them into buf: a burst, as
+ *  these devices step through their registers */
+struct i2c_xfer {
+   uint8_t addr;
+   uint8_t reg;
+   uint8_t read; // 1 to read, 0 to write
+   uint8_t size;
+   uint8_t * buf;
+   volatile uint8_t status;
+   struct i2c_xfer * next; // the driver's
+};
+
+// ms a transfer may take before the bus is reset
+#define I2C_TIMEOUT 5
+// failures in a row before the bus is reset
+#define I2C_MAX_FAILS 3
+
 void i2c_init();
 
-// write a single byte to a register in an I2C device
-void i2c_write(uint8_t addr, uint8_t reg, uint8_t data);
+// queue a transfer; -1 if it is already queued, or a read of nothing
+int8_t i2c_submit(struct i2c_xfer * x);
 
-// write multiple bytes and call a callback when done
-void i2c_writem( uint8_t addr, uint8_t reg, uint8_t * data, uint8_t size, 
-      void(*cb)(void));
+/* check on the bus, with the time in ms; if a transfer has hung or too
+ *  many have failed, fail it, clock out any stuck slave, and carry on with
+ *  the queue. Call every few ms while transfers are queued */
+void i2c_poll(uint32_t now);
 
-// read bytes from an I2C device into a buffer and call a callback when done
-uint8_t i2c_read(uint8_t addr, uint8_t reg, uint8_t * buf, uint8_t size, 
-      void(*cb)(uint8_t *));
+extern uint8_t i2c_fail;   // failed transfers; wraps
+extern uint8_t i2c_resets; // bus resets; wraps
 
 #endif
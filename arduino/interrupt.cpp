@@ -1,9 +1,11 @@
 /*
  * New interrupt-based wheel and speed management; replaces the RTOS
+ *
+ * The tick interrupt only counts ticks and captures wheel sensor edges;
+ *  speed control and odometry run as main loop tasks (see scheduler.h).
  */
 
 #include <avr/interrupt.h>
-#include <math.h>
 
 extern "C" {
 #include "drivers/serial.h"
@@ -12,14 +14,15 @@ extern "C" {
 #include "estop.h"
 }
 
-#include "steer.h"
+#include "odom.h"
 #include "imu.h"
 #include "publish.h"
 #include "twist.h"
+#include "interrupt.h"
 
 #define abs(x) ((x)>0?(x):-(x))
 
-uint32_t ticks = 0;
+volatile uint32_t ticks = 0;
 
 uint8_t input, input_old;
 
@@ -32,25 +35,41 @@ uint8_t input, input_old;
 
 #define WHEELDIV 2000
 
-// wheel counter variables
-uint16_t lcnt = 0;
-uint16_t rcnt = 0;
-int16_t qcnt = 0;
+// wheel sensor state, written by the tick interrupt; read with interrupts off
+//  through encoder_read()
+// ticks since the last edge on each sensor, stopping at WHEELDIV+1
+uint16_t lcnt = WHEELDIV+1;
+uint16_t rcnt = WHEELDIV+1;
+uint16_t qcnt = WHEELDIV+1;
+// ticks between the last two edges
+uint16_t lperiod = WHEELDIV+1;
+uint16_t rperiod = WHEELDIV+1;
+uint16_t qperiod = WHEELDIV+1;
+uint8_t qforward = 1; // direction of the last quadrature edge
 
-uint8_t q1;
-uint8_t q2;
-
-volatile uint16_t lspeed; /* left wheel speed (Hz) */
-volatile uint16_t rspeed; /* right wheel speed (Hz) */
 volatile uint16_t lcount; /* left wheel count, revolutions */
 volatile uint16_t rcount; /* right wheel count, revolutions */
+volatile int16_t qcount; /* quaderature encoder 1/4 turn count */
 
+// computed from the above by encoder_read()
+volatile uint16_t lspeed; /* left wheel speed (Hz) */
+volatile uint16_t rspeed; /* right wheel speed (Hz) */
 volatile int16_t qspeed; /* quaderature encoder speed */
-volatile int16_t qcount; /* quaderature encoder 1/4 turn count */
 
-float x, y, yaw; /* position */
+// longest time from a tick to the end of its interrupt since the last
+//  tick_isr_max() (timer counts); TICK_OVERRUN once the interrupt has run
+//  into the next tick
+uint8_t tick_isr_worst = 0;
+#define TICK_OVERRUN 0xFF
+
+// the odometry slot within ODOM_PERIOD, counted here rather than with a
+//  32-bit modulus on ticks
+uint8_t odom_phase = 0;
+
+pose odom_pose;
 int16_t old_qcount; /* for updating odometry output */
 
+// power and mult are fixed point, DIV to the unit
 #define DIV 256
 
 // speed management variables
@@ -64,14 +83,42 @@ int16_t e = 0; // error
 // odometry transmission variables
 volatile uint16_t odom_sz = 0;
 volatile int8_t steer;
-// (5 floats + overhead)*2 = 64
-Publisher<64> odom('O');
+Publisher<odometry_msg> odom(TX_RT);
 
-// 0.03 meters per tick
-#define Q_SCALE 0.032
+// mm/s per unit of qspeed; Q_SCALE (0.032m) * 0.5 * 1000
+#define Q_SPEED_MM 16
+int16_t odom_speed = 0;
 
 uint16_t estop_cnt = 0;
 
+uint32_t get_ticks(void) {
+   uint8_t sreg = SREG;
+   cli();
+   uint32_t t = ticks;
+   SREG = sreg;
+   return t;
+}
+
+uint32_t clock_us(void) {
+   uint8_t sreg = SREG;
+   cli();
+   uint32_t t = ticks;
+   uint8_t c = TCNT0;
+   // the timer wrapped but its interrupt hasn't run yet
+   if( (TIFR0 & (1 << TOV0)) && c < 125 ) t++;
+   SREG = sreg;
+   return t * 1000 + c * 4;
+}
+
+uint16_t tick_isr_max(void) {
+   uint8_t sreg = SREG;
+   cli();
+   uint8_t c = tick_isr_worst;
+   tick_isr_worst = 0;
+   SREG = sreg;
+   return c == TICK_OVERRUN ? 0xFFFF : c * 4;
+}
+
 /* set up interrupt handling */
 void interrupt_init(void) {
    estop_init();
@@ -93,194 +140,180 @@ void interrupt_init(void) {
    OCR0A  = 249; // 250 counts per tick
 }
 
+// speed from the period between edges, and the time since the last one
+static uint16_t edge_speed(uint16_t period, uint16_t cnt) {
+   if( cnt > WHEELDIV ) return 0;
+   if( cnt > period ) period = cnt;
+   if( period < 1 ) period = 1;
+   return WHEELDIV/period;
+}
+
+/* snapshot the wheel sensors and update the wheel speeds; returns the
+ *  quadrature count */
+static int16_t encoder_read(void) {
+   uint8_t sreg = SREG;
+   cli();
+   uint16_t lp = lperiod, lc = lcnt;
+   uint16_t rp = rperiod, rc = rcnt;
+   uint16_t qp = qperiod, qc = qcnt;
+   uint8_t fwd = qforward;
+   int16_t q = qcount;
+   SREG = sreg;
+
+   lspeed = edge_speed(lp, lc);
+   rspeed = edge_speed(rp, rc);
+   if( fwd ) {
+      qspeed = edge_speed(qp, qc);
+   } else {
+      qspeed = -edge_speed(qp, qc);
+   }
+   return q;
+}
+
 /* interrupt routine */
 /* TIMER0 OVF */
+// only counts ticks and captures wheel sensor edges, so that it is short
+//  enough to never delay itself past the next tick and miss an edge;
+//  everything that uses the edges runs as a main loop task
 ISR(TIMER0_OVF_vect) {
+   /* read sensors early so we don't get jitter */
+   input = PINC;
    ticks++;
-   // every time; read wheel sensors and compute counts and speed.
-   {
-      /* read sensors early so we don't get jitter */
-      input = PINC;
-
-      // enable nested interrupts now that we've read our input
-      sei();
-
-      /* read wheel sensors and update computed wheel speed */
-      if( ~(input ^ input_old) & L ) {
-         lcnt++;
-         if( lspeed > WHEELDIV/lcnt ) lspeed = WHEELDIV/lcnt;
-         if( lcnt > WHEELDIV+1) {
-            lcnt = WHEELDIV+1;
-            lspeed = 0;
-         }
-      } else {
-         if(input & L) lcount++;
-         lspeed = WHEELDIV/lcnt;
-         lcnt = 0;
-      }
 
-      if( ~(input ^ input_old) & R ) {
-         rcnt++;
-         if( rspeed > WHEELDIV/rcnt ) rspeed = WHEELDIV/rcnt;
-         if( rcnt > WHEELDIV+1 ) {
-            rcnt = WHEELDIV+1;
-            rspeed = 0;
-         }
-      } else {
-         if(input & R) rcount++;
-         rspeed = WHEELDIV/rcnt;
-         rcnt = 0;
-      }
+   uint8_t changed = input ^ input_old;
+   input_old = input;
 
-      q1 = (input >> 5) & 0x1;
-      q2 = (input >> 4) & 0x1;
-      /* read the quaderature encoder on the drive gear to get better
-         direction and speed data */
-      if( (input ^ input_old) & Q1 ) { // Q1 change
-         if( q1 == q2 ) { // q1 == q2
-            // turning forward
-            qspeed = WHEELDIV/qcnt;
-            qcount++;
-         } else {
-            // turning backward
-            qspeed = -(WHEELDIV/qcnt);
-            qcount--;
-         }
-         qcnt = 0;
-      } else if( (input ^ input_old) & Q2 ) { // Q2 change
-         if( q1 == q2 ) { // q1 == q2
-            // turning backward
-            qspeed = -(WHEELDIV/qcnt);
-            qcount--;
-         } else {
-            // turning forward
-            qspeed = WHEELDIV/qcnt;
-            qcount++;
-         }
-         qcnt = 0;
-      } else {
-         qcnt++;
-         if( qcnt > WHEELDIV+1 ) {
-            qcnt = WHEELDIV+1;
-            qspeed = 0;
-         } else if( qspeed > 0 ) {
-            if( qspeed > WHEELDIV/qcnt ) qspeed = WHEELDIV/qcnt;
-         } else {
-            if( qspeed < -(WHEELDIV/qcnt) ) qspeed = -(WHEELDIV/qcnt);
-         }
-      }
-      input_old = input;
+   if( changed & L ) {
+      if(input & L) lcount++;
+      lperiod = lcnt;
+      lcnt = 0;
+   } else if( lcnt <= WHEELDIV ) {
+      lcnt++;
    }
-   // end wheel encoder processing
 
-   // speed management; run at 10Hz
-   const static int16_t Kp = DIV/16; // proportional constant
-   if( ticks % 100 == 0 ) {
-      // E-stop
-      if( estop() ) {
-         estop_cnt = 30;
+   if( changed & R ) {
+      if(input & R) rcount++;
+      rperiod = rcnt;
+      rcnt = 0;
+   } else if( rcnt <= WHEELDIV ) {
+      rcnt++;
+   }
+
+   /* read the quaderature encoder on the drive gear to get better
+      direction and speed data */
+   if( changed & (Q1 | Q2) ) {
+      uint8_t q1 = (input >> 5) & 0x1;
+      uint8_t q2 = (input >> 4) & 0x1;
+      // on a Q1 edge the channels match turning forward; on a Q2 edge
+      //  they differ
+      qforward = (changed & Q1) ? (q1 == q2) : (q1 != q2);
+      if( qforward ) {
+         qcount++;
+      } else {
+         qcount--;
       }
+      qperiod = qcnt;
+      qcnt = 0;
+   } else if( qcnt <= WHEELDIV ) {
+      qcnt++;
+   }
 
-      if( estop_cnt == 0 ) {
-         led_on();
-         // reflex: stop if we bump into something
-         if( target_speed > 0 && bump() ) {
-            power = 0;
-         } else {
-            speed = qspeed;
+   // keep bulk traffic to the brain out of the odometry slot
+   if( ++odom_phase >= ODOM_PERIOD ) odom_phase = 0;
+   tx_slot(BRAIN, (ODOM_PERIOD + ODOM_PHASE - odom_phase) % ODOM_PERIOD);
 
-            e = target_speed - speed; 
+   /* the counter wraps at each tick, so it can't show an overrun by
+    *  itself; if the next tick is already pending, the interrupt has run
+    *  past it */
+   uint8_t c = TCNT0;
+   if( TIFR0 & (1 << TOV0) ) c = TICK_OVERRUN;
+   if( c > tick_isr_worst ) tick_isr_worst = c;
+}
 
-            if( target_speed != 0 ) {
-               e = Kp * e / target_speed;
-               if( e > DIV ) e = DIV;
-               if( e < -DIV ) e = -DIV;
-               mult += e;
-            } else {
-               mult = DIV/2;
-            }
+// speed management; run at 10Hz
+void speed_control(void) {
+   const static int16_t Kp = DIV/16; // proportional constant
+   encoder_read();
 
-            if( mult < 1 ) mult = 1;
-            if( abs(mult*target_speed) > 100*DIV ) 
-               mult = 100*DIV/target_speed;
+   // E-stop
+   if( estop() ) {
+      estop_cnt = 30;
+   }
 
-            power = mult * (double)target_speed;
-         }
-      } else {
-         --estop_cnt;
-         led_off();
+   if( estop_cnt == 0 ) {
+      led_on();
+      // reflex: stop if we bump into something
+      if( target_speed > 0 && bump() ) {
          power = 0;
-      }
+      } else {
+         int16_t target = target_speed;
+         speed = qspeed;
 
-      // output
-      motor_speed(power/DIV);
-   }
+         // 32 bits, since Kp * e and mult * target overflow 16
+         int32_t err = target - speed;
 
-   // wheel encoder and speed transmit; 20Hz
-   // wheel encoder and speed transmit; 10Hz
-   if( ticks % 100 == 0 ) {
-      double r = steer2radius(steer);
-
-      float speed = qspeed * (Q_SCALE * 0.5);
-
-      // if we've moved, update position
-      if( old_qcount != qcount ) {
-         float d = (qcount - old_qcount) * Q_SCALE;
-         float dx, dy, dt;
-         if( steer == 0 ) {
-            dx = d * cos(yaw);
-            dy = d * sin(yaw);
-            dt = 0.0;
+         if( target != 0 ) {
+            err = Kp * err / target;
+            if( err > DIV ) err = DIV;
+            if( err < -DIV ) err = -DIV;
+            mult += err;
          } else {
-            dt = d / r;
-            float theta_c1;
-            float theta_c2;
-            if( steer > 0 ) {
-               // turning right
-               theta_c1 = yaw + M_PI/2;
-            } else {
-               // turning left
-               dt = -dt;
-               theta_c1 = yaw - M_PI/2;
-            }
-            theta_c2 = theta_c1 - dt;
-
-            dx = r * (cos(theta_c2) - cos(theta_c1));
-            dy = r * (sin(theta_c2) - sin(theta_c1));
+            mult = DIV/2;
          }
+         e = err;
 
-         x += dx;
-         y += dy;
-         yaw -= dt; // TODO: figure out why this sign is flipped
+         if( mult < 1 ) mult = 1;
+         int32_t p = (int32_t)mult * target;
+         if( abs(p) > 100*DIV ) {
+            mult = 100*DIV / abs(target);
+            p = (int32_t)mult * target;
+         }
 
-         old_qcount = qcount;
+         power = p;
       }
+   } else {
+      --estop_cnt;
+      led_off();
+      power = 0;
+   }
 
-      if(odom.reset() ) {
-         odom.append(speed); // linear speed
-         if( steer == 0 ) {
-            odom.append(0.0f);
-         } else {
-            odom.append((float)(speed / r)); // angular speed
-         }
-         // odom position in odom frame
-         odom.append(x);
-         odom.append(y);
-
-         extern Twist imu_state;
-         yaw = (yaw + imu_state.angular.z) / 2.0;
-         //yaw = imu_state.angular.z;
-         odom.append(yaw);
-         odom.append(bump());
-         // odom: total of 5 floats; 4*5 = 20 bytes
-         odom.finish();
-      }
+   // output
+   motor_speed(power/DIV);
+}
+
+// wheel encoder and speed transmit; 50Hz
+void odometry(void) {
+   uint32_t now = get_ticks();
+   int16_t q = encoder_read();
+   int8_t s = steer;
+
+   int16_t speed = qspeed * Q_SPEED_MM; // mm/s
+   odom_speed = speed;
+
+   // if we've moved, update position
+   if( old_qcount != q ) {
+      pose_move(odom_pose, q - old_qcount, s);
+      old_qcount = q;
+   }
+
+   // blend in the IMU heading at 10Hz, as before
+   static uint8_t blend = 0;
+   if( ++blend >= 100 / ODOM_PERIOD ) {
+      blend = 0;
+      extern Twist imu_state;
+      pose_blend_yaw(odom_pose, ANGLE(imu_state.angular.z));
    }
 
-   // IMU and GPS loop; run at 20Hz.
-   // run at a time when the odometry calculations aren't running
-   if( ticks % 50 == 24 ) {
-   //if( ticks % 20 == 0 ) {
-      imu_read(); // read the IMU
+   if(odom.reset() ) {
+      odometry_msg m;
+      m.linear = speed; // linear speed
+      m.angular = angular_speed(speed, s); // mrad/s
+      // odom position in odom frame, mm
+      m.x = mul_q16(odom_pose.x, 1000);
+      m.y = mul_q16(odom_pose.y, 1000);
+      m.yaw = pose_yaw_mrad(odom_pose);
+      m.ticks = now;
+      m.bump = bump();
+      odom.publish(m);
    }
 }
@@ -8,6 +8,31 @@
 
 void interrupt_init(void);
 
+// odometry output period in ticks (ms): 50Hz, and its offset in the period
+#define ODOM_PERIOD 20
+#define ODOM_PHASE 10
+// speed control period in ticks: 10Hz
+#define CONTROL_PERIOD 100
+
+// main loop tasks for the wheels
+void speed_control(void);
+void odometry(void);
+
+// forward speed from the encoder as of the last odometry run (mm/s)
+extern int16_t odom_speed;
+
+// longest time from a tick to the end of its interrupt since the last call
+//  (us); 0xFFFF if it ran into the next tick, which may then be missed
+uint16_t tick_isr_max(void);
+
 extern volatile uint32_t ticks;
 
+// ticks, read with interrupts off so that all four bytes agree; for use
+//  outside interrupt handlers
+uint32_t get_ticks(void);
+
+// microseconds since boot, to the 4us resolution of the tick timer; wraps
+//  every 71 minutes
+uint32_t clock_us(void);
+
 #endif
@@ -9,8 +9,6 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
-#include <util/delay.h>
-
 extern "C" {
 #include "drivers/pwm.h"
 #include "motor.h"
@@ -23,6 +21,7 @@ extern "C" {
 #include "speedman.h"
 #include "drivers/bump.h"
 #include "drivers/led.h"
+#include "i2c.h"
 }
 
 #include "twist.h"
@@ -31,16 +30,15 @@ extern "C" {
 #include "gps.h"
 #include "steer.h"
 #include "imu.h"
+#include "protocol.h"
 #include "publish.h"
+#include "scheduler.h"
 
 #define CLK 16000
 
 // was 119
 #define STEER_OFFSET 115
 
-extern uint8_t i2c_state; // DEBUG
-extern uint8_t i2c_twsr; // DEBUG
-
 extern volatile int8_t steer;
 extern volatile uint32_t ticks;
 
@@ -58,10 +56,10 @@ extern "C" {
    }
 }
 
-char sub_buffer[256];
-//uint8_t sub_pos = 0;
-Packet sub_p(0, 200, sub_buffer);
-char sub_type = 0;
+// the frame being received from the brain; its length keeps counting past
+//  the end of the buffer so that an oversize frame is dropped whole
+uint8_t sub_buffer[FRAME_MAX_ENCODED];
+uint16_t sub_len = 0;
 
 // control modes
 #define STOP 0
@@ -70,46 +68,57 @@ char sub_type = 0;
 char control_mode = AUTONOMOUS;
 
 // callback on cmd_vel
-void vel_cb(Packet & p) {
-   // TODO: assert packet size
+void vel_cb(const command_msg & cmd) {
    if( AUTONOMOUS == control_mode ) {
-      target_speed = p.reads16();
+      target_speed = cmd.speed;
 
-      steer = p.reads8();
+      steer = cmd.steer;
       servo_set(0, steer + STEER_OFFSET);
    }
 }
 
 uint32_t last_heartbeat = -1000;
 uint8_t pub_enable = 0;
+Publisher<time_msg> time_pub(TX_RT);
+
+// take one byte from the brain; decode and dispatch at each delimiter
+void sub_byte(uint8_t b) {
+   if( b != FRAME_DELIMITER ) {
+      if( sub_len < sizeof(sub_buffer) ) sub_buffer[sub_len] = b;
+      if( sub_len <= sizeof(sub_buffer) ) sub_len++;
+      return;
+   }
+   // end of frame; anything too long or corrupt is dropped
+   frame f;
+   if( sub_len > 0 && sub_len < sizeof(sub_buffer) &&
+         frame_decode(sub_buffer, sub_len, f) == FRAME_OK ) {
+      command_msg cmd;
+      heartbeat_msg hb;
+      if( decode(f, cmd) ) {
+         vel_cb(cmd);
+      } else if( decode(f, hb) ) {
+         last_heartbeat = get_ticks();
+         // answer with our clock, so the host can map our timestamps
+         //  onto its own
+         if( pub_enable && time_pub.reset() ) {
+            time_msg t;
+            t.heartbeat = f.seq;
+            t.ticks = last_heartbeat;
+            time_pub.publish(t);
+         }
+      }
+   }
+   sub_len = 0;
+}
 
 // subscriber spin loop
 void sub_spinOnce() {
-   while(rx_ready(BRAIN)) {
-      char b = rx_byte(BRAIN);
-      if( sub_type == 0 ) {
-         sub_type = b;
-      } else {
-         sub_p.input(b);
-         // if we got the end-of-packet flag
-         if( b == '\r' ) {
-            switch(sub_type) {
-               case 'C':
-                  vel_cb(sub_p);
-                  break;
-               case 'H':
-                  // heartbeat
-                  last_heartbeat = ticks;
-                  break;
-               default:
-                  break;
-            }
-            sub_p.reset();
-            sub_type = 0;
-         }
-      }
+   uint8_t chunk[32];
+   uint8_t n;
+   while( (n = rx_read(BRAIN, chunk, sizeof(chunk))) > 0 ) {
+      for( uint8_t i=0; i<n; i++ ) sub_byte(chunk[i]);
    }
-   pub_enable = (ticks - last_heartbeat) < 1000;
+   pub_enable = (get_ticks() - last_heartbeat) < 1000;
 }
 
 char bt_buffer[256];
@@ -155,10 +164,61 @@ void bt_spinOnce() {
    }
 }
 
-// publish idle time data
-uint16_t idle;
-Publisher<16> idle_pub('I');
-uint32_t idle_last = 0;
+// publish idle time, link and I2C health, and task timing
+Publisher<idle_msg> idle_pub;
+Publisher<task_msg> task_pub;
+uint32_t status_last = 0;
+
+void status_spinOnce();
+
+// watch the I2C bus: start a transfer held back by a stop, and reset the
+//  bus within a few ms of a hang rather than at the next IMU read
+void i2c_spinOnce() {
+   i2c_poll(get_ticks());
+}
+
+// main loop tasks, in the order of task_msg
+task tasks[NUM_TASKS] = {
+   // function      period          phase       deadline (ms)
+   { gps_spinOnce,    10,             0,          10 },
+   { sub_spinOnce,    1,              0,          2 },
+   // at the sensors' data rate, clear of the odometry and speed control
+   //  ticks
+   { imu_read,        20,             4,          10 },
+   // sonar isn't fitted; give it a period of 10 to run it
+   { sonar_spinOnce,  0,              0,          10 },
+   { status_spinOnce, 1000,           500,        100 },
+   // moved out of the tick interrupt; odometry has the tightest deadline so
+   //  that it makes its transmit slot
+   { speed_control,   CONTROL_PERIOD, 0,          10 },
+   { odometry,        ODOM_PERIOD,    ODOM_PHASE, 1 },
+   { i2c_spinOnce,    2,              1,          2 },
+};
+
+void status_spinOnce() {
+   uint32_t now = clock_us();
+   uint32_t elapsed = now - status_last;
+   status_last = now;
+
+   if( idle_pub.reset() ) {
+      idle_msg m;
+      m.idle = scheduler_idle() * 1000 / elapsed;
+      m.i2c_fail = i2c_fail;
+      m.i2c_resets = i2c_resets;
+      m.tx_dropped = tx_dropped(BRAIN);
+      m.tx_deferred = tx_deferred(BRAIN);
+      idle_pub.publish(m);
+   } else {
+      scheduler_idle();
+   }
+
+   if( task_pub.reset() ) {
+      task_msg m;
+      task_report(tasks, NUM_TASKS, m.wcet, m.overruns);
+      m.tick_isr = tick_isr_max();
+      task_pub.publish(m);
+   }
+}
 
 int main() {
    pwr_on();
@@ -193,7 +253,7 @@ int main() {
 
    sei(); // enable interrupts
 
-   // imu initialization requires interrupts to be enabled.
+   // queues the sensor settings; they go out once interrupts are enabled
    imu_init();
 
    interrupt_init();
@@ -201,27 +261,8 @@ int main() {
    // power up!
    pwr_on();
 
-   while(1) {
-      gps_spinOnce();
-//      sonar_spinOnce();
-//      bt_spinOnce();
-      sub_spinOnce();
-
-      _delay_ms(1);
-      idle++;
-      if( ticks - idle_last > 1000 ) {
-         idle_last = (ticks/1000) * 1000;
-         if( idle_pub.reset() ) {
-            idle_pub.append(idle);
-            extern uint8_t i2c_fail;
-            idle_pub.append(i2c_fail);
-            extern uint8_t i2c_resets;
-            idle_pub.append(i2c_resets);
-            idle_pub.finish();
-         }
-         idle = 0;
-      }
-   }
+   status_last = clock_us();
+   scheduler_run(tasks, NUM_TASKS);
    
    // if we're here, we're done. power down.
 //   pwr_off();
@@ -0,0 +1,82 @@
+/* odom.cpp
+ *
+ * Fixed-point dead reckoning; see odom.h
+ *
+ * Author: Austin Hendrix
+ */
+
+#include "odom.h"
+
+/* heading change per quadrature count (2^-32 turn) for each steering
+ *  setting: Q_SCALE / (2 pi steer2radius(s)). Setting 0 drives straight.
+ *  Regenerate with fixed-test if the radius table in steer.cpp changes. */
+static const uint32_t turn_table[128] PROGMEM = {
+/*   0 */        0,   241556,   269684,   305227,   351560,   414478,
+/*   6 */   504825,   645539,   895012,  1458759,  3941277,  4063927,
+/*  12 */  4194456,  4333648,  4482395,  4641716,  4812781,  4996936,
+/*  18 */  5195746,  5411030,  5644926,  5790626,  5944046,  6105817,
+/*  24 */  6276639,  6457296,  6648659,  6851711,  7067557,  7297444,
+/*  30 */  7542789,  7795470,  8065667,  8355267,  8666437,  9001682,
+/*  36 */  9363908,  9756507, 10183468, 10649507, 11160249, 11392754,
+/*  42 */ 11635154, 11888092, 12152272, 12428460, 12717493, 13020291,
+/*  48 */ 13337859, 13671306, 14021852, 14268812, 14524628, 14789783,
+/*  54 */ 15064800, 15350238, 15646702, 15954843, 16275364, 16609028,
+/*  60 */ 16956659, 17312299, 17683176, 18070292, 18474737, 18897700,
+/*  66 */ 19340485, 19804518, 20291363, 20802748, 21340575, 21593375,
+/*  72 */ 21852238, 22117381, 22389037, 22667450, 22952875, 23245578,
+/*  78 */ 23545845, 23853968, 24170265, 24481354, 24800555, 25128190,
+/*  84 */ 25464598, 25810135, 26165179, 26530125, 26905398, 27291439,
+/*  90 */ 27688719, 28025739, 28371061, 28725002, 29087883, 29460052,
+/*  96 */ 29841868, 30233709, 30635979, 31049096, 31473509, 31909686,
+/* 102 */ 32358120, 32819339, 33293894, 33782378, 34285408, 34803643,
+/* 108 */ 35337787, 35888579, 36456817, 37043334, 37649036, 38274875,
+/* 114 */ 38921868, 39591115, 40283774, 41001107, 41744450, 42515239,
+/* 120 */ 43315033, 44145492, 45008419, 45905756, 46839596, 47812224,
+/* 126 */ 48826099, 49883905 };
+
+// heading change per count for a steering setting (+ or -), unsigned
+static uint32_t turn_per_count(int8_t steer) {
+   uint8_t i = steer < 0 ? -steer : steer;
+   if( i > 127 ) i = 127; // -128
+   return pgm_read_dword(&turn_table[i]);
+}
+
+void pose_move(pose & p, int16_t counts, int8_t steer) {
+   int32_t turn = (int32_t)turn_per_count(steer) * counts;
+   // positive steering turns right, clockwise
+   if( steer > 0 ) turn = -turn;
+
+   /* the arc's chord has the heading half way along it; it is shorter
+    *  than the arc by d * turn^2 / 24 (turn in rad), but only by 0.1% even
+    *  for a turn of 0.15 rad in one update */
+   angle_t mid = (p.yaw + (uint32_t)(turn / 2)) >> 16;
+
+   // length in Q8.24, rounded to Q16.16 after the multiply
+   int32_t d = counts * FIX(Q_SCALE, 24);
+   p.x += (mul_q15(d, fx_cos(mid)) + 128) >> 8;
+   p.y += (mul_q15(d, fx_sin(mid)) + 128) >> 8;
+   p.yaw += (uint32_t)turn;
+}
+
+void pose_blend_yaw(pose & p, angle_t a) {
+   int16_t diff = a - (angle_t)(p.yaw >> 16);
+   // half of diff, from 2^-16 to 2^-32 turn
+   p.yaw += (uint32_t)(int32_t)diff << 15;
+}
+
+int16_t pose_yaw_mrad(const pose & p) {
+   int16_t a = p.yaw >> 16;
+   // 2 pi * 1000 / 65536 mrad per angle_t, rounded
+   return ((int32_t)a * 6283 + 32768) >> 16;
+}
+
+int16_t angular_speed(int16_t speed, int8_t steer) {
+   /* speed / Q_SCALE is counts/s; times the turn per count is 2^-32 turn/s.
+    *  Multiplied through: 2^-16 turn per 32 mrad */
+   int32_t t = mul_q16(turn_per_count(steer), speed);
+   int32_t w = mul_q16(t, Q16(2 * M_PI / Q_SCALE / 2048)) >> 5;
+   if( w > 32767 ) w = 32767;
+   if( w < -32767 ) w = -32767;
+   // positive steering turns right, clockwise
+   return steer > 0 ? -w : w;
+}
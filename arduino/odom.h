@@ -0,0 +1,36 @@
+/* odom.h
+ *
+ * Dead reckoning from the drive encoder and the steering setting, in fixed
+ *  point (see fixed.h).
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef ODOM_H
+#define ODOM_H
+
+#include "fixed.h"
+
+// metres per quadrature count
+#define Q_SCALE 0.032
+
+struct pose {
+   q16_t x;      // m
+   q16_t y;      // m
+   uint32_t yaw; // heading, in 2^-32 turn; the top half is an angle_t
+};
+
+/* drive counts quadrature counts (+ forward) along the arc for steering
+ *  setting steer; good for up to 40 counts at a time */
+void pose_move(pose & p, int16_t counts, int8_t steer);
+
+// move the heading half way to a
+void pose_blend_yaw(pose & p, angle_t a);
+
+// heading in (-pi, pi], mrad
+int16_t pose_yaw_mrad(const pose & p);
+
+// angular speed (mrad/s) when driving at speed mm/s with steering steer
+int16_t angular_speed(int16_t speed, int8_t steer);
+
+#endif
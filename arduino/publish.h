@@ -9,7 +9,7 @@
 #ifndef PUBLISH_H
 #define PUBLISH_H
 
-#include "protocol.h"
+#include "messages.h"
 extern "C" {
 #include "drivers/serial.h"
 #include "drivers/led.h"
@@ -17,43 +17,41 @@ extern "C" {
 
 extern uint8_t pub_enable;
 
-// experimental publisher class; wraps the Packet class
+// publisher for one message type; encodes straight into its own frame
+//  buffer, which stays in use until the serial driver has sent it. cls is
+//  the transmit class (see drivers/serial.h): TX_RT for odometry and
+//  control replies, TX_BULK for everything else
 // targeted to my AVR
-template<uint8_t SZ>
+template<class M>
 class Publisher {
    private:
       uint16_t brain_sz;
-      char buffer[SZ];
-      Packet p;
+      uint8_t seq;
+      uint8_t cls;
+      uint8_t buffer[wire_size<M>::FRAME];
 
    public:
-      Publisher(char topic) : p(topic, (uint8_t)SZ, buffer) {
-         brain_sz = 0;
-         //bt_sz = 0;
-      }
+      Publisher(uint8_t cls = TX_BULK) : brain_sz(0), seq(0), cls(cls) {}
 
+      // 1 if the buffer is free for the next message; if not, the message
+      //  is dropped
       int8_t reset() {
          if( brain_sz > 0 ) {
             led_on();
+            tx_drop(BRAIN);
             return 0;
          } else {
-            p.reset();
             return 1;
          }
       }
 
-      void finish() {
-         p.finish();
+      void publish(const M & m) {
+         uint8_t sz = encode(m, seq++, buffer);
          if( pub_enable ) {
-            brain_sz = p.outsz();
-            tx_buffer(BRAIN, (const uint8_t *)buffer, &brain_sz);
-            //tx_buffer(BRAIN, (const uint8_t *)p.outbuf(), &brain_sz);
+            brain_sz = sz;
+            tx_buffer_class(BRAIN, buffer, &brain_sz, cls);
          }
       }
-
-      template<class T> void append(T t) {
-         p.append(t);
-      }
 };
 
 #endif
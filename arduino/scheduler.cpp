@@ -0,0 +1,102 @@
+/* scheduler.cpp
+ *
+ * Tick-driven cooperative scheduler; see scheduler.h
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "scheduler.h"
+#include "interrupt.h"
+
+uint32_t idle_us = 0;
+
+// first tick at or after now that is phase ticks into a period
+static uint32_t first_release(const task & t, uint32_t now) {
+   uint32_t r = now - now % t.period + t.phase;
+   if( (int32_t)(r - now) < 0 ) r += t.period;
+   return r;
+}
+
+// released task with the earliest deadline, or 0
+static task * next_task(task * tasks, uint8_t n, uint32_t now) {
+   task * best = 0;
+   for( uint8_t i=0; i<n; i++ ) {
+      task & t = tasks[i];
+      if( t.period == 0 || (int32_t)(now - t.release) < 0 ) continue;
+      if( !best || (int32_t)((t.release + t.deadline) -
+               (best->release + best->deadline)) < 0 ) {
+         best = &t;
+      }
+   }
+   return best;
+}
+
+// sleep until the next interrupt, unless the tick has moved on since now
+static void idle(uint32_t now) {
+   uint32_t start = clock_us();
+   set_sleep_mode(SLEEP_MODE_IDLE);
+   cli();
+   if( ticks == now ) {
+      sleep_enable();
+      // the instruction after sei always runs before any interrupt, so a
+      //  tick that arrives here still wakes us
+      sei();
+      sleep_cpu();
+      sleep_disable();
+   }
+   sei();
+   idle_us += clock_us() - start;
+}
+
+void scheduler_run(task * tasks, uint8_t n) {
+   uint32_t now = get_ticks();
+   for( uint8_t i=0; i<n; i++ ) {
+      if( tasks[i].period ) tasks[i].release = first_release(tasks[i], now);
+   }
+
+   while(1) {
+      now = get_ticks();
+      task * t = next_task(tasks, n, now);
+      if( !t ) {
+         idle(now);
+         continue;
+      }
+
+      uint32_t start = clock_us();
+      t->run();
+      uint32_t run = clock_us() - start;
+      if( run > 0xFFFF ) run = 0xFFFF;
+      if( run > t->wcet ) t->wcet = run;
+
+      uint32_t end = get_ticks();
+      if( (int32_t)(end - (t->release + t->deadline)) > 0 ) ++t->overruns;
+
+      // the next release may already be due and run late, but any before
+      //  it are skipped rather than run back to back
+      t->release += t->period;
+      if( (int32_t)(end - t->release) >= (int32_t)t->period ) {
+         uint32_t missed = (end - t->release) / t->period;
+         t->overruns += missed;
+         t->release += missed * t->period;
+      }
+   }
+}
+
+uint32_t scheduler_idle(void) {
+   uint32_t i = idle_us;
+   idle_us = 0;
+   return i;
+}
+
+void task_report(task * tasks, uint8_t n, uint16_t * wcet,
+      uint16_t * overruns) {
+   for( uint8_t i=0; i<n; i++ ) {
+      wcet[i] = tasks[i].wcet;
+      overruns[i] = tasks[i].overruns;
+      tasks[i].wcet = 0;
+   }
+}
@@ -0,0 +1,42 @@
+/* scheduler.h
+ *
+ * Tick-driven cooperative scheduler for the main loop.
+ *
+ * Each task is released every period ticks (ms), at phase ticks into the
+ *  period, and should finish within deadline ticks of its release. Of the
+ *  released tasks, the one with the earliest deadline runs next, to
+ *  completion; when none are released the CPU sleeps until the next
+ *  interrupt. A run that finishes late, or a release that passes before
+ *  the previous one ran, counts as an overrun.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+struct task {
+   void (*run)(void);
+   uint16_t period;   // ticks between releases; 0 never runs
+   uint16_t phase;    // offset of the releases within the period
+   uint16_t deadline; // ticks after its release by which a run must end
+
+   uint32_t release;  // tick of the next release
+   uint16_t wcet;     // longest run since the last task_report() (us)
+   uint16_t overruns; // counts up and wraps
+};
+
+// run the n tasks forever
+void scheduler_run(task * tasks, uint8_t n);
+
+// time spent asleep since the last call (us)
+uint32_t scheduler_idle(void);
+
+/* copy each task's longest run and overrun count into wcet and overruns,
+ *  and start measuring the longest run over again */
+void task_report(task * tasks, uint8_t n, uint16_t * wcet,
+      uint16_t * overruns);
+
+#endif
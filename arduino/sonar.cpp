@@ -12,11 +12,11 @@ extern "C" {
 }
 
 #include "publish.h"
+#include "interrupt.h"
 
 #define SONAR_TIMEOUT 200
 #define SONAR_DELAY 20
 
-#define NUM_SONARS 5
 uint8_t sonar_port;
 uint8_t sonar_value[NUM_SONARS];
 
@@ -24,10 +24,9 @@ uint8_t current_sonar;
 uint8_t sonar_bytes;
 uint8_t sonar_tmp;
 
-extern uint32_t ticks;
 uint32_t last_sonar = 0;
 
-Publisher<12> sonar_pub('S');
+Publisher<sonar_msg> sonar_pub;
 
 /* initalize sonar driver */
 void sonar_init(uint8_t port) {
@@ -80,14 +79,14 @@ void sonar_spinOnce(void) {
             sonar_value[current_sonar] = sonar_tmp;
             // TODO: rewrite this to send sonar data as available
             /*
-            // if this is the first sonar, reset
-            if( current_sonar == 0 ) 
-               sonar_pub.reset();
-
-            sonar_pub.append(sonar_tmp);
             // if this is the last sonar, send
-            if( current_sonar == (NUM_SONARS-1) )
-               sonar_pub.finish();
+            if( current_sonar == (NUM_SONARS-1) && sonar_pub.reset() ) {
+               sonar_msg m;
+               for( uint8_t i=0; i<NUM_SONARS; i++ )
+                  m.range[i] = sonar_value[i];
+               m.ticks = get_ticks();
+               sonar_pub.publish(m);
+            }
                */
           }
           break;
@@ -0,0 +1,93 @@
+/* imu_cycles.cpp
+ *
+ * Measures the CPU cycles of the attitude filter (see ahrs.h): the first
+ *  update, which sets the orientation from the accelerometer and compass,
+ *  an update in motion, and the roll, pitch and yaw output. Each call runs
+ *  with interrupts off between two reads of timer 1; the filter takes more
+ *  than the 65536 cycles timer 1 can count at the CPU clock, so it counts
+ *  every 8 cycles instead. Results are printed on the BRAIN port at 115200,
+ *  one per line, with their share of the 20ms between samples. Accuracy is
+ *  checked on the host, by data/ahrs.
+ *
+ * Author: Austin Hendrix
+ */
+
+#define F_CPU 16000000UL
+
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+extern "C" {
+#include <drivers/serial.h>
+}
+
+#include "ahrs.h"
+
+// cycles per timer count
+#define PRESCALE 8
+// cycles between samples: 20ms
+#define PERIOD (F_CPU / 1000 * 20)
+
+uint16_t overhead;
+
+#define CYCLES(expr) ({ \
+      uint16_t t0 = TCNT1; \
+      expr; \
+      uint16_t t1 = TCNT1; \
+      (uint32_t)(uint16_t)(t1 - t0 - overhead) * PRESCALE; })
+
+char line[64];
+volatile uint16_t line_sz;
+
+void report(const char * what, uint32_t cycles) {
+   while( line_sz != 0 );
+   line_sz = snprintf(line, sizeof(line), "%-16s %6lu cycles, %3lu.%lu%%\r\n",
+         what, cycles, cycles * 100 / PERIOD, cycles * 1000 / PERIOD % 10);
+   cli();
+   tx_buffer(BRAIN, (uint8_t*)line, (uint16_t*)&line_sz);
+   sei();
+   while( line_sz != 0 );
+}
+
+// level and still, then turning left at 2 m/s over rough ground
+imu_sample still = { { 0, 0, 256 }, { 0, 0, 0 }, { 184, -184, -585 }, 0 };
+imu_sample moving = { { 12, 40, 251 }, { 35, -20, 450 }, { 170, -200, -580 },
+   2000 };
+volatile float out;
+
+int main() {
+   ahrs a;
+   uint32_t cycles;
+
+   serial_init(BRAIN);
+   serial_baud(BRAIN, 115200);
+
+   // timer 1 free-running at an eighth of the CPU clock
+   TCCR1A = 0;
+   TCCR1B = (1 << CS11);
+
+   ahrs_init(a);
+
+   cli();
+   overhead = 0;
+   overhead = CYCLES(;) / PRESCALE;
+   sei();
+
+   cli();
+   cycles = CYCLES(ahrs_update(a, still));
+   sei();
+   report("first update", cycles);
+
+   cli();
+   cycles = CYCLES(ahrs_update(a, moving));
+   sei();
+   report("update", cycles);
+
+   cli();
+   cycles = CYCLES(out = ahrs_rpy(a).z);
+   sei();
+   report("roll/pitch/yaw", cycles);
+
+   while(1);
+}
@@ -0,0 +1,117 @@
+/* isr_cycles.c
+ *
+ * Measures the CPU cycles of the serial interrupt handlers and the receive
+ *  calls, for working out how fast a port can run. Each handler is called
+ *  directly, with interrupts off, between two reads of timer 1 counting at
+ *  the CPU clock; the cost of the reads themselves is subtracted. The times
+ *  include the call and the handler's reti, but not the 4-cycle interrupt
+ *  response.
+ *
+ * The handlers under test belong to port 1 (SONAR), which is otherwise
+ *  unused; results are printed on the BRAIN port at 115200, one per line.
+ *
+ * Author: Austin Hendrix
+ */
+
+#define F_CPU 16000000UL
+
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include <drivers/serial.h>
+
+#define PORT 1
+
+void USART1_RX_vect(void);
+void USART1_UDRE_vect(void);
+
+uint16_t overhead;
+
+#define CYCLES(expr) ({ \
+      uint16_t t0 = TCNT1; \
+      expr; \
+      uint16_t t1 = TCNT1; \
+      cli(); /* the handlers' reti turns interrupts back on */ \
+      (uint16_t)(t1 - t0 - overhead); })
+
+char line[64];
+volatile uint16_t line_sz;
+
+void report(const char * what, uint16_t cycles) {
+   while( line_sz != 0 );
+   line_sz = snprintf(line, sizeof(line), "%-24s %4u cycles\r\n", what,
+         cycles);
+   cli();
+   tx_buffer(BRAIN, (uint8_t*)line, (uint16_t*)&line_sz);
+   sei();
+   while( line_sz != 0 );
+}
+
+uint8_t frame[32];
+uint16_t frame_sz;
+
+int main() {
+   uint8_t buf[32];
+   uint16_t rx, rx_full, rx_byte_c, rx_read_c, rx_empty;
+   uint16_t tx_idle, tx_first, tx_mid, tx_last, tx_deferred;
+   uint16_t i;
+
+   serial_init(BRAIN);
+   serial_baud(BRAIN, 115200);
+   serial_init(PORT);
+   serial_baud(PORT, 115200);
+
+   // timer 1 free-running at the CPU clock
+   TCCR1A = 0;
+   TCCR1B = (1 << CS10);
+
+   cli();
+   overhead = 0;
+   overhead = CYCLES(;);
+
+   // receive: a byte into the ring, and into a full ring
+   rx = CYCLES(USART1_RX_vect());
+   for( i=0; i<BUF_SZ; i++ ) USART1_RX_vect();
+   rx_full = CYCLES(USART1_RX_vect());
+
+   // reads, from a full ring
+   rx_byte_c = CYCLES(rx_byte(PORT));
+   rx_read_c = CYCLES(rx_read(PORT, buf, sizeof(buf)));
+   while( rx_read(PORT, buf, sizeof(buf)) );
+   rx_empty = CYCLES(rx_read(PORT, buf, sizeof(buf)));
+
+   // send: nothing queued, first, middle and last bytes of a frame
+   tx_idle = CYCLES(USART1_UDRE_vect());
+   frame_sz = sizeof(frame);
+   tx_buffer(PORT, frame, &frame_sz);
+   tx_first = CYCLES(USART1_UDRE_vect());
+   tx_mid = CYCLES(USART1_UDRE_vect());
+   // up to the last byte
+   for( i=2; i<sizeof(frame) - 1; i++ ) {
+      USART1_UDRE_vect();
+      cli();
+   }
+   tx_last = CYCLES(USART1_UDRE_vect());
+
+   // a bulk frame that doesn't fit before the next slot
+   tx_slot(PORT, 0);
+   frame_sz = sizeof(frame);
+   tx_buffer(PORT, frame, &frame_sz);
+   tx_deferred = CYCLES(USART1_UDRE_vect());
+
+   sei();
+   report("overhead", overhead);
+   report("rx isr", rx);
+   report("rx isr, ring full", rx_full);
+   report("rx_byte", rx_byte_c);
+   report("rx_read 32 bytes", rx_read_c);
+   report("rx_read, empty", rx_empty);
+   report("tx isr, idle", tx_idle);
+   report("tx isr, first byte", tx_first);
+   report("tx isr, next byte", tx_mid);
+   report("tx isr, last byte", tx_last);
+   report("tx isr, deferred", tx_deferred);
+
+   while(1);
+}
@@ -0,0 +1,113 @@
+/* odom_cycles.cpp
+ *
+ * Measures the CPU cycles of the odometry and speed control math, before
+ *  (float; see odom_float.h) and after (fixed point; see fixed.h and
+ *  odom.h). Each call runs with interrupts off between two reads of timer 1
+ *  counting at the CPU clock; the cost of the reads themselves is
+ *  subtracted. Results are printed on the BRAIN port at 115200, one per
+ *  line. Accuracy is checked on the host, by fixed-test.
+ *
+ * Author: Austin Hendrix
+ */
+
+#define F_CPU 16000000UL
+
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+extern "C" {
+#include <drivers/serial.h>
+}
+
+#include "fixed.h"
+#include "odom.h"
+#include "odom_float.h"
+
+uint16_t overhead;
+
+#define CYCLES(expr) ({ \
+      uint16_t t0 = TCNT1; \
+      expr; \
+      uint16_t t1 = TCNT1; \
+      (uint16_t)(t1 - t0 - overhead); })
+
+char line[64];
+volatile uint16_t line_sz;
+
+void report(const char * what, uint16_t before, uint16_t after) {
+   while( line_sz != 0 );
+   line_sz = snprintf(line, sizeof(line),
+         "%-16s float %5u, fixed %5u cycles\r\n", what, before, after);
+   cli();
+   tx_buffer(BRAIN, (uint8_t*)line, (uint16_t*)&line_sz);
+   sei();
+   while( line_sz != 0 );
+}
+
+// inputs and outputs, volatile so that nothing is worked out at compile time
+volatile int16_t counts = 2;
+volatile int8_t straight = 0;
+volatile int8_t turning = -45;
+volatile int16_t speed = 1600;
+volatile int16_t target = 90;
+volatile float f_angle = 1.0;
+volatile angle_t angle = 10430;
+volatile int32_t out;
+
+int main() {
+   float_pose<float> f;
+   pose p = { 0, 0, 0 };
+   int16_t mult = 128;
+   uint16_t before, after;
+
+   serial_init(BRAIN);
+   serial_baud(BRAIN, 115200);
+
+   // timer 1 free-running at the CPU clock
+   TCCR1A = 0;
+   TCCR1B = (1 << CS10);
+
+   cli();
+   overhead = 0;
+   overhead = CYCLES(;);
+   sei();
+
+   cli();
+   before = CYCLES(out = 32768 * sin(f_angle));
+   after = CYCLES(out = fx_sin(angle));
+   sei();
+   report("sin", before, after);
+
+   cli();
+   before = CYCLES(float_move(f, counts, straight));
+   after = CYCLES(pose_move(p, counts, straight));
+   sei();
+   report("move, straight", before, after);
+
+   cli();
+   before = CYCLES(float_move(f, counts, turning));
+   after = CYCLES(pose_move(p, counts, turning));
+   sei();
+   report("move, turning", before, after);
+
+   cli();
+   before = CYCLES(out = float_yaw_mrad(f));
+   after = CYCLES(out = pose_yaw_mrad(p));
+   sei();
+   report("yaw output", before, after);
+
+   cli();
+   before = CYCLES(out = float_angular(speed, turning));
+   after = CYCLES(out = angular_speed(speed, turning));
+   sei();
+   report("angular output", before, after);
+
+   cli();
+   before = CYCLES(out = mult * (double)target);
+   after = CYCLES(out = (int32_t)mult * target);
+   sei();
+   report("power", before, after);
+
+   while(1);
+}
@@ -0,0 +1,71 @@
+/* odom_float.h
+ *
+ * The floating-point odometry that odom.cpp replaced, kept as a reference
+ *  for fixed-test (accuracy, on the host) and odom_cycles (speed, on the
+ *  AVR). T is float, as the AVR ran it, or double.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef ODOM_FLOAT_H
+#define ODOM_FLOAT_H
+
+#include <math.h>
+#include <stdint.h>
+#include "steer.h"
+
+template<class T> struct float_pose {
+   T x, y, yaw; // m, rad
+   float_pose() : x(0), y(0), yaw(0) {}
+};
+
+template<class T>
+void float_move(float_pose<T> & p, int16_t counts, int8_t steer) {
+   T r = steer2radius(steer);
+   T d = counts * (T)0.032;
+   T dx, dy, dt;
+   if( steer == 0 ) {
+      dx = d * cos(p.yaw);
+      dy = d * sin(p.yaw);
+      dt = 0.0;
+   } else {
+      dt = d / r;
+      T theta_c1;
+      T theta_c2;
+      if( steer > 0 ) {
+         // turning right
+         theta_c1 = p.yaw + M_PI/2;
+      } else {
+         // turning left
+         dt = -dt;
+         theta_c1 = p.yaw - M_PI/2;
+      }
+      theta_c2 = theta_c1 - dt;
+
+      dx = r * (cos(theta_c2) - cos(theta_c1));
+      dy = r * (sin(theta_c2) - sin(theta_c1));
+   }
+
+   p.x += dx;
+   p.y += dy;
+   p.yaw -= dt;
+}
+
+// the odometry message's yaw (mrad)
+template<class T> int16_t float_yaw_mrad(const float_pose<T> & p) {
+   T a = p.yaw;
+   while( a > M_PI ) a -= 2*M_PI;
+   while( a < -M_PI ) a += 2*M_PI;
+   return a * 1000;
+}
+
+// the odometry message's angular speed; always with the sign of speed
+inline int16_t float_angular(int16_t speed, int8_t steer) {
+   if( steer == 0 ) return 0;
+   float w = speed / steer2radius(steer);
+   if( w > 32767 ) w = 32767;
+   if( w < -32767 ) w = -32767;
+   return w;
+}
+
+#endif
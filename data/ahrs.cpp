@@ -0,0 +1,204 @@
+/*
+ * run the AVR's attitude filter (arduino/ahrs.cpp) on the host
+ *
+ * ahrs <imu log>: replay a raw IMU log from hardware_interface (an AVR built
+ *  with IMU_RAW) through the filter, and print time, roll, pitch and yaw for
+ *  every sample; the sensor noise over the first second, while the robot is
+ *  still, goes to stderr
+ *
+ * ahrs: drive a simulated IMU, with noise, gyro bias and the sensors'
+ *  quantization, through turns, hills and bumps, and compare the filter to
+ *  the truth
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "ahrs.h"
+
+// hard-iron offset the filter takes out (gauss); see arduino/ahrs.cpp
+const double compass_offset[3] = { -0.036923, -0.107692, -0.03775 };
+
+const char * axes[9] = { "ax", "ay", "az", "gx", "gy", "gz", "mx", "my", "mz" };
+
+int replay(const char * log) {
+   FILE * in = fopen(log, "r");
+   if( in == NULL ) {
+      perror(log);
+      return 1;
+   }
+
+   ahrs a;
+   ahrs_init(a);
+   unsigned ticks;
+   unsigned last = 0;
+   double t = 0;
+   int n = 0;
+   double sum[9] = { 0 };
+   double sum2[9] = { 0 };
+   imu_sample s;
+   while( fscanf(in, "%u %hd %hd %hd %hd %hd %hd %hd %hd %hd %hd", &ticks,
+            &s.accel[0], &s.accel[1], &s.accel[2],
+            &s.gyro[0], &s.gyro[1], &s.gyro[2],
+            &s.compass[0], &s.compass[1], &s.compass[2], &s.speed) == 11 ) {
+      // ticks are ms, and wrap at 16 bits
+      if( n > 0 ) t += (uint16_t)(ticks - last) / 1000.0;
+      last = ticks;
+
+      if( n < 50 ) {
+         for( int i=0; i<3; i++ ) {
+            int16_t v[3] = { s.accel[i], s.gyro[i], s.compass[i] };
+            for( int j=0; j<3; j++ ) {
+               sum[j*3 + i] += v[j];
+               sum2[j*3 + i] += v[j] * (double)v[j];
+            }
+         }
+      }
+      ++n;
+
+      ahrs_update(a, s);
+      Vector3 rpy = ahrs_rpy(a);
+      printf("%.3f %.4f %.4f %.4f\n", t, rpy.x, rpy.y, rpy.z);
+   }
+   fclose(in);
+
+   int m = n < 50 ? n : 50;
+   if( m > 1 ) {
+      fprintf(stderr, "%d samples; noise over the first %d:\n", n, m);
+      for( int i=0; i<9; i++ ) {
+         double mean = sum[i] / m;
+         double var = (sum2[i] - m * mean * mean) / (m - 1);
+         fprintf(stderr, " %s mean %8.1f sd %6.2f\n", axes[i], mean,
+               sqrt(var > 0 ? var : 0));
+      }
+   }
+   return 0;
+}
+
+// unit normal noise
+double noise() {
+   double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+   double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+   return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+int16_t quantize(double x) {
+   x = floor(x + 0.5);
+   if( x > 32767 ) x = 32767;
+   if( x < -32768 ) x = -32768;
+   return x;
+}
+
+// v rotated from world to robot axes by the conjugate of q
+void to_robot(const double q[4], const double w[3], double r[3]) {
+   double q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+   r[0] = (1 - 2*(q2*q2 + q3*q3)) * w[0] + 2*(q1*q2 + q0*q3) * w[1] +
+      2*(q1*q3 - q0*q2) * w[2];
+   r[1] = 2*(q1*q2 - q0*q3) * w[0] + (1 - 2*(q1*q1 + q3*q3)) * w[1] +
+      2*(q2*q3 + q0*q1) * w[2];
+   r[2] = 2*(q1*q3 + q0*q2) * w[0] + 2*(q2*q3 - q0*q1) * w[1] +
+      (1 - 2*(q1*q1 + q2*q2)) * w[2];
+}
+
+double wrap(double a) {
+   while( a > M_PI ) a -= 2 * M_PI;
+   while( a < -M_PI ) a += 2 * M_PI;
+   return a;
+}
+
+// the robot's course: roll, pitch and yaw (from north) and their rates;
+//  weaving turns over rolling ground
+void course(double t, double e[3], double de[3]) {
+   e[0] = 0.1 * sin(1.3 * t);
+   de[0] = 0.13 * cos(1.3 * t);
+   e[1] = 0.15 * sin(0.7 * t + 1);
+   de[1] = 0.105 * cos(0.7 * t + 1);
+   e[2] = 1.7 + 0.2 * t - 3.2 * cos(0.25 * t);
+   de[2] = 0.2 + 0.8 * sin(0.25 * t);
+}
+
+int simulate() {
+   srand(1);
+   // the field: 0.2 gauss north and 0.45 down
+   const double field[3] = { 0.2, 0, -0.45 };
+   const double up[3] = { 0, 0, 1 };
+   // gyro bias left over after the startup zero, and sensor noise (counts)
+   const double bias[3] = { 12, -8, 20 };
+   const double accel_sd = 3, gyro_sd = 2, compass_sd = 3;
+   ahrs a;
+   ahrs_init(a);
+   double sq[3] = { 0 }, worst[3] = { 0 };
+   int n = 0;
+   for( int k=0; k<120 * 50; k++ ) {
+      double t = k * AHRS_DT;
+      double e[3], de[3];
+      course(t, e, de);
+      double sr = sin(e[0]), cr = cos(e[0]);
+      double sp = sin(e[1]), cp = cos(e[1]);
+
+      // robot to world
+      double c1 = cos(e[0]/2), s1 = sin(e[0]/2);
+      double c2 = cos(e[1]/2), s2 = sin(e[1]/2);
+      double c3 = cos(e[2]/2), s3 = sin(e[2]/2);
+      double q[4] = { c1*c2*c3 + s1*s2*s3, s1*c2*c3 - c1*s2*s3,
+         c1*s2*c3 + s1*c2*s3, c1*c2*s3 - s1*s2*c3 };
+
+      // rates in robot axes (rad/s)
+      double w[3];
+      w[0] = de[0] - de[2] * sp;
+      w[1] = de[1] * cr + de[2] * sr * cp;
+      w[2] = -de[1] * sr + de[2] * cr * cp;
+
+      // speed (m/s), and acceleration (g): speeding up and slowing down,
+      //  cornering, and the odd jolt from a bump
+      double v = 2 + 0.4 * sin(0.5 * t);
+      double acc[3] = { 0.2 * cos(0.5 * t) / 9.81, v * w[2] / 9.81,
+         -v * w[1] / 9.81 };
+      if( k % 250 == 0 ) acc[2] += 0.5;
+
+      double g[3], m[3];
+      to_robot(q, up, g);
+      to_robot(q, field, m);
+      imu_sample s;
+      s.speed = v * 1000;
+      for( int i=0; i<3; i++ ) {
+         s.accel[i] = quantize((g[i] + acc[i]) * 256 + accel_sd * noise());
+         s.gyro[i] = quantize(w[i] * 180 / M_PI * 14.375 + bias[i] +
+               gyro_sd * noise());
+         s.compass[i] = quantize((m[i] + compass_offset[i]) * 1300 +
+               compass_sd * noise());
+      }
+      ahrs_update(a, s);
+
+      // scored after the bias has had a while to settle
+      Vector3 rpy = ahrs_rpy(a);
+      double err[3] = { wrap(rpy.x - e[0]), wrap(rpy.y - e[1]),
+         wrap(rpy.z - e[2] - M_PI / 2) };
+      if( t > 30 ) {
+         for( int i=0; i<3; i++ ) {
+            sq[i] += err[i] * err[i];
+            if( fabs(err[i]) > worst[i] ) worst[i] = fabs(err[i]);
+         }
+         ++n;
+      }
+   }
+
+   const char * names[3] = { "roll", "pitch", "yaw" };
+   printf("error over %d samples (deg):\n", n);
+   for( int i=0; i<3; i++ ) {
+      printf(" %-5s rms %5.2f max %5.2f\n", names[i],
+            sqrt(sq[i] / n) * 180 / M_PI, worst[i] * 180 / M_PI);
+   }
+   printf("gyro bias learned (counts): %.1f %.1f %.1f, actual %.0f %.0f %.0f\n",
+         -a.bias.x * 180 / M_PI * 14.375, -a.bias.y * 180 / M_PI * 14.375,
+         -a.bias.z * 180 / M_PI * 14.375, bias[0], bias[1], bias[2]);
+   return 0;
+}
+
+int main(int argc, char ** argv) {
+   if( argc > 1 ) return replay(argv[1]);
+   return simulate();
+}
@@ -0,0 +1,84 @@
+/* frame.cpp
+ *
+ * COBS framing with a length, sequence number and CRC-16; see frame.h.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <string.h>
+
+#include "frame.h"
+
+#define CRC_INIT 0xFFFF
+
+uint16_t crc16(const uint8_t * data, uint8_t len) {
+   uint16_t crc = CRC_INIT;
+   for( uint8_t i=0; i<len; i++ ) {
+      crc = crc16_update(crc, data[i]);
+   }
+   return crc;
+}
+
+uint8_t frame_finish(uint8_t * out, uint8_t type, uint8_t seq, uint8_t len) {
+   if( len > FRAME_MAX_PAYLOAD ) return 0;
+
+   // unencoded frame in out[1..n]; out[0] is the first COBS code byte
+   out[1] = len;
+   out[2] = type;
+   out[3] = seq;
+   uint8_t n = len + 5;
+   uint16_t crc = crc16(out + 1, n - 2);
+   out[n - 1] = crc & 0xFF;
+   out[n] = crc >> 8;
+
+   /* COBS in place: every non-zero byte stays where it is, and each zero
+    *  (and the leading slot) becomes the distance to the next zero or the
+    *  end. That only holds without 254-byte runs, which would need an extra
+    *  code byte; frames are never that long.
+    */
+   uint8_t next = n + 1;
+   for( uint8_t i = n; i > 0; --i ) {
+      if( out[i] == 0 ) {
+         out[i] = next - i;
+         next = i;
+      }
+   }
+   out[0] = next;
+   out[n + 1] = FRAME_DELIMITER;
+   return n + 2;
+}
+
+uint8_t frame_encode(uint8_t type, uint8_t seq, const uint8_t * payload,
+      uint8_t len, uint8_t * out) {
+   if( len > FRAME_MAX_PAYLOAD ) return 0;
+   memcpy(frame_payload(out), payload, len);
+   return frame_finish(out, type, seq, len);
+}
+
+frame_status frame_decode(uint8_t * buf, uint8_t n, frame & f) {
+   // undo COBS in place; the output never overtakes the input
+   uint8_t r = 0;
+   uint8_t w = 0;
+   while( r < n ) {
+      uint8_t code = buf[r++];
+      if( code == 0 ) return FRAME_COBS;
+      for( uint8_t i=1; i<code; i++ ) {
+         if( r >= n || buf[r] == 0 ) return FRAME_COBS;
+         buf[w++] = buf[r++];
+      }
+      if( code != 0xFF && r < n ) buf[w++] = 0;
+   }
+
+   if( w < 5 || buf[0] != w - 5 ) return FRAME_LENGTH;
+
+   uint16_t crc = crc16(buf, w - 2);
+   if( buf[w - 2] != (crc & 0xFF) || buf[w - 1] != (crc >> 8) ) {
+      return FRAME_CRC;
+   }
+
+   f.len = buf[0];
+   f.type = buf[1];
+   f.seq = buf[2];
+   f.payload = buf + 3;
+   return FRAME_OK;
+}
@@ -0,0 +1,81 @@
+/* frame.h
+ *
+ * Version 2 of the serial wire format, for AVR and x86.
+ *
+ * A frame is
+ *    len type seq payload[len] crc_lo crc_hi
+ *  COBS-encoded and terminated by a zero byte. len is the payload length,
+ *  seq counts frames of each type per sender, and the CRC is CRC-16/CCITT
+ *  (polynomial 0x1021, initial value 0xFFFF) over everything before it. COBS
+ *  costs one byte per 254 instead of the old format's one escape per '\r' or
+ *  ESC, so the size on the wire is fixed: payload + 7 bytes for anything up
+ *  to FRAME_MAX_PAYLOAD.
+ *
+ * Neither side allocates. A frame can be built in place: write the payload
+ *  at frame_payload(out) and call frame_finish(), which adds the header and
+ *  CRC and COBS-encodes the buffer where it is. frame_encode does the same
+ *  for a payload held elsewhere. frame_decode decodes in place and points
+ *  the frame's payload into the same buffer. Output buffers need
+ *  len + FRAME_OVERHEAD bytes.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_DELIMITER 0
+#define FRAME_MAX_PAYLOAD 240
+// len, type, seq, two CRC bytes, the COBS code byte and the delimiter
+#define FRAME_OVERHEAD 7
+#define FRAME_MAX_ENCODED (FRAME_MAX_PAYLOAD + FRAME_OVERHEAD)
+
+struct frame {
+   uint8_t type;
+   uint8_t seq;
+   uint8_t len;
+   const uint8_t * payload;
+};
+
+enum frame_status {
+   FRAME_OK = 0,
+   FRAME_COBS,   // not valid COBS
+   FRAME_LENGTH, // too short, or the length byte doesn't match
+   FRAME_CRC     // checksum mismatch
+};
+
+// CRC-16/CCITT update for one byte
+inline uint16_t crc16_update(uint16_t crc, uint8_t b) {
+   crc = (crc >> 8) | (crc << 8);
+   crc ^= b;
+   crc ^= (crc & 0xFF) >> 4;
+   crc ^= crc << 12;
+   crc ^= (crc & 0xFF) << 5;
+   return crc;
+}
+
+uint16_t crc16(const uint8_t * data, uint8_t len);
+
+// where to write the payload of a frame being built in out
+inline uint8_t * frame_payload(uint8_t * out) {
+   return out + 4;
+}
+
+/* finish a frame whose len payload bytes are at frame_payload(out); returns
+ *  the number of bytes to send, including the delimiter, or 0 if len is
+ *  larger than FRAME_MAX_PAYLOAD
+ */
+uint8_t frame_finish(uint8_t * out, uint8_t type, uint8_t seq, uint8_t len);
+
+// encode a frame into out; returns the same as frame_finish
+uint8_t frame_encode(uint8_t type, uint8_t seq, const uint8_t * payload,
+      uint8_t len, uint8_t * out);
+
+/* decode the n bytes before a delimiter in place. On success f describes
+ *  the frame and its payload points into buf
+ */
+frame_status frame_decode(uint8_t * buf, uint8_t n, frame & f);
+
+#endif
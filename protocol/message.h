@@ -0,0 +1,174 @@
+/* message.h
+ *
+ * Compile-time message descriptors for the v2 wire format, for AVR and x86.
+ *
+ * A message is a plain struct plus a specialization of message<> that gives
+ *  its type byte and its field list:
+ *
+ *    struct gps_msg { int32_t lat; int32_t lon; };
+ *    template<> struct message<gps_msg> {
+ *       enum { TYPE = 'G' };
+ *       typedef field<gps_msg, int32_t, &gps_msg::lat,
+ *               field<gps_msg, int32_t, &gps_msg::lon> > fields;
+ *    };
+ *
+ * The field list fixes the payload layout (little-endian, in list order)
+ *  and its size at compile time, so encode() writes each field straight
+ *  into the frame with no per-byte calls, and decode() needs a single
+ *  length check for the whole payload. wire_size<M> gives the payload and
+ *  frame sizes for sizing buffers.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+// little-endian encoding of a single value
+template<class T> struct wire;
+
+template<> struct wire<uint8_t> {
+   enum { SIZE = 1 };
+   static void put(uint8_t * b, const uint8_t & v) { b[0] = v; }
+   static void get(const uint8_t * b, uint8_t & v) { v = b[0]; }
+};
+
+template<> struct wire<int8_t> {
+   enum { SIZE = 1 };
+   static void put(uint8_t * b, const int8_t & v) { b[0] = v; }
+   static void get(const uint8_t * b, int8_t & v) { v = b[0]; }
+};
+
+template<> struct wire<uint16_t> {
+   enum { SIZE = 2 };
+   static void put(uint8_t * b, const uint16_t & v) {
+      b[0] = v;
+      b[1] = v >> 8;
+   }
+   static void get(const uint8_t * b, uint16_t & v) {
+      v = b[0] | ((uint16_t)b[1] << 8);
+   }
+};
+
+template<> struct wire<int16_t> {
+   enum { SIZE = 2 };
+   static void put(uint8_t * b, const int16_t & v) {
+      wire<uint16_t>::put(b, (uint16_t)v);
+   }
+   static void get(const uint8_t * b, int16_t & v) {
+      uint16_t u;
+      wire<uint16_t>::get(b, u);
+      v = u;
+   }
+};
+
+template<> struct wire<uint32_t> {
+   enum { SIZE = 4 };
+   static void put(uint8_t * b, const uint32_t & v) {
+      b[0] = v;
+      b[1] = v >> 8;
+      b[2] = v >> 16;
+      b[3] = v >> 24;
+   }
+   static void get(const uint8_t * b, uint32_t & v) {
+      v = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) |
+         ((uint32_t)b[3] << 24);
+   }
+};
+
+template<> struct wire<int32_t> {
+   enum { SIZE = 4 };
+   static void put(uint8_t * b, const int32_t & v) {
+      wire<uint32_t>::put(b, (uint32_t)v);
+   }
+   static void get(const uint8_t * b, int32_t & v) {
+      uint32_t u;
+      wire<uint32_t>::get(b, u);
+      v = u;
+   }
+};
+
+// IEEE single precision; float is 32 bits on both sides
+template<> struct wire<float> {
+   enum { SIZE = 4 };
+   union bits {
+      float f;
+      uint32_t u;
+   };
+   static void put(uint8_t * b, const float & v) {
+      bits t;
+      t.f = v;
+      wire<uint32_t>::put(b, t.u);
+   }
+   static void get(const uint8_t * b, float & v) {
+      bits t;
+      wire<uint32_t>::get(b, t.u);
+      v = t.f;
+   }
+};
+
+template<class T, int N> struct wire<T[N]> {
+   enum { SIZE = N * wire<T>::SIZE };
+   static void put(uint8_t * b, const T (&v)[N]) {
+      for( int i=0; i<N; i++ ) wire<T>::put(b + i * wire<T>::SIZE, v[i]);
+   }
+   static void get(const uint8_t * b, T (&v)[N]) {
+      for( int i=0; i<N; i++ ) wire<T>::get(b + i * wire<T>::SIZE, v[i]);
+   }
+};
+
+// end of a field list
+struct field_end {
+   enum { SIZE = 0 };
+   template<class M> static void encode(const M &, uint8_t *) {}
+   template<class M> static void decode(M &, const uint8_t *) {}
+};
+
+// member P of type T, followed by the rest of the list
+template<class M, class T, T M::*P, class Next = field_end>
+struct field {
+   enum { SIZE = wire<T>::SIZE + Next::SIZE };
+   static void encode(const M & m, uint8_t * b) {
+      wire<T>::put(b, m.*P);
+      Next::encode(m, b + wire<T>::SIZE);
+   }
+   static void decode(M & m, const uint8_t * b) {
+      wire<T>::get(b, m.*P);
+      Next::decode(m, b + wire<T>::SIZE);
+   }
+};
+
+// type byte and field list for a message; specialized for each message
+template<class M> struct message;
+
+template<class M> struct wire_size {
+   enum {
+      PAYLOAD = message<M>::fields::SIZE,
+      FRAME = PAYLOAD + FRAME_OVERHEAD
+   };
+   // compile-time check that the payload fits in a frame
+   typedef char fits[PAYLOAD <= FRAME_MAX_PAYLOAD ? 1 : -1];
+};
+
+/* encode m as a frame into out, which must hold wire_size<M>::FRAME bytes;
+ *  returns the number of bytes to send
+ */
+template<class M> uint8_t encode(const M & m, uint8_t seq, uint8_t * out) {
+   message<M>::fields::encode(m, frame_payload(out));
+   return frame_finish(out, message<M>::TYPE, seq, wire_size<M>::PAYLOAD);
+}
+
+// decode a frame into m; false if it is the wrong type or size
+template<class M> bool decode(const frame & f, M & m) {
+   if( f.type != message<M>::TYPE || f.len != wire_size<M>::PAYLOAD ) {
+      return false;
+   }
+   message<M>::fields::decode(m, f.payload);
+   return true;
+}
+
+#endif
@@ -0,0 +1,197 @@
+/* messages.h
+ *
+ * The messages exchanged between the AVR and the host; see message.h.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef MESSAGES_H
+#define MESSAGES_H
+
+#include "message.h"
+
+/* AVR to host
+ *
+ * Sensor messages carry the low 16 bits of the AVR's 1 kHz tick count when
+ *  they were sampled; the host maps them to its own clock with time_msg.
+ */
+
+// odometry, in fixed point: speeds (mm/s, mrad/s), position in the odom
+//  frame (mm), yaw (mrad, -pi to pi), the low 16 bits of the AVR's
+//  millisecond tick count when it was computed, and the bump sensor
+struct odometry_msg {
+   int16_t linear;
+   int16_t angular;
+   int32_t x;
+   int32_t y;
+   int16_t yaw;
+   uint16_t ticks;
+   uint8_t bump;
+};
+
+template<> struct message<odometry_msg> {
+   enum { TYPE = 'O' };
+   typedef field<odometry_msg, int16_t, &odometry_msg::linear,
+           field<odometry_msg, int16_t, &odometry_msg::angular,
+           field<odometry_msg, int32_t, &odometry_msg::x,
+           field<odometry_msg, int32_t, &odometry_msg::y,
+           field<odometry_msg, int16_t, &odometry_msg::yaw,
+           field<odometry_msg, uint16_t, &odometry_msg::ticks,
+           field<odometry_msg, uint8_t, &odometry_msg::bump> > > > > > >
+              fields;
+};
+
+// IMU orientation: roll, pitch and yaw (rad)
+struct imu_msg {
+   float x;
+   float y;
+   float z;
+   uint16_t ticks;
+};
+
+template<> struct message<imu_msg> {
+   enum { TYPE = 'U' };
+   typedef field<imu_msg, float, &imu_msg::x,
+           field<imu_msg, float, &imu_msg::y,
+           field<imu_msg, float, &imu_msg::z,
+           field<imu_msg, uint16_t, &imu_msg::ticks> > > > fields;
+};
+
+// raw IMU readings, as the filter takes them (see arduino/ahrs.h); only
+//  sent when the AVR is built with IMU_RAW
+struct imu_raw_msg {
+   int16_t ax;
+   int16_t ay;
+   int16_t az;
+   int16_t gx;
+   int16_t gy;
+   int16_t gz;
+   int16_t mx;
+   int16_t my;
+   int16_t mz;
+   int16_t speed;
+   uint16_t ticks;
+};
+
+template<> struct message<imu_raw_msg> {
+   enum { TYPE = 'R' };
+   typedef field<imu_raw_msg, int16_t, &imu_raw_msg::ax,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::ay,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::az,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::gx,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::gy,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::gz,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::mx,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::my,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::mz,
+           field<imu_raw_msg, int16_t, &imu_raw_msg::speed,
+           field<imu_raw_msg, uint16_t, &imu_raw_msg::ticks> > > > > > > > > > >
+              fields;
+};
+
+// GPS position, in millionths of a degree
+struct gps_msg {
+   int32_t lat;
+   int32_t lon;
+   uint16_t ticks;
+};
+
+template<> struct message<gps_msg> {
+   enum { TYPE = 'G' };
+   typedef field<gps_msg, int32_t, &gps_msg::lat,
+           field<gps_msg, int32_t, &gps_msg::lon,
+           field<gps_msg, uint16_t, &gps_msg::ticks> > > fields;
+};
+
+#define NUM_SONARS 5
+
+// sonar ranges (inches)
+struct sonar_msg {
+   uint8_t range[NUM_SONARS];
+   uint16_t ticks;
+};
+
+template<> struct message<sonar_msg> {
+   enum { TYPE = 'S' };
+   typedef field<sonar_msg, uint8_t[NUM_SONARS], &sonar_msg::range,
+           field<sonar_msg, uint16_t, &sonar_msg::ticks> > fields;
+};
+
+// main loop idle time (thousandths of the last second spent asleep), I2C
+//  failed transfers and bus resets, and frames to the brain that were
+//  dropped or deferred for a real-time slot (running counts; they wrap)
+struct idle_msg {
+   uint16_t idle;
+   uint8_t i2c_fail;
+   uint8_t i2c_resets;
+   uint16_t tx_dropped;
+   uint16_t tx_deferred;
+};
+
+template<> struct message<idle_msg> {
+   enum { TYPE = 'I' };
+   typedef field<idle_msg, uint16_t, &idle_msg::idle,
+           field<idle_msg, uint8_t, &idle_msg::i2c_fail,
+           field<idle_msg, uint8_t, &idle_msg::i2c_resets,
+           field<idle_msg, uint16_t, &idle_msg::tx_dropped,
+           field<idle_msg, uint16_t, &idle_msg::tx_deferred> > > > > fields;
+};
+
+// main loop tasks: GPS, command receive, IMU, sonar, status, speed
+//  control, odometry, I2C
+#define NUM_TASKS 8
+
+// for each main loop task, its longest run over the last second (us), and
+//  the runs that missed their deadlines (a running count; wraps); and the
+//  longest the tick interrupt took to finish after its tick (us)
+struct task_msg {
+   uint16_t wcet[NUM_TASKS];
+   uint16_t overruns[NUM_TASKS];
+   uint16_t tick_isr;
+};
+
+template<> struct message<task_msg> {
+   enum { TYPE = 'K' };
+   typedef field<task_msg, uint16_t[NUM_TASKS], &task_msg::wcet,
+           field<task_msg, uint16_t[NUM_TASKS], &task_msg::overruns,
+           field<task_msg, uint16_t, &task_msg::tick_isr> > > fields;
+};
+
+// answer to a heartbeat: its sequence number, and the full tick count
+//  when it arrived
+struct time_msg {
+   uint8_t heartbeat;
+   uint32_t ticks;
+};
+
+template<> struct message<time_msg> {
+   enum { TYPE = 'T' };
+   typedef field<time_msg, uint8_t, &time_msg::heartbeat,
+           field<time_msg, uint32_t, &time_msg::ticks> > fields;
+};
+
+// host to AVR
+
+// drive command: speed in units of 0.016 m/s, and steering
+struct command_msg {
+   int16_t speed;
+   int8_t steer;
+};
+
+template<> struct message<command_msg> {
+   enum { TYPE = 'C' };
+   typedef field<command_msg, int16_t, &command_msg::speed,
+           field<command_msg, int8_t, &command_msg::steer> > fields;
+};
+
+// heartbeat; the AVR only publishes while these keep arriving, and answers
+//  each with a time_msg
+struct heartbeat_msg {
+};
+
+template<> struct message<heartbeat_msg> {
+   enum { TYPE = 'H' };
+   typedef field_end fields;
+};
+
+#endif
@@ -0,0 +1,159 @@
+/* circle.h
+ *
+ * Range segmentation and circle detection on a buffer of scan points.
+ *
+ * Segments are index ranges into the caller's point buffer, so nothing here
+ *  copies points or allocates once the output vectors have grown to size.
+ *  Point types only need public x and y members.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef CIRCLE_H
+#define CIRCLE_H
+
+#include <math.h>
+#include <stddef.h>
+#include <vector>
+
+// a run of points [start, end) in the point buffer
+struct segment {
+   size_t start;
+   size_t end;
+
+   segment(size_t s, size_t e) : start(s), end(e) {}
+   size_t size() const { return end - start; }
+};
+
+// a detected circle
+struct circle {
+   double x;
+   double y;
+   double r;
+};
+
+// circle detection parameters
+struct circle_params {
+   size_t min_circle_size;  // groups must have more than this many points
+   double std_dev_threshold; // inscribed angle std dev threshold (degrees)
+   bool fit;                // refine center and radius with a Kasa fit
+};
+
+// split pts into runs where consecutive points are closer than threshold
+//  segs is cleared first; its capacity is kept between calls
+template<class P>
+void segment_points(const std::vector<P> & pts, double threshold,
+      std::vector<segment> & segs) {
+   segs.clear();
+   if( pts.size() == 0 ) return;
+
+   size_t start = 0;
+   for( size_t i=1; i<pts.size(); ++i ) {
+      if( hypot(pts[i].x - pts[i-1].x, pts[i].y - pts[i-1].y) > threshold ) {
+         segs.push_back(segment(start, i));
+         start = i;
+      }
+   }
+   segs.push_back(segment(start, pts.size()));
+}
+
+// algebraic (Kasa) least-squares circle fit over n points
+//  coordinates are taken relative to the centroid so the normal equations
+//  reduce to a 2x2 system. returns false for degenerate (collinear) input
+template<class P>
+bool fit_circle(const P * pts, size_t n, circle & c) {
+   if( n < 3 ) return false;
+
+   double mx = 0, my = 0;
+   for( size_t i=0; i<n; ++i ) {
+      mx += pts[i].x;
+      my += pts[i].y;
+   }
+   mx /= n;
+   my /= n;
+
+   double suu = 0, svv = 0, suv = 0;
+   double suuu = 0, svvv = 0, suvv = 0, svuu = 0;
+   for( size_t i=0; i<n; ++i ) {
+      double u = pts[i].x - mx;
+      double v = pts[i].y - my;
+      double uu = u*u;
+      double vv = v*v;
+      suu += uu;
+      svv += vv;
+      suv += u*v;
+      suuu += uu*u;
+      svvv += vv*v;
+      suvv += u*vv;
+      svuu += v*uu;
+   }
+
+   double det = suu*svv - suv*suv;
+   if( fabs(det) < 1e-12 ) return false;
+
+   double bu = 0.5 * (suuu + suvv);
+   double bv = 0.5 * (svvv + svuu);
+   double uc = (bu*svv - bv*suv) / det;
+   double vc = (bv*suu - bu*suv) / det;
+
+   c.x = uc + mx;
+   c.y = vc + my;
+   c.r = sqrt(uc*uc + vc*vc + (suu + svv) / n);
+   return true;
+}
+
+// test whether the n points at pts form a circular arc, based on the
+//  inscribed angle method. the inscribed angle mean and variance are
+//  accumulated in a single pass (Welford)
+template<class P>
+bool detect_circle(const P * pts, size_t n, const circle_params & params,
+      circle & c) {
+   if( n <= params.min_circle_size || n < 3 ) return false;
+
+   const P & first = pts[0];
+   const P & last = pts[n-1];
+   const P & middle = pts[n/2];
+
+   double d = hypot(last.x - first.x, last.y - first.y);
+
+   // check prerequisite for circle
+   {
+      double theta = atan2(last.x - first.x, last.y - first.y);
+      double x2 = - (((middle.x-first.x) * cos(theta)) -
+            ((middle.y-first.y) * sin(theta)));
+      if( 0.1 * d > x2 ) return false;
+      if( 0.7 * d < x2 ) return false;
+   }
+
+   // inscribed angles for each inner point
+   double mean = 0;
+   double m2 = 0;
+   size_t k = 0;
+   for( size_t i=1; i<n-1; ++i ) {
+      const P & p = pts[i];
+      double angle = atan2(first.y - p.y, first.x - p.x) -
+         atan2(last.y - p.y, last.x - p.x);
+      ++k;
+      double delta = angle - mean;
+      mean += delta / k;
+      m2 += delta * (angle - mean);
+   }
+
+   double std_dev = sqrt(m2 / k) * 180.0 / M_PI;
+   if( std_dev >= params.std_dev_threshold ) return false;
+
+   if( params.fit && fit_circle(pts, n, c) ) return true;
+
+   // compute center of circle from the mean inscribed angle
+   double theta = atan2(last.y - first.y, last.x - first.x);
+
+   double x = d / 2;
+   double y = d * tan(mean - M_PI/2.0);
+
+   c.x = first.x + x * cos(theta) - y*sin(theta);
+   c.y = first.y + y * cos(theta) + x*sin(theta);
+   c.r = hypot(x, y);
+   return true;
+}
+
+#endif
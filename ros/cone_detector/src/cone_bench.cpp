@@ -0,0 +1,100 @@
+/* cone_bench.cpp
+ *
+ * Measure segmentation and circle detection throughput on recorded scans.
+ *
+ * Usage: cone_bench <bagfile> [topic] [passes]
+ *
+ * Scans are converted to points in the laser frame (no tf), then segmented
+ *  and searched for circles with the same code the cone_detector uses.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vector>
+#include <boost/foreach.hpp>
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/LaserScan.h>
+
+#include "circle.h"
+
+struct point {
+   double x;
+   double y;
+};
+
+int main(int argc, char ** argv) {
+   if( argc < 2 ) {
+      fprintf(stderr, "Usage: cone_bench <bagfile> [topic] [passes]\n");
+      return -1;
+   }
+   std::string topic = argc > 2 ? argv[2] : "scan";
+   int passes = argc > 3 ? atoi(argv[3]) : 10;
+
+   // load all scans up front so we only time the processing
+   std::vector<sensor_msgs::LaserScan::ConstPtr> scans;
+   rosbag::Bag bag(argv[1]);
+   rosbag::View view(bag, rosbag::TopicQuery(topic));
+   BOOST_FOREACH(rosbag::MessageInstance const m, view) {
+      sensor_msgs::LaserScan::ConstPtr s =
+         m.instantiate<sensor_msgs::LaserScan>();
+      if( s ) scans.push_back(s);
+   }
+   bag.close();
+
+   if( scans.size() == 0 ) {
+      fprintf(stderr, "No scans on topic %s\n", topic.c_str());
+      return -1;
+   }
+
+   std::vector<point> points;
+   std::vector<segment> segments;
+
+   circle_params params;
+   params.min_circle_size = 4;
+   params.std_dev_threshold = 15.0;
+
+   for( int fit = 0; fit < 2; ++fit ) {
+      params.fit = fit;
+      long circles = 0;
+      long segs = 0;
+      ros::WallTime start = ros::WallTime::now();
+      for( int pass = 0; pass < passes; ++pass ) {
+         BOOST_FOREACH(const sensor_msgs::LaserScan::ConstPtr & s, scans) {
+            points.clear();
+            double theta = s->angle_min;
+            for( size_t i=0; i<s->ranges.size();
+                  ++i, theta += s->angle_increment ) {
+               if( s->ranges[i] >= s->range_min ) {
+                  point p;
+                  p.x = s->ranges[i] * cos(theta);
+                  p.y = s->ranges[i] * sin(theta);
+                  points.push_back(p);
+               }
+            }
+
+            segment_points(points, 0.05, segments);
+            segs += segments.size();
+            BOOST_FOREACH(const segment & seg, segments) {
+               circle c;
+               if( detect_circle(&points[seg.start], seg.size(), params, c) ) {
+                  ++circles;
+               }
+            }
+         }
+      }
+      double t = (ros::WallTime::now() - start).toSec();
+      long n = (long)scans.size() * passes;
+      printf("fit %d: %ld scans in %lf s: %lf scans/s, %lf us/scan, "
+            "%ld segments, %ld circles\n", fit, n, t, n / t, t * 1e6 / n,
+            segs, circles);
+   }
+
+   return 0;
+}
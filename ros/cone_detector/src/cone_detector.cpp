@@ -5,111 +5,279 @@
  * Based on a paper by Joao Xavier, Marco Pacheco, Daniel Castro, Antonio Ruano
  *  and Urbano Nunes
  *
+ * Processing is split into two pipelined stages:
+ *  1) conversion and segmentation, in the ROS callback thread
+ *  2) circle detection, tracking and publishing, in a worker thread
+ *  joined by a lock-free ring of preallocated frames. Per-stage latency and
+ *  drop counts are published as diagnostics.
+ *
  * Author: Austin Hendrix
  *
- * Sleep: none
+ * Sleep: stage 2 waits on a semaphore for frames
  */
 
+#include <semaphore.h>
+#include <time.h>
+
 #include <ros/ros.h>
 
-#include <list>
+#include <vector>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
-#include <geometry_msgs/PointStamped.h>
+#include <geometry_msgs/Point.h>
 #include <sensor_msgs/LaserScan.h>
+#include <message_filters/subscriber.h>
 #include <tf/transform_listener.h>
+#include <tf/message_filter.h>
 #include <visualization_msgs/Marker.h>
+#include <visualization_msgs/MarkerArray.h>
 
+#include <diagnostic_updater/diagnostic_updater.h>
 #include <dynamic_reconfigure/server.h>
 #include <cone_detector/ConeDetectorConfig.h>
 
-double dist(geometry_msgs::Point a, geometry_msgs::Point b) {
-   return hypot(a.x - b.x, a.y - b.y);
-}
+#include "circle.h"
+#include "cone_tracker.h"
+#include "spsc_ring.h"
+
+// a scan after stage 1: points in /odom and their segmentation
+struct scan_frame {
+   ros::Time stamp;
+   double convert_time; // stage 1 processing time (s)
+   ros::WallTime queued; // when stage 1 handed the frame to stage 2
+   std::vector<geometry_msgs::Point> points;
+   std::vector<segment> segments;
+};
 
-double dist(geometry_msgs::PointStamped a, geometry_msgs::PointStamped b) {
-   return dist(a.point, b.point);
-}
+// latency statistics over a diagnostics window
+struct latency_stats {
+   double total;
+   double max;
+   int count;
+
+   latency_stats() { reset(); }
+   void reset() { total = 0; max = 0; count = 0; }
+   void add(double t) {
+      total += t;
+      if( t > max ) max = t;
+      ++count;
+   }
+   double avg() const { return count ? total / count : 0.0; }
+};
 
 class ConeDetector {
 private:
    ros::NodeHandle n;
    tf::TransformListener listener;
-   ros::Subscriber laser_sub;
+   // scans are queued here until the /odom transform for them is available,
+   //  so the callback never has to wait on tf
+   message_filters::Subscriber<sensor_msgs::LaserScan> laser_sub;
+   tf::MessageFilter<sensor_msgs::LaserScan> laser_filter;
    ros::Publisher marker_pub;
+   ros::Publisher track_pub;
    dynamic_reconfigure::Server<cone_detector::ConeDetectorConfig> server;
 
-   // last seen and point
-   typedef std::pair<ros::Time, geometry_msgs::Point> cone_type;
-   typedef std::list<cone_type> cone_list;
-   cone_list cones;
+   // stage 2 state; tracker and detection parameters are guarded by
+   //  config_mutex since reconfigure runs in the callback thread
+   boost::mutex config_mutex;
+   cone_tracker tracker;
+   ros::Time last_scan;
+
+   // pipeline between stage 1 and stage 2
+   spsc_ring<scan_frame, 4> frames;
+   sem_t frames_ready;
+   boost::thread worker;
+   volatile bool running;
+
+   // drop counters; written by stage 1 only
+   volatile unsigned tf_drops;   // scans dropped waiting for tf
+   volatile unsigned ring_drops; // scans dropped because stage 2 was busy
+
+   // diagnostics; stage 2 only
+   diagnostic_updater::Updater updater;
+   latency_stats convert_latency; // stage 1 processing
+   latency_stats queue_latency;   // waiting between stages
+   latency_stats detect_latency;  // stage 2 processing
+   latency_stats total_latency;   // scan stamp to publish
+   unsigned last_tf_drops;
+   unsigned last_ring_drops;
 
    double grouping_threshold;
    int min_circle_size;
    double std_dev_threshold;
-   double same_cone_threshold;
    double min_cone_radius;
    double max_cone_radius;
+   bool motion_compensation;
+   bool circle_fit;
+
 public:
-   ConeDetector() : listener(n, ros::Duration(20.0)) {
-      laser_sub = n.subscribe("scan", 1, &ConeDetector::laserCallback, this);
-      marker_pub = n.advertise<visualization_msgs::Marker>("cone_markers", 1);;
+   ConeDetector() : listener(n, ros::Duration(20.0)),
+         laser_sub(n, "scan", 10),
+         laser_filter(laser_sub, listener, "/odom", 10),
+         running(true), tf_drops(0), ring_drops(0),
+         last_tf_drops(0), last_ring_drops(0) {
+      laser_filter.registerCallback(
+            boost::bind(&ConeDetector::laserCallback, this, _1));
+      laser_filter.registerFailureCallback(
+            boost::bind(&ConeDetector::tfFailureCallback, this, _1, _2));
+      marker_pub = n.advertise<visualization_msgs::Marker>("cone_markers", 1);
+      track_pub = n.advertise<visualization_msgs::MarkerArray>("cone_tracks",
+            1);
       
       min_circle_size = 4;
       grouping_threshold = 0.05;
       std_dev_threshold = 15.0;
-      same_cone_threshold = 0.25;
       min_cone_radius = 0.1;
       max_cone_radius = 0.2;
+      motion_compensation = true;
+      circle_fit = false;
 
       server.setCallback(boost::bind(&ConeDetector::reconfigureCb, 
                this, _1, _2));
+
+      updater.setHardwareID("none");
+      updater.add("Cone Detector Pipeline", 
+            boost::bind(&ConeDetector::pipelineDiagnostics, this, _1));
+
+      sem_init(&frames_ready, 0, 0);
+      worker = boost::thread(boost::bind(&ConeDetector::detectLoop, this));
    }
 
-   void laserCallback(const sensor_msgs::LaserScan::ConstPtr & msg) {
-      std::list<std::list<geometry_msgs::Point> > groups;
-      groups.push_back(std::list<geometry_msgs::Point>());
+   ~ConeDetector() {
+      running = false;
+      sem_post(&frames_ready);
+      worker.join();
+      sem_destroy(&frames_ready);
+   }
 
-      // range segmentation
-      geometry_msgs::PointStamped prev;
-      geometry_msgs::PointStamped a, b;
+   // look up the 2D pose (x, y, yaw) of the laser in /odom at time t
+   void laserPose(const std::string & frame, ros::Time t, 
+         double & x, double & y, double & yaw) {
+      tf::StampedTransform transform;
+      listener.lookupTransform("/odom", frame, t, transform);
+      x = transform.getOrigin().x();
+      y = transform.getOrigin().y();
+      yaw = tf::getYaw(transform.getRotation());
+   }
+
+   // convert a scan into points in the /odom frame
+   //  one transform lookup per scan (two with motion compensation); each beam
+   //  is then placed with a 2D rigid transform
+   void scanToPoints(const sensor_msgs::LaserScan::ConstPtr & msg,
+         std::vector<geometry_msgs::Point> & points) {
+      points.clear();
+      if( msg->ranges.size() < 2 ) return;
+
+      double x0, y0, yaw0;
+      laserPose(msg->header.frame_id, msg->header.stamp, x0, y0, yaw0);
+
+      // pose change from the first to the last beam of the scan
+      double dx = 0, dy = 0, dyaw = 0;
+      if( motion_compensation && msg->time_increment > 0 ) {
+         ros::Time end = msg->header.stamp + 
+            ros::Duration(msg->time_increment * (msg->ranges.size() - 1));
+         try {
+            double x1, y1, yaw1;
+            laserPose(msg->header.frame_id, end, x1, y1, yaw1);
+            dx = x1 - x0;
+            dy = y1 - y0;
+            dyaw = yaw1 - yaw0;
+            while( dyaw >  M_PI ) dyaw -= M_PI*2;
+            while( dyaw < -M_PI ) dyaw += M_PI*2;
+         } catch(tf::TransformException e) {
+            // end of scan isn't available yet; treat the scan as instantaneous
+            ROS_DEBUG("%s", e.what());
+         }
+      }
+
+      double step = 1.0 / (msg->ranges.size() - 1);
+      geometry_msgs::Point p;
+      p.z = 0;
+      double theta = msg->angle_min;
+      for( size_t i=0; i < msg->ranges.size(); ++i, 
+            theta += msg->angle_increment ) {
+         double r = msg->ranges[i];
+         if( r >= msg->range_min ) {
+            double f = i * step;
+            double angle = theta + yaw0 + f * dyaw;
+            p.x = x0 + f * dx + r * cos(angle);
+            p.y = y0 + f * dy + r * sin(angle);
+            points.push_back(p);
+         }
+      }
+   }
 
-      a.header = msg->header;
-      //a.header.stamp = ros::Time(0);
-      a.point.z = 0;
+   void tfFailureCallback(const sensor_msgs::LaserScan::ConstPtr & msg,
+         tf::filter_failure_reasons::FilterFailureReason reason) {
+      ++tf_drops;
+   }
+
+   // stage 1: convert and segment a scan, then hand it to stage 2
+   void laserCallback(const sensor_msgs::LaserScan::ConstPtr & msg) {
+      ros::WallTime start = ros::WallTime::now();
 
-      listener.waitForTransform("/odom", msg->header.frame_id,
-            msg->header.stamp, ros::Duration(0.5));
+      scan_frame * frame = frames.write_slot();
+      if( !frame ) {
+         // stage 2 is still behind; drop this scan rather than queue it
+         ++ring_drops;
+         return;
+      }
 
       try {
-         double theta = msg->angle_min;
-         for( size_t i=0; i < msg->ranges.size(); ++i, 
-               theta += msg->angle_increment) {
-            double r = msg->ranges[i];
-            if( r >= msg->range_min ) {
-               a.point.x = r * cos(theta);
-               a.point.y = r * sin(theta);
-               listener.transformPoint("/odom", a, b);
-
-               double d = dist(b, prev);
-               if( d > grouping_threshold ) {
-                  groups.push_back(std::list<geometry_msgs::Point>());
-               }
-               groups.back().push_back(b.point);
-               prev = b;
-            }
-         }
+         scanToPoints(msg, frame->points);
       } catch(tf::TransformException e) {
          ROS_ERROR("%s", e.what());
+         return;
+      }
+
+      // range segmentation
+      segment_points(frame->points, grouping_threshold, frame->segments);
+
+      frame->stamp = msg->header.stamp;
+      frame->queued = ros::WallTime::now();
+      frame->convert_time = (frame->queued - start).toSec();
+      frames.push();
+      sem_post(&frames_ready);
+   }
+
+   // stage 2 thread: wait for frames and process them
+   void detectLoop() {
+      while( running && ros::ok() ) {
+         // wake up periodically so diagnostics and shutdown still happen
+         struct timespec timeout;
+         clock_gettime(CLOCK_REALTIME, &timeout);
+         timeout.tv_nsec += 100000000; // 100ms
+         if( timeout.tv_nsec >= 1000000000 ) {
+            timeout.tv_nsec -= 1000000000;
+            ++timeout.tv_sec;
+         }
+         if( sem_timedwait(&frames_ready, &timeout) == 0 ) {
+            scan_frame * frame = frames.read_slot();
+            if( frame ) {
+               detect(*frame);
+               frames.pop();
+            }
+         }
+         updater.update();
       }
+   }
+
+   // stage 2: circle detection, tracking and publishing
+   void detect(const scan_frame & frame) {
+      ros::WallTime start = ros::WallTime::now();
+      boost::mutex::scoped_lock lock(config_mutex);
 
-      // new cones
-      cone_list new_cones;
+      // grow track uncertainty by the time since the last scan
+      double dt = last_scan.isZero() ? 0.0 : 
+         (frame.stamp - last_scan).toSec();
+      last_scan = frame.stamp;
+      tracker.predict(dt);
 
       // set up markers
       visualization_msgs::Marker markers;
       markers.header.frame_id = "/odom";
-      markers.header.stamp = msg->header.stamp;
+      markers.header.stamp = frame.stamp;
       markers.type = visualization_msgs::Marker::POINTS;
       markers.action = visualization_msgs::Marker::MODIFY;
 
@@ -122,118 +290,120 @@ public:
       markers.scale.y = 0.05;
       markers.scale.z = 0.05;
 
-      // circle detection
-      BOOST_FOREACH(std::list<geometry_msgs::Point> group, groups) {
-         if( group.size() > min_circle_size ) {
-            // calculate inscribed angles for each inner point in group
-            std::list<double> angles;
-            double avg_angle = 0;
-            geometry_msgs::Point first = group.front();
-            geometry_msgs::Point last = group.back();
-            geometry_msgs::Point center;
-            int i=0;
-            int j=0;
-            BOOST_FOREACH(geometry_msgs::Point p, group) {
-               if( i > 0 && i < (group.size() - 1) ) {
-                  // compute inscribed angle
-                  double angle = atan2(first.y - p.y, first.x - p.x) - 
-                     atan2(last.y - p.y, last.x - p.x);
-                  angles.push_back(angle);
-                  avg_angle += angle;
-                  ++j;
-               }
-               if( i == group.size()/2 ) {
-                  center = p;
-               }
-               ++i;
-            }
-            // check prerequisite for circle
-            bool circle = true;
-            {
-               double theta = atan2(last.x - first.x, last.y - first.y);
-               double x2 = - (((center.x-first.x) * cos(theta)) - 
-                     ((center.y-first.y) * sin(theta)));
-               if( 0.1 * dist(first, last) > x2 ) circle = false;
-               if( 0.7 * dist(first, last) < x2 ) circle = false;
-            }
+      circle_params params;
+      params.min_circle_size = min_circle_size;
+      params.std_dev_threshold = std_dev_threshold;
+      params.fit = circle_fit;
 
-            if( circle ) {
-               // average inscribed angle
-               avg_angle /= (group.size() - 2);
-
-               // standard deviation
-               double std_dev = 0;
-               BOOST_FOREACH(double a, angles) {
-                  std_dev += (a - avg_angle) * (a - avg_angle);
-               }
-               std_dev /= (group.size() - 2);
-               std_dev = sqrt(std_dev) * 180.0 / M_PI;
-               if( std_dev < std_dev_threshold ) {
-                  // compute center of circle
-                  double theta = atan2(last.y - first.y, last.x - first.x);
-                  double d = dist(first, last);
-
-                  double x = d / 2;
-                  double y = d * tan(avg_angle - M_PI/2.0);
-
-                  center.x = first.x + x * cos(theta) - y*sin(theta);
-                  center.y = first.y + y * cos(theta) + x*sin(theta);
-
-                  double r = hypot(x, y);
-
-                  if( r > min_cone_radius && r < max_cone_radius ) {
-                     //markers.points.push_back(center);
-
-                     ROS_INFO("Found circle with radius %lf", r);
-
-                     if( cones.size() > 0 ) {
-                        cone_list::iterator nearest = cones.begin();
-                        d = dist(cones.front().second, center);
-                        // determine if this is a cone we've seen before
-                        for( cone_list::iterator itr = cones.begin(); 
-                              itr != cones.end(); ++itr ) {
-                           if( dist(itr->second, center) < d ) {
-                              d = dist(itr->second, center);
-                              nearest = itr;
-                           }
-                        }
-                        if( dist(nearest->second, center) < 
-                              same_cone_threshold ) {
-                           cones.erase(nearest);
-                        }
-                     }
-                     new_cones.push_back(cone_type(ros::Time::now(), center));
-                     // markers at ends of arc
-                     //markers.points.push_back(first);
-                     //markers.points.push_back(last);
-                  }
-               }
+      // circle detection
+      BOOST_FOREACH(const segment & seg, frame.segments) {
+         circle c;
+         if( detect_circle(&frame.points[seg.start], seg.size(), params, c) ) {
+            if( c.r > min_cone_radius && c.r < max_cone_radius ) {
+               ROS_DEBUG("Found circle with radius %lf", c.r);
+               tracker.update(c.x, c.y);
             }
          }
       }
-
-      BOOST_FOREACH(cone_type p, cones) {
-         // TODO: dynamic_reconfigure parameter
-         if( p.first > (ros::Time::now() - ros::Duration(2.0)) ) {
-            new_cones.push_back(p);
+      tracker.finish();
+
+      // confirmed cones as a single points marker, plus a marker per track
+      //  with the track id, so consumers can follow individual cones
+      visualization_msgs::MarkerArray tracks;
+      visualization_msgs::Marker track;
+      track.header = markers.header;
+      track.ns = "cone_tracks";
+      track.type = visualization_msgs::Marker::CYLINDER;
+      track.action = visualization_msgs::Marker::ADD;
+      track.pose.orientation.w = 1.0;
+      track.color = markers.color;
+      track.scale.x = 0.3;
+      track.scale.y = 0.3;
+      track.scale.z = 0.5;
+      track.pose.position.z = 0.25;
+      BOOST_FOREACH(const cone_track & t, tracker.tracks()) {
+         if( t.confirmed ) {
+            geometry_msgs::Point p;
+            p.x = t.x;
+            p.y = t.y;
+            p.z = 0;
+            markers.points.push_back(p);
+
+            track.id = t.id;
+            track.pose.position.x = t.x;
+            track.pose.position.y = t.y;
+            tracks.markers.push_back(track);
          }
       }
-      cones.clear();
-      BOOST_FOREACH(cone_type p, new_cones) {
-         markers.points.push_back(p.second);
-         cones.push_back(p);
+      track.action = visualization_msgs::Marker::DELETE;
+      BOOST_FOREACH(uint32_t id, tracker.deleted()) {
+         track.id = id;
+         tracks.markers.push_back(track);
       }
       marker_pub.publish(markers);
+      track_pub.publish(tracks);
+
+      ros::WallTime end = ros::WallTime::now();
+      convert_latency.add(frame.convert_time);
+      queue_latency.add((start - frame.queued).toSec());
+      detect_latency.add((end - start).toSec());
+      total_latency.add((ros::Time::now() - frame.stamp).toSec());
+   }
+
+   void pipelineDiagnostics(diagnostic_updater::DiagnosticStatusWrapper & 
+         stat) {
+      unsigned tf = tf_drops;
+      unsigned ring = ring_drops;
+      unsigned new_drops = (tf - last_tf_drops) + (ring - last_ring_drops);
+
+      if( new_drops > 0 ) {
+         stat.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+               "Warning: %u scans dropped", new_drops);
+      } else if( convert_latency.count == 0 ) {
+         stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+               "Warning: No scans");
+      } else {
+         stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+               "OK: Keeping up with laser");
+      }
+
+      stat.addf("Scans", "%d", convert_latency.count);
+      stat.addf("Convert Latency", "avg %.2f ms, max %.2f ms",
+            convert_latency.avg() * 1000.0, convert_latency.max * 1000.0);
+      stat.addf("Queue Latency", "avg %.2f ms, max %.2f ms",
+            queue_latency.avg() * 1000.0, queue_latency.max * 1000.0);
+      stat.addf("Detect Latency", "avg %.2f ms, max %.2f ms",
+            detect_latency.avg() * 1000.0, detect_latency.max * 1000.0);
+      stat.addf("Total Latency", "avg %.2f ms, max %.2f ms",
+            total_latency.avg() * 1000.0, total_latency.max * 1000.0);
+      stat.addf("TF Drops", "%u (%u total)", tf - last_tf_drops, tf);
+      stat.addf("Pipeline Drops", "%u (%u total)", ring - last_ring_drops,
+            ring);
+
+      last_tf_drops = tf;
+      last_ring_drops = ring;
+      convert_latency.reset();
+      queue_latency.reset();
+      detect_latency.reset();
+      total_latency.reset();
    }
 
    void reconfigureCb(cone_detector::ConeDetectorConfig & config, 
          uint32_t level) {
+      boost::mutex::scoped_lock lock(config_mutex);
       grouping_threshold  = config.grouping_threshold;
       min_circle_size     = config.min_circle_size;
       std_dev_threshold   = config.std_dev_threshold;
-      same_cone_threshold = config.same_cone_threshold;
       min_cone_radius     = config.min_cone_radius;
       max_cone_radius     = config.max_cone_radius;
+      motion_compensation = config.motion_compensation;
+      circle_fit          = config.circle_fit;
+
+      tracker.gate              = config.same_cone_threshold;
+      tracker.process_noise     = config.process_noise;
+      tracker.measurement_noise = config.measurement_noise;
+      tracker.confirm_hits      = config.confirm_hits;
+      tracker.max_misses        = config.max_misses;
    }
 };
 
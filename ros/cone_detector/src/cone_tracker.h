@@ -0,0 +1,175 @@
+/* cone_tracker.h
+ *
+ * Track store for detected cones.
+ *
+ * Each track filters its center with a constant-position Kalman filter
+ *  (isotropic variance, so the filter is scalar per track). Tracks are
+ *  confirmed after a number of hits and deleted after a number of
+ *  consecutive misses. Detections are associated through a uniform grid
+ *  hash with cells the size of the association gate, so only the 3x3 cells
+ *  around a detection are searched.
+ *
+ * Usage, once per scan:
+ *    tracker.predict(dt);
+ *    for each detection: tracker.update(x, y);
+ *    tracker.finish();
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef CONE_TRACKER_H
+#define CONE_TRACKER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+struct cone_track {
+   uint32_t id;
+   double x;
+   double y;
+   double variance; // position variance, per axis (m^2)
+   int hits;        // total number of associated detections
+   int misses;      // consecutive scans without a detection
+   bool confirmed;
+   bool updated;    // associated with a detection this scan
+};
+
+class cone_tracker {
+   public:
+      // tracker parameters
+      double gate;              // association distance (m)
+      double process_noise;     // variance growth per second (m^2/s)
+      double measurement_noise; // detection variance (m^2)
+      int confirm_hits;
+      int max_misses;
+
+      cone_tracker() : gate(0.25), process_noise(0.01),
+         measurement_noise(0.0025), confirm_hits(3), max_misses(20),
+         next_id(0) {}
+
+      // start a new scan; grow track uncertainty by dt seconds of noise
+      void predict(double dt) {
+         if( dt < 0 ) dt = 0;
+         for( size_t i=0; i<store.size(); ++i ) {
+            store[i].variance += process_noise * dt;
+            store[i].updated = false;
+         }
+         rebuild();
+      }
+
+      // associate a detection with the nearest free track inside the gate,
+      //  or start a new track. returns the track id
+      uint32_t update(double x, double y) {
+         int cx = cell(x);
+         int cy = cell(y);
+
+         int best = -1;
+         double best_d = gate;
+         for( int i=cx-1; i<=cx+1; ++i ) {
+            for( int j=cy-1; j<=cy+1; ++j ) {
+               grid_type::const_iterator c = grid.find(key(i, j));
+               if( c == grid.end() ) continue;
+               for( int t = c->second; t >= 0; t = next[t] ) {
+                  if( store[t].updated ) continue;
+                  double d = hypot(store[t].x - x, store[t].y - y);
+                  if( d < best_d ) {
+                     best_d = d;
+                     best = t;
+                  }
+               }
+            }
+         }
+
+         if( best < 0 ) {
+            cone_track t;
+            t.id = next_id++;
+            t.x = x;
+            t.y = y;
+            t.variance = measurement_noise;
+            t.hits = 1;
+            t.misses = 0;
+            t.confirmed = confirm_hits <= 1;
+            t.updated = true;
+            store.push_back(t);
+            insert(store.size() - 1);
+            return t.id;
+         }
+
+         // Kalman measurement update
+         cone_track & t = store[best];
+         double gain = t.variance / (t.variance + measurement_noise);
+         t.x += gain * (x - t.x);
+         t.y += gain * (y - t.y);
+         t.variance *= (1 - gain);
+         ++t.hits;
+         t.misses = 0;
+         if( t.hits >= confirm_hits ) t.confirmed = true;
+         t.updated = true;
+         return t.id;
+      }
+
+      // end the scan: count misses and delete stale tracks
+      //  ids of deleted tracks are left in deleted() until the next finish()
+      void finish() {
+         removed.clear();
+         size_t j = 0;
+         for( size_t i=0; i<store.size(); ++i ) {
+            if( !store[i].updated ) ++store[i].misses;
+            if( store[i].misses > max_misses ) {
+               removed.push_back(store[i].id);
+            } else {
+               store[j++] = store[i];
+            }
+         }
+         store.resize(j);
+      }
+
+      const std::vector<cone_track> & tracks() const { return store; }
+      const std::vector<uint32_t> & deleted() const { return removed; }
+
+   private:
+      // grid cell key; cells are gate-sized
+      typedef boost::unordered_map<uint64_t, int> grid_type;
+
+      std::vector<cone_track> store;
+      std::vector<uint32_t> removed;
+      uint32_t next_id;
+
+      // grid cell -> first track index; next[] chains tracks in a cell
+      grid_type grid;
+      std::vector<int> next;
+
+      int cell(double v) const {
+         // a zero gate can never associate; any cell size will do
+         return gate > 0 ? (int)floor(v / gate) : 0;
+      }
+
+      static uint64_t key(int i, int j) {
+         return ((uint64_t)(uint32_t)i << 32) | (uint32_t)j;
+      }
+
+      void insert(size_t t) {
+         if( next.size() <= t ) next.resize(t + 1);
+         uint64_t k = key(cell(store[t].x), cell(store[t].y));
+         grid_type::iterator c = grid.find(k);
+         if( c == grid.end() ) {
+            next[t] = -1;
+            grid[k] = t;
+         } else {
+            next[t] = c->second;
+            c->second = t;
+         }
+      }
+
+      void rebuild() {
+         grid.clear();
+         next.resize(store.size());
+         for( size_t i=0; i<store.size(); ++i ) {
+            insert(i);
+         }
+      }
+};
+
+#endif
@@ -0,0 +1,61 @@
+/* spsc_ring.h
+ *
+ * A lock-free single-producer, single-consumer ring of preallocated slots.
+ *
+ * The producer fills the slot returned by write_slot() in place and then
+ *  calls push(); the consumer reads the slot returned by read_slot() and
+ *  then calls pop(). Slots are never freed, so anything they own (vectors,
+ *  etc) keeps its capacity from one use to the next.
+ *
+ * N must be a power of two.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+template<class T, unsigned N>
+class spsc_ring {
+   private:
+      T slots[N];
+      // head is only written by the producer, tail only by the consumer.
+      //  both count up forever; the slot index is the count mod N
+      volatile unsigned head;
+      volatile unsigned tail;
+
+      // compile-time check that N is a power of two
+      typedef char n_is_power_of_two[(N & (N - 1)) == 0 ? 1 : -1];
+
+   public:
+      spsc_ring() : head(0), tail(0) {}
+
+      // producer: the next free slot, or 0 if the ring is full
+      T * write_slot() {
+         if( head - tail >= N ) return 0;
+         return &slots[head & (N - 1)];
+      }
+
+      // producer: publish the slot from write_slot()
+      void push() {
+         __sync_synchronize(); // slot contents before the new head
+         head = head + 1;
+      }
+
+      // consumer: the oldest full slot, or 0 if the ring is empty
+      T * read_slot() {
+         if( head == tail ) return 0;
+         __sync_synchronize(); // new head before the slot contents
+         return &slots[tail & (N - 1)];
+      }
+
+      // consumer: release the slot from read_slot()
+      void pop() {
+         __sync_synchronize(); // finish reading before the slot is reused
+         tail = tail + 1;
+      }
+
+      unsigned size() const { return head - tail; }
+};
+
+#endif
@@ -0,0 +1,44 @@
+/* distance_field.h
+ *
+ * Distance-to-nearest-obstacle transform of the global map, for scoring
+ *  laser scans with one lookup per beam.
+ *
+ * Each output cell is the Euclidean distance to the nearest obstacle
+ *  (occupancy > 0), in map cells, rounded and saturated at FIELD_MAX.
+ *  Unknown cells count as free.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef GLOBAL_MAP_DISTANCE_FIELD_H
+#define GLOBAL_MAP_DISTANCE_FIELD_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace global_map {
+
+   // largest stored distance, in cells; also how far beyond a region the
+   //  occupancy has to be read to get that region's distances exactly
+   const int FIELD_MAX = 255;
+
+   // exact Euclidean distance transform (Felzenszwalb and Huttenlocher);
+   //  keeps its scratch space between calls
+   class distance_transform {
+      public:
+         // occupancy and out are row-major, w by h
+         void compute(const int8_t * occupancy, int w, int h, uint8_t * out);
+
+      private:
+         std::vector<double> d;
+         std::vector<double> f;
+         std::vector<double> out;
+         std::vector<int> v;
+         std::vector<double> z;
+
+         void edt_1d(int n);
+   };
+
+}
+
+#endif
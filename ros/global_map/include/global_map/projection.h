@@ -0,0 +1,36 @@
+/* projection.h
+ *
+ * Transverse mercator projection between lat/lon and global map
+ *  coordinates, shared by the map server and anything that needs map
+ *  coordinates without a service round trip.
+ *
+ * Map coordinates are in decimeters from the meridian origin; x (col) is
+ *  east and y (row) is north.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef GLOBAL_MAP_PROJECTION_H
+#define GLOBAL_MAP_PROJECTION_H
+
+#include <stdint.h>
+
+namespace global_map {
+
+   // size of one map cell, in meters
+   const double MAP_RES = 0.1;
+
+   // the meridian for a given longitude, in degrees
+   int16_t meridian_for(double lon);
+
+   // lat/lon (degrees) to map coordinates relative to meridian
+   void project(double lat, double lon, int16_t meridian,
+         double & x, double & y);
+
+   // map coordinates relative to meridian back to lat/lon (degrees)
+   void unproject(double x, double y, int16_t meridian,
+         double & lat, double & lon);
+
+}
+
+#endif
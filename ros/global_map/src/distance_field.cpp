@@ -0,0 +1,74 @@
+/* distance_field.cpp
+ *
+ * Distance-to-nearest-obstacle transform of the global map.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <math.h>
+
+#include "global_map/distance_field.h"
+
+// squared distance for cells with no obstacle; finite so the parabola
+//  intersections stay exact, and far beyond any real window
+#define FIELD_INF 1e10
+
+namespace global_map {
+
+   void distance_transform::compute(const int8_t * occupancy, int w, int h,
+         uint8_t * dist) {
+      // squared distances, transformed along columns and then rows
+      d.resize(w * h);
+      for( int i=0; i<w*h; i++ ) {
+         d[i] = occupancy[i] > 0 ? 0.0 : FIELD_INF;
+      }
+      int n = w > h ? w : h;
+      f.resize(n);
+      out.resize(n);
+      v.resize(n);
+      z.resize(n + 1);
+
+      for( int x=0; x<w; x++ ) {
+         for( int y=0; y<h; y++ ) f[y] = d[x + y*w];
+         edt_1d(h);
+         for( int y=0; y<h; y++ ) d[x + y*w] = out[y];
+      }
+      for( int y=0; y<h; y++ ) {
+         for( int x=0; x<w; x++ ) f[x] = d[x + y*w];
+         edt_1d(w);
+         for( int x=0; x<w; x++ ) {
+            double e = sqrt(out[x]);
+            dist[x + y*w] = e < FIELD_MAX ? (uint8_t)(e + 0.5) : FIELD_MAX;
+         }
+      }
+   }
+
+   /* 1D squared Euclidean distance transform of f into out: the lower
+    *  envelope of parabolas rooted at each sample
+    */
+   void distance_transform::edt_1d(int n) {
+      int k = 0;
+      v[0] = 0;
+      z[0] = -FIELD_INF;
+      z[1] = FIELD_INF;
+      for( int q=1; q<n; q++ ) {
+         double s;
+         while( true ) {
+            s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+            if( s > z[k] || k == 0 ) break;
+            --k;
+         }
+         if( s > z[k] ) ++k;
+         v[k] = q;
+         z[k] = k ? s : -FIELD_INF;
+         z[k+1] = FIELD_INF;
+      }
+      k = 0;
+      for( int q=0; q<n; q++ ) {
+         while( z[k+1] < q ) ++k;
+         double dq = q - v[k];
+         out[q] = dq*dq + f[v[k]];
+      }
+   }
+
+}
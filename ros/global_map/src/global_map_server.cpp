@@ -22,6 +22,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <stdint.h>
 #include <math.h>
 #include <fcntl.h>
@@ -36,6 +37,11 @@
 #include "global_map/SetMeridian.h"
 #include "global_map/Offset.h"
 #include "global_map/RevOffset.h"
+#include "global_map/Field.h"
+#include "global_map/projection.h"
+#include "global_map/distance_field.h"
+
+#include <boost/shared_array.hpp>
 
 using namespace std;
 
@@ -46,16 +52,10 @@ using namespace std;
 class map_hunk {
 public:
    int last_use;
-   int8_t * data;
+   // reference counted, so copies into the cache share the buffer
+   boost::shared_array<int8_t> data;
 
-   map_hunk() : last_use(0) { 
-      data = (int8_t*)malloc(HUNK_SZ);
-      if( data == NULL ) {
-         ROS_ERROR("Failed to allocate map hunk: %s", strerror(errno));
-      }
-   }
-   ~map_hunk() { free(data); }
-   // TODO: copy constructor. deal with handling buffer/reference counting
+   map_hunk() : last_use(0), data(new int8_t[HUNK_SZ]) {}
 };
 //typedef uint8_t map_hunk[HUNK_SZ][HUNK_SZ];
 
@@ -70,6 +70,23 @@ cache_type * cache;
 // usage counter; for updating last-used counts
 int use_count = 0;
 
+// the distance-to-obstacle field for each hunk, in the same layout as the
+//  map hunks. built the first time a hunk's field is requested; map updates
+//  only mark the part they affect stale, and it is recomputed the next time
+//  the hunk's field is requested
+struct field_hunk {
+   vector<uint8_t> dist;
+   // stale cells, hunk-relative: columns [c0, c1), rows [r0, r1)
+   int c0, r0, c1, r1;
+
+   field_hunk() : c0(0), r0(0), c1(0), r1(0) {}
+
+   bool stale() const { return c0 < c1; }
+};
+typedef map<hunk_idx, field_hunk> field_cache_type;
+field_cache_type field_cache;
+global_map::distance_transform field_transform;
+
 // Global Meridian
 int16_t meridian;
 
@@ -96,63 +113,15 @@ bool setMeridian(global_map::SetMeridian::Request &req,
    return true;
 }
 
-// compute row/column offsets for lat/lon from current meridian
-// see: http://en.wikipedia.org/wiki/Transverse_Mercator_projection#Formulae_for_the_spherical_Transverse_Mercator
-const static double EARTH_RADIUS = 6378.1; // kilometers
-const static double SEGMENT_SIZE = 10.0; // in centimeters
-// A: radius of sphere
-//   in our case, the earth's radius in decimeters (10cm-increments)
-const static double A = EARTH_RADIUS * 1000.0 * 100.0 / SEGMENT_SIZE;
-
-// wrong wrong wrong
-// col (or X)
-int32_t col(double lon) {
-   double lon_tmp = lon - meridian;
-   // we should never be more than 1 degree from the meridian
-   ROS_ASSERT(lon_tmp < 1.0);
-   ROS_ASSERT(lon_tmp > -1.0);
-
-   lon_tmp *= M_PI / 180.0;
-
-   double y = A / 2 * log( (1 + sin(lon_tmp)) / (1 - sin(lon_tmp)) );
-   //cout << "lon: " << lon << " y: " << y << endl;
-   return y; // implicit cast on return
-}
-
-// row (or Y)
-int32_t row(double lat) {
-   //double lon_tmp = lon - meridian;
-   double x = A * (lat * M_PI / 180.0 );
-   //cout << "lat: " << lat << " x: " << x << endl;
-   return x; // implicit cast on return
-}
-
-/*
-// convert a column back to latitude
-double lon(int32_t col) {
-   return 0.0;
-}
-
-// convert a row back to longitude
-double lat(int32_t row) {
-   return 0.0;
-}
-*/
-
 // Service to get offset from meridian center to specific lat/lon
+//  the projection itself lives in projection.cpp, so that nodes which need
+//  it on every fix can call it directly
 bool getOffset(global_map::Offset::Request &req,
                global_map::Offset::Response &resp) {
-   /*
-   resp.row = row(req.lat);
-   resp.col = col(req.lon);
-   */
-   long double lat = req.lat * M_PI / 180.0; // phi
-   long double lon = (req.lon - meridian) * M_PI / 180.0; // lambda
-
-   long double x = A * logl( (1 + sinl(lon)*cosl(lat)) / (1 - sinl(lon)*cosl(lat))) / 2;
-   long double y = A * atanl( tanl(lat) / cosl(lon) );
+   double x, y;
+   global_map::project(req.lat, req.lon, meridian, x, y);
 
-   resp.loc.row = y;
+   resp.loc.row = y; // implicit cast
    resp.loc.col = x;
 
    return true;
@@ -160,14 +129,8 @@ bool getOffset(global_map::Offset::Request &req,
 
 bool reverseOffset(global_map::RevOffset::Request &req,
                    global_map::RevOffset::Response &resp) {
-   long double x = req.loc.col;
-   long double y = req.loc.row;
-
-   long double lon = atanl( sinhl(x / A) / cosl(y / A));
-   long double lat = asinl( sinl(y / A) / coshl(x / A));
-
-   resp.lon = (lon * 180 / M_PI) + meridian;
-   resp.lat = (lat * 180 / M_PI);
+   global_map::unproject(req.loc.col, req.loc.row, meridian,
+         resp.lat, resp.lon);
    return true;
 }
 
@@ -210,7 +173,7 @@ void load_hunk(hunk_idx idx) {
          hunk.data[i] = -1;
       }
    } else {
-      int cnt = read(in, hunk.data, HUNK_SZ);
+      int cnt = read(in, hunk.data.get(), HUNK_SZ);
       if( cnt != HUNK_SZ ) {
          ROS_ERROR("Hunk read error; only read %d bytes for hunk %s; expected %d", cnt, path, HUNK_SZ);
          for( int i = cnt; i < HUNK_SZ; i++ ) {
@@ -240,7 +203,7 @@ void save_hunk(hunk_idx idx) {
    if( out < 0 ) {
       ROS_ERROR("Error opening: %s: %s", path, strerror(errno));
    } else {
-      int cnt = write(out, hunk->second.data, HUNK_SZ);
+      int cnt = write(out, hunk->second.data.get(), HUNK_SZ);
       if( cnt != HUNK_SZ ) {
          ROS_ERROR("Problem writing to %s: %s", path, strerror(errno));
       }
@@ -251,12 +214,22 @@ void save_hunk(hunk_idx idx) {
    return;
 }
 
+// hunk number and offset within the hunk for a row or column; rounds
+//  towards negative infinity so negative coordinates land in the right hunk
+inline int32_t hunk_div(int32_t v) {
+   return v >= 0 ? v / HUNK_SIDE : -((-v - 1) / HUNK_SIDE) - 1;
+}
+
+inline int32_t hunk_mod(int32_t v) {
+   return v - hunk_div(v) * HUNK_SIDE;
+}
+
 // get the hunk index for a row and column location
 hunk_idx get_hunk_idx(int32_t col, int32_t row) {
    hunk_idx res;
 
-   res.first = col / HUNK_SIDE;
-   res.second = row / HUNK_SIDE;
+   res.first = hunk_div(col);
+   res.second = hunk_div(row);
 
    return res;
 }
@@ -272,6 +245,8 @@ bool getMap(global_map::Map::Request &req,
 
    cache_type::iterator cache_itr;
 
+   resp.map.resize(req.width * req.height);
+
    for( idx.first = hunk_start.first; 
         idx.first <= hunk_end.first; 
         idx.first++ ) {
@@ -288,20 +263,21 @@ bool getMap(global_map::Map::Request &req,
 
          // compute start and end indices in hunk buffer
          int colstart = idx.first == hunk_start.first ? 
-                           (req.offset_col%HUNK_SIDE) : 0;
+                           hunk_mod(req.offset_col) : 0;
          int rowstart = idx.second == hunk_start.second ? 
-                           (req.offset_row%HUNK_SIDE) : 0;
+                           hunk_mod(req.offset_row) : 0;
 
          int colend = idx.first == hunk_end.first ? 
-                        ((req.offset_col + req.width)%HUNK_SIDE) : HUNK_SIDE;
+                        hunk_mod(req.offset_col + req.width) : HUNK_SIDE;
          int rowend = idx.second == hunk_end.second ? 
-                        ((req.offset_row + req.height)%HUNK_SIDE) : HUNK_SIDE;
+                        hunk_mod(req.offset_row + req.height) : HUNK_SIDE;
 
          // compute offsets into output buffer
-         int xx = idx.first == hunk_start.first ? 0 : 
-            (idx.first-hunk_start.first)*HUNK_SIDE - req.offset_col%HUNK_SIDE;
-         int yy = idx.second == hunk_start.second ? 0 : 
-            (idx.second-hunk_start.second)*HUNK_SIDE - req.offset_row%HUNK_SIDE;
+         //  (hunk column col is request column xx + col)
+         int xx = (idx.first-hunk_start.first)*HUNK_SIDE -
+            hunk_mod(req.offset_col);
+         int yy = (idx.second-hunk_start.second)*HUNK_SIDE -
+            hunk_mod(req.offset_row);
 
          // copy data from this hunk to portion of output buffer
          for( int col = colstart; col < colend; col++ ) {
@@ -316,6 +292,151 @@ bool getMap(global_map::Map::Request &req,
    return true;
 }
 
+// get a map hunk, loading it if it isn't in the cache
+map_hunk & get_hunk(hunk_idx idx) {
+   cache_type::iterator itr = cache->find(idx);
+   if( itr == cache->end() ) {
+      load_hunk(idx);
+      itr = cache->find(idx);
+   }
+   return itr->second;
+}
+
+// read a rectangle of the map into a row-major buffer
+void read_map(int32_t col, int32_t row, int w, int h, int8_t * out) {
+   for( int32_t c = col; c < col + w; ) {
+      int32_t hc = hunk_div(c);
+      int32_t cend = min(col + w, (hc + 1) * HUNK_SIDE);
+      for( int32_t r = row; r < row + h; ) {
+         int32_t hr = hunk_div(r);
+         int32_t rend = min(row + h, (hr + 1) * HUNK_SIDE);
+         const int8_t * data = get_hunk(hunk_idx(hc, hr)).data.get();
+         for( int32_t i = c; i < cend; i++ ) {
+            const int8_t * src = data + (i - hc*HUNK_SIDE)*HUNK_SIDE;
+            for( int32_t j = r; j < rend; j++ ) {
+               out[(i - col) + (j - row)*w] = src[j - hr*HUNK_SIDE];
+            }
+         }
+         r = rend;
+      }
+      c = cend;
+   }
+}
+
+// recompute the field for a rectangle within one cached field hunk. the
+//  occupancy is read FIELD_MAX cells beyond the rectangle on every side, so
+//  the distances are exact up to FIELD_MAX
+void compute_field(int32_t col, int32_t row, int w, int h) {
+   const int A = global_map::FIELD_MAX;
+   int ow = w + 2*A;
+   int oh = h + 2*A;
+   static vector<int8_t> occupancy;
+   static vector<uint8_t> dist;
+   occupancy.resize(ow * oh);
+   dist.resize(ow * oh);
+
+   read_map(col - A, row - A, ow, oh, &occupancy[0]);
+   field_transform.compute(&occupancy[0], ow, oh, &dist[0]);
+
+   vector<uint8_t> & field = field_cache[get_hunk_idx(col, row)].dist;
+   int32_t c0 = hunk_mod(col);
+   int32_t r0 = hunk_mod(row);
+   for( int i=0; i<w; i++ ) {
+      for( int j=0; j<h; j++ ) {
+         field[(r0 + j) + (c0 + i)*HUNK_SIDE] = dist[(A + i) + (A + j)*ow];
+      }
+   }
+}
+
+// get a hunk's field, building it if it hasn't been built yet and bringing
+//  its stale part up to date
+const vector<uint8_t> & get_field(hunk_idx idx) {
+   field_cache_type::iterator itr = field_cache.find(idx);
+   if( itr == field_cache.end() ) {
+      itr = field_cache.insert(make_pair(idx, field_hunk())).first;
+      itr->second.dist.resize(HUNK_SZ);
+      itr->second.c1 = itr->second.r1 = HUNK_SIDE;
+   }
+   field_hunk & f = itr->second;
+   if( f.stale() ) {
+      compute_field(idx.first * HUNK_SIDE + f.c0, idx.second * HUNK_SIDE + f.r0,
+            f.c1 - f.c0, f.r1 - f.r0);
+      f.c0 = f.r0 = f.c1 = f.r1 = 0;
+   }
+   return f.dist;
+}
+
+// cells of the map changed; mark the part of every built field that is
+//  within FIELD_MAX of them stale
+void update_field(int32_t col, int32_t row, int w, int h) {
+   const int A = global_map::FIELD_MAX;
+   col -= A;
+   row -= A;
+   w += 2*A;
+   h += 2*A;
+   for( int32_t c = col; c < col + w; ) {
+      int32_t hc = hunk_div(c);
+      int32_t cend = min(col + w, (hc + 1) * HUNK_SIDE);
+      for( int32_t r = row; r < row + h; ) {
+         int32_t hr = hunk_div(r);
+         int32_t rend = min(row + h, (hr + 1) * HUNK_SIDE);
+         field_cache_type::iterator itr =
+            field_cache.find(hunk_idx(hc, hr));
+         if( itr != field_cache.end() ) {
+            // grow the stale rectangle to cover these cells too
+            field_hunk & f = itr->second;
+            int c0 = c - hc*HUNK_SIDE;
+            int r0 = r - hr*HUNK_SIDE;
+            int c1 = cend - hc*HUNK_SIDE;
+            int r1 = rend - hr*HUNK_SIDE;
+            if( f.stale() ) {
+               f.c0 = min(f.c0, c0);
+               f.r0 = min(f.r0, r0);
+               f.c1 = max(f.c1, c1);
+               f.r1 = max(f.r1, r1);
+            } else {
+               f.c0 = c0;
+               f.r0 = r0;
+               f.c1 = c1;
+               f.r1 = r1;
+            }
+         }
+         r = rend;
+      }
+      c = cend;
+   }
+}
+
+// Field service; retrieve an arbitrary chunk of the likelihood field
+bool getField(global_map::Field::Request &req,
+              global_map::Field::Response &resp) {
+   if( req.width <= 0 || req.height <= 0 ) return false;
+   resp.field.resize(req.width * req.height);
+
+   int32_t col = req.offset_col;
+   int32_t row = req.offset_row;
+   int w = req.width;
+   for( int32_t c = col; c < col + req.width; ) {
+      int32_t hc = hunk_div(c);
+      int32_t cend = min(col + req.width, (hc + 1) * HUNK_SIDE);
+      for( int32_t r = row; r < row + req.height; ) {
+         int32_t hr = hunk_div(r);
+         int32_t rend = min(row + req.height, (hr + 1) * HUNK_SIDE);
+         const vector<uint8_t> & field = get_field(hunk_idx(hc, hr));
+         for( int32_t i = c; i < cend; i++ ) {
+            const uint8_t * src = &field[(i - hc*HUNK_SIDE)*HUNK_SIDE];
+            for( int32_t j = r; j < rend; j++ ) {
+               resp.field[(i - col) + (j - row)*w] = src[j - hr*HUNK_SIDE];
+            }
+         }
+         r = rend;
+      }
+      c = cend;
+   }
+
+   return true;
+}
+
 // Update service: update an arbitrary chunk of the map
 bool updateMap(global_map::Update::Request &req,
                global_map::Update::Response &resp) {
@@ -342,20 +463,19 @@ bool updateMap(global_map::Update::Request &req,
 
          // compute start and end indices in hunk buffer
          int colstart = idx.first == hunk_start.first ? 
-                           (req.col%HUNK_SIDE) : 0;
+                           hunk_mod(req.col) : 0;
          int rowstart = idx.second == hunk_start.second ? 
-                           (req.row%HUNK_SIDE) : 0;
+                           hunk_mod(req.row) : 0;
 
          int colend = idx.first == hunk_end.first ? 
-                        ((req.col + req.width)%HUNK_SIDE) : HUNK_SIDE;
+                        hunk_mod(req.col + req.width) : HUNK_SIDE;
          int rowend = idx.second == hunk_end.second ? 
-                        ((req.row + req.height)%HUNK_SIDE) : HUNK_SIDE;
+                        hunk_mod(req.row + req.height) : HUNK_SIDE;
 
          // compute offsets into output buffer
-         int xx = idx.first == hunk_start.first ? 0 : 
-            (idx.first-hunk_start.first)*HUNK_SIDE - req.col%HUNK_SIDE;
-         int yy = idx.second == hunk_start.second ? 0 : 
-            (idx.second-hunk_start.second)*HUNK_SIDE - req.row%HUNK_SIDE;
+         //  (hunk column col is request column xx + col)
+         int xx = (idx.first-hunk_start.first)*HUNK_SIDE - hunk_mod(req.col);
+         int yy = (idx.second-hunk_start.second)*HUNK_SIDE - hunk_mod(req.row);
 
          // copy data from this hunk to portion of output buffer
          for( int col = colstart; col < colend; col++ ) {
@@ -367,6 +487,8 @@ bool updateMap(global_map::Update::Request &req,
       }
    }
 
+   update_field(req.col, req.row, req.width, req.height);
+
    return true;
 }
 
@@ -389,6 +511,7 @@ int main(int argc, char ** argv, char ** envp) {
    ros::ServiceServer revoffset_serv = n.advertiseService("RevOffset", reverseOffset);
    ros::ServiceServer getmap_serv = n.advertiseService("Map", getMap);
    ros::ServiceServer updatemap_serv = n.advertiseService("Update", updateMap);
+   ros::ServiceServer field_serv = n.advertiseService("Field", getField);
 
    ROS_INFO("Map server ready");
 
@@ -0,0 +1,45 @@
+/* projection.cpp
+ *
+ * Transverse mercator projection for the global map.
+ *
+ * see: http://en.wikipedia.org/wiki/Transverse_Mercator_projection#Formulae_for_the_spherical_Transverse_Mercator
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <math.h>
+
+#include "global_map/projection.h"
+
+namespace global_map {
+
+   const static double EARTH_RADIUS = 6378.1; // kilometers
+   const static double SEGMENT_SIZE = 10.0; // in centimeters
+   // A: radius of sphere
+   //   in our case, the earth's radius in decimeters (10cm-increments)
+   const static double A = EARTH_RADIUS * 1000.0 * 100.0 / SEGMENT_SIZE;
+
+   int16_t meridian_for(double lon) {
+      return round(lon);
+   }
+
+   void project(double lat, double lon, int16_t meridian,
+         double & x, double & y) {
+      long double phi = lat * M_PI / 180.0;
+      long double lambda = (lon - meridian) * M_PI / 180.0;
+
+      long double b = sinl(lambda) * cosl(phi);
+      x = A * logl( (1 + b) / (1 - b) ) / 2;
+      y = A * atanl( tanl(phi) / cosl(lambda) );
+   }
+
+   void unproject(double x, double y, int16_t meridian,
+         double & lat, double & lon) {
+      long double lambda = atanl( sinhl(x / A) / cosl(y / A));
+      long double phi = asinl( sinl(y / A) / coshl(x / A));
+
+      lon = (lambda * 180 / M_PI) + meridian;
+      lat = (phi * 180 / M_PI);
+   }
+
+}
@@ -0,0 +1,136 @@
+/* ekf.h
+ *
+ * Extended Kalman filter over the robot pose (x, y, heading).
+ *
+ * The motion model integrates the odometry twist (forward speed and yaw
+ *  rate) over dt; GPS measures x and y, and the compass measures heading.
+ *  Measurement updates use the Joseph form of the covariance update so the
+ *  covariance stays symmetric and positive-definite.
+ *
+ * No ROS dependencies, so it can be benchmarked and tested on its own.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef EKF_H
+#define EKF_H
+
+#include <math.h>
+#include "matrix.h"
+
+// wrap an angle to [-pi, pi]
+inline double wrap_angle(double a) {
+   while( a >  M_PI ) a -= M_PI*2;
+   while( a < -M_PI ) a += M_PI*2;
+   return a;
+}
+
+class ekf {
+   public:
+      // state: x (m), y (m), heading (rad)
+      matrix<3, 1> x;
+      // state covariance
+      matrix<3, 3> P;
+
+      // control noise: variance of the odometry speed ((m/s)^2) and yaw
+      //  rate ((rad/s)^2)
+      double linear_noise;
+      double angular_noise;
+
+      ekf() : x(0.0), P(0.0), linear_noise(0.01), angular_noise(0.01) {}
+
+      // reset to a known state with diagonal covariance
+      void reset(double px, double py, double heading,
+            double p_var, double h_var) {
+         x.data[0][0] = px;
+         x.data[1][0] = py;
+         x.data[2][0] = wrap_angle(heading);
+         P = matrix<3, 3>(0.0);
+         P.data[0][0] = p_var;
+         P.data[1][1] = p_var;
+         P.data[2][2] = h_var;
+      }
+
+      // prediction step: drive at speed v and yaw rate w for dt seconds
+      void predict(double v, double w, double dt) {
+         if( dt <= 0 ) return;
+         double h = x.data[2][0];
+         double c = cos(h);
+         double s = sin(h);
+
+         x.data[0][0] += v * dt * c;
+         x.data[1][0] += v * dt * s;
+         x.data[2][0] = wrap_angle(h + w * dt);
+
+         // F: jacobian of the motion model with respect to the state
+         matrix<3, 3> F = I<3>();
+         F.data[0][2] = -v * dt * s;
+         F.data[1][2] =  v * dt * c;
+
+         // V: jacobian with respect to the control (v, w)
+         matrix<3, 2> V(0.0);
+         V.data[0][0] = dt * c;
+         V.data[1][0] = dt * s;
+         V.data[2][1] = dt;
+
+         matrix<2, 2> M(0.0);
+         M.data[0][0] = linear_noise;
+         M.data[1][1] = angular_noise;
+
+         P = F * P * F.T() + V * M * V.T();
+      }
+
+      // GPS update: measured position (px, py) with covariance R
+      //  returns false if the innovation covariance is degenerate
+      bool update_position(double px, double py, const matrix<2, 2> & R) {
+         // H = [ I 0 ]
+         matrix<2, 3> H(0.0);
+         H.data[0][0] = 1.0;
+         H.data[1][1] = 1.0;
+
+         matrix<2, 1> y;
+         y.data[0][0] = px - x.data[0][0];
+         y.data[1][0] = py - x.data[1][0];
+
+         return update(H, y, R);
+      }
+
+      // compass update: measured heading with variance r
+      bool update_heading(double heading, double r) {
+         matrix<1, 3> H(0.0);
+         H.data[0][2] = 1.0;
+
+         matrix<1, 1> y;
+         y.data[0][0] = wrap_angle(heading - x.data[2][0]);
+
+         matrix<1, 1> R;
+         R.data[0][0] = r;
+
+         return update(H, y, R);
+      }
+
+   private:
+      // measurement update with innovation y, measurement jacobian H and
+      //  measurement covariance R
+      template<int K>
+      bool update(const matrix<K, 3> & H, const matrix<K, 1> & y,
+            const matrix<K, K> & R) {
+         matrix<3, K> PHt = P * H.T();
+         matrix<K, K> S = H * PHt + R;
+
+         // K = P H^T S^-1; S and P are symmetric, so K^T = S^-1 (P H^T)^T
+         matrix<K, 3> Kt;
+         if( !solve(S, PHt.T(), Kt) ) return false;
+         matrix<3, K> gain = Kt.T();
+
+         x += gain * y;
+         x.data[2][0] = wrap_angle(x.data[2][0]);
+
+         // Joseph form: P = (I - KH) P (I - KH)^T + K R K^T
+         matrix<3, 3> IKH = I<3>() - gain * H;
+         P = IKH * P * IKH.T() + gain * R * Kt;
+         return true;
+      }
+};
+
+#endif
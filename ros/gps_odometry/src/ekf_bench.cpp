@@ -0,0 +1,96 @@
+/* ekf_bench.cpp
+ *
+ * Measure the cost of each EKF step, and run the filter against a simulated
+ *  drive as a sanity check.
+ *
+ * The odometry rate is 50Hz, so a step needs to fit well inside 20ms.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "ekf.h"
+
+double now() {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// gaussian noise; Box-Muller
+double noise(double sigma) {
+   double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+   double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+   return sigma * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+// keep the optimizer from discarding benchmark results
+volatile double sink;
+
+#define ITERS 1000000
+
+int main(int argc, char ** argv) {
+   ekf f;
+   matrix<2, 2> R(0.0);
+   R.data[0][0] = R.data[1][1] = 2.5*2.5;
+   double start;
+
+   f.reset(0, 0, 0, 1.0, 0.1);
+   start = now();
+   for( int i=0; i<ITERS; i++ ) {
+      f.predict(1.0, 0.1, 0.02);
+      sink = f.x.data[0][0];
+   }
+   printf("predict: %.1f ns\n", (now() - start) * 1e9 / ITERS);
+
+   start = now();
+   for( int i=0; i<ITERS; i++ ) {
+      f.update_position(f.x.data[0][0] + 0.1, f.x.data[1][0], R);
+      sink = f.x.data[0][0];
+   }
+   printf("GPS update: %.1f ns\n", (now() - start) * 1e9 / ITERS);
+
+   start = now();
+   for( int i=0; i<ITERS; i++ ) {
+      f.update_heading(f.x.data[2][0] + 0.01, 0.01);
+      sink = f.x.data[2][0];
+   }
+   printf("compass update: %.1f ns\n", (now() - start) * 1e9 / ITERS);
+
+   /* simulated drive: 10 minutes at 50Hz odometry, 1Hz GPS and 10Hz compass.
+    *  drive in a circle with noisy odometry and report the position error
+    *  against its 1-sigma bound.
+    */
+   f.reset(0, 0, 0, 0.01, 0.01);
+   double x = 0, y = 0, h = 0;
+   double err = 0;
+   double bound = 0;
+   int n = 0;
+   for( int t=0; t<50*600; t++ ) {
+      double v = 1.0;
+      double w = 0.1;
+      double dt = 0.02;
+      x += v * dt * cos(h);
+      y += v * dt * sin(h);
+      h = wrap_angle(h + w * dt);
+
+      f.predict(v + noise(0.1), w + noise(0.1), dt);
+      if( t % 5 == 0 ) {
+         f.update_heading(h + noise(0.1), 0.1*0.1);
+      }
+      if( t % 50 == 0 ) {
+         f.update_position(x + noise(2.5), y + noise(2.5), R);
+         err += hypot(f.x.data[0][0] - x, f.x.data[1][0] - y);
+         bound += sqrt(f.P.data[0][0] + f.P.data[1][1]);
+         ++n;
+      }
+   }
+   printf("simulated drive: mean position error %.2f m, mean 1-sigma %.2f m\n",
+         err / n, bound / n);
+
+   return 0;
+}
@@ -0,0 +1,276 @@
+/* ekf_replay.cpp
+ *
+ * Replay a recorded run through the filter with delayed GPS fixes, and
+ *  compare fusing them at arrival time against fusing them at their
+ *  measurement time through the fixed-lag buffer.
+ *
+ * Usage: ekf_replay <logfile> [gps delay (s)] [lag (s)] [odometry period (s)]
+ *
+ * Logs are the output of test/log (the .logc files in data/plot): O lines hold
+ *  odometry deltas (decimeters, decimeters, radians), G lines a fix
+ *  (lat, lon), or zeros while there is none, and C lines a compass heading.
+ *  Logs aren't timestamped, so time advances by one odometry period per O
+ *  line.
+ *
+ * Each mode is compared against two references: the same log with no GPS
+ *  delay, which counts fixes still in flight as error, and the best that
+ *  the fixes available at the time allow, which counts only the error from
+ *  fusing them at the wrong time. The RMS and maximum distance from each,
+ *  sampled at every odometry message, are reported.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <deque>
+#include <vector>
+
+#include "global_map/projection.h"
+#include "fixed_lag.h"
+
+using namespace std;
+
+struct record {
+   char type;
+   double a, b, c;
+};
+
+// one input, in log order
+struct step {
+   filter_input in;
+   bool start;  // the first fix, which sets the position
+   bool sample; // an odometry message; the estimate is sampled after it
+};
+
+struct point {
+   double x;
+   double y;
+};
+
+enum mode { REFERENCE, ARRIVAL, MEASUREMENT };
+
+// the log as filter inputs, timed by odometry messages
+vector<step> inputs(const vector<record> & log, double period) {
+   bool valid = false;
+   int16_t meridian = 0;
+   double t = 0;
+   vector<step> out;
+
+   for( size_t i=0; i<log.size(); ++i ) {
+      const record & r = log[i];
+      step s;
+      s.in.R = matrix<2, 2>(0.0);
+      s.start = false;
+      s.sample = false;
+
+      if( r.type == 'O' ) {
+         t += period;
+         s.in.type = filter_input::ODOMETRY;
+         s.in.a = hypot(r.a, r.b) * global_map::MAP_RES / period;
+         s.in.b = r.c / period;
+         s.sample = true;
+      } else if( r.type == 'C' ) {
+         s.in.type = filter_input::COMPASS;
+         s.in.a = r.a;
+         s.in.R.data[0][0] = 0.1*0.1;
+      } else if( r.type == 'G' ) {
+         // test/log writes a zero fix while the GPS has none, which
+         //  gps_odometry skips
+         if( r.a == 0 && r.b == 0 ) continue;
+         if( !valid ) meridian = global_map::meridian_for(r.b);
+         s.in.type = filter_input::GPS;
+         global_map::project(r.a, r.b, meridian, s.in.a, s.in.b);
+         s.in.a *= global_map::MAP_RES;
+         s.in.b *= global_map::MAP_RES;
+         s.in.R.data[0][0] = s.in.R.data[1][1] = 2.5*2.5;
+         s.start = !valid;
+         valid = true;
+      } else {
+         continue;
+      }
+      s.in.t = t;
+      out.push_back(s);
+   }
+   return out;
+}
+
+// put the filter at a fix, as gps_odometry does with its first
+void start_at(ekf & s, const filter_input & in) {
+   s.x.data[0][0] = in.a;
+   s.x.data[1][0] = in.b;
+   s.P.data[0][0] = s.P.data[1][1] = in.R.data[0][0];
+   s.P.data[0][1] = s.P.data[1][0] = 0;
+   s.P.data[0][2] = s.P.data[2][0] = 0;
+   s.P.data[1][2] = s.P.data[2][1] = 0;
+}
+
+point position(const ekf & f) {
+   point p;
+   p.x = f.x.data[0][0];
+   p.y = f.x.data[1][0];
+   return p;
+}
+
+// run the inputs through the filter; one output point per odometry message
+//  from the first fix on
+vector<point> run(const vector<step> & steps, mode m, double delay,
+      double lag) {
+   fixed_lag_filter<512> filter;
+   filter.lag = lag;
+   ekf f;
+   f.reset(0, 0, 0, 1000.0*1000.0, 10.0);
+   filter.reset(f, 0);
+
+   bool valid = false;
+   deque<filter_input> pending; // fixes in flight
+   vector<point> out;
+
+   for( size_t i=0; i<steps.size(); ++i ) {
+      const step & s = steps[i];
+      double t = s.in.t;
+      if( s.start ) {
+         ekf e = filter.state();
+         start_at(e, s.in);
+         filter.reset(e, t);
+         valid = true;
+      } else if( s.in.type != filter_input::GPS || m == REFERENCE ) {
+         filter.add(s.in);
+      } else {
+         pending.push_back(s.in);
+      }
+
+      // deliver fixes whose delay has passed
+      while( !pending.empty() && pending.front().t + delay <= t ) {
+         filter_input g = pending.front();
+         pending.pop_front();
+         if( m == ARRIVAL ) g.t = t;
+         filter.add(g);
+      }
+
+      if( s.sample && valid ) out.push_back(position(filter.state()));
+   }
+   return out;
+}
+
+// a plain EKF and the twist in effect, driven through inputs in order
+struct track {
+   ekf f;
+   double v;
+   double w;
+   double t;
+
+   void apply(const step & s) {
+      if( s.in.t > t ) {
+         f.predict(v, w, s.in.t - t);
+         t = s.in.t;
+      }
+      if( s.start ) {
+         start_at(f, s.in);
+         return;
+      }
+      switch( s.in.type ) {
+         case filter_input::ODOMETRY:
+            v = s.in.a;
+            w = s.in.b;
+            break;
+         case filter_input::GPS:
+            f.update_position(s.in.a, s.in.b, s.in.R);
+            break;
+         case filter_input::COMPASS:
+            f.update_heading(s.in.a, s.in.R.data[0][0]);
+            break;
+      }
+   }
+};
+
+/* the best estimate the delay allows, without the fixed-lag buffer: at
+ *  each odometry message, every input up to delay seconds ago, with every
+ *  fix among them fused at its own time, then the odometry and compass
+ *  since. Fixes still in flight can't count against a filter here. */
+vector<point> available(const vector<step> & steps, double delay) {
+   track settled; // every input up to delay ago
+   settled.f.reset(0, 0, 0, 1000.0*1000.0, 10.0);
+   settled.v = settled.w = settled.t = 0;
+   size_t next = 0;
+   bool valid = false;
+   vector<point> out;
+
+   for( size_t i=0; i<steps.size(); ++i ) {
+      double t = steps[i].in.t;
+      if( steps[i].start ) valid = true;
+      if( !steps[i].sample || !valid ) continue;
+
+      while( next <= i && steps[next].in.t + delay <= t ) {
+         settled.apply(steps[next++]);
+      }
+      track now = settled;
+      for( size_t j=next; j<=i; ++j ) {
+         if( steps[j].in.type != filter_input::GPS || steps[j].start ) {
+            now.apply(steps[j]);
+         }
+      }
+      out.push_back(position(now.f));
+   }
+   return out;
+}
+
+void compare(const char * name, const vector<point> & ref,
+      const vector<point> & p) {
+   double sum = 0;
+   double max = 0;
+   for( size_t i=0; i<ref.size() && i<p.size(); ++i ) {
+      double d = hypot(p[i].x - ref[i].x, p[i].y - ref[i].y);
+      sum += d*d;
+      if( d > max ) max = d;
+   }
+   printf("%s: RMS %.3f m, max %.3f m\n", name, sqrt(sum / ref.size()), max);
+}
+
+int main(int argc, char ** argv) {
+   if( argc < 2 ) {
+      fprintf(stderr, "Usage: ekf_replay <logfile> [gps delay] [lag] "
+            "[odometry period]\n");
+      return -1;
+   }
+   double delay = argc > 2 ? atof(argv[2]) : 0.5;
+   double lag = argc > 3 ? atof(argv[3]) : fixed_lag_filter<1>().lag;
+   double period = argc > 4 ? atof(argv[4]) : 0.1;
+
+   FILE * in = fopen(argv[1], "r");
+   if( in == NULL ) {
+      perror("Failed to open log");
+      return -1;
+   }
+
+   vector<record> log;
+   char line[256];
+   while( fgets(line, sizeof(line), in) ) {
+      record r;
+      r.type = line[0];
+      int n = sscanf(line + 1, "%lf %lf %lf", &r.a, &r.b, &r.c);
+      if( (r.type == 'O' && n == 3) || (r.type == 'G' && n == 2) ||
+            (r.type == 'C' && n == 1) ) {
+         log.push_back(r);
+      }
+   }
+   fclose(in);
+
+   vector<step> steps = inputs(log, period);
+   vector<point> ref = run(steps, REFERENCE, 0, lag);
+   vector<point> avail = available(steps, delay);
+   vector<point> arrival = run(steps, ARRIVAL, delay, lag);
+   vector<point> measurement = run(steps, MEASUREMENT, delay, lag);
+   printf("%zu odometry steps, GPS delay %.2fs, lag %.2fs\n", ref.size(),
+         delay, lag);
+   printf("from the undelayed run:\n");
+   compare(" fused at arrival", ref, arrival);
+   compare(" fused at measurement time", ref, measurement);
+   printf("from the fixes available at the time:\n");
+   compare(" fused at arrival", avail, arrival);
+   compare(" fused at measurement time", avail, measurement);
+
+   return 0;
+}
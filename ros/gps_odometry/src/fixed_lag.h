@@ -0,0 +1,178 @@
+/* fixed_lag.h
+ *
+ * Fixed-lag wrapper around the EKF that fuses inputs at their measurement
+ *  time rather than their arrival time.
+ *
+ * Inputs (odometry twists, GPS fixes and compass headings) are kept in
+ *  timestamp order in a preallocated ring, each with the filter state after
+ *  it was applied. An input that arrives late is inserted at its own time;
+ *  the filter is rewound to the state before it and every later input is
+ *  replayed. Inputs older than the lag window are folded into a base state
+ *  and dropped from the ring. An input that arrives before the base state
+ *  can't be put at its own time any more; it is fused at the base state,
+ *  the oldest one kept, which is as close as the filter can get. Dropping
+ *  it would leave the filter on odometry alone for as long as the delay
+ *  lasts.
+ *
+ * The window is the smaller of lag seconds and N inputs; lag should cover
+ *  the GPS latency, and N the inputs that arrive within lag. N must be a
+ *  power of two.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef FIXED_LAG_H
+#define FIXED_LAG_H
+
+#include "ekf.h"
+
+struct filter_input {
+   enum kind { ODOMETRY, GPS, COMPASS };
+   kind type;
+   double t;       // measurement time (s)
+   double a;       // odometry: speed; gps: x; compass: heading
+   double b;       // odometry: yaw rate; gps: y
+   matrix<2, 2> R; // gps: covariance; compass: variance in R.data[0][0]
+};
+
+template<unsigned N>
+class fixed_lag_filter {
+   public:
+      double lag;        // window length (s)
+      unsigned late;     // inputs older than the window, fused at its start
+      unsigned replayed; // inputs re-applied because of late arrivals
+
+      fixed_lag_filter() : lag(2.5), late(0), replayed(0), head(0),
+         count(0) {
+         base.v = 0;
+         base.w = 0;
+         base.t = 0;
+      }
+
+      // start over from a known state at time t; the last twist stays in
+      //  effect
+      void reset(const ekf & f, double t) {
+         if( count ) {
+            base.v = at(count - 1).s.v;
+            base.w = at(count - 1).s.w;
+         }
+         base.f = f;
+         base.t = t;
+         count = 0;
+      }
+
+      // the filter state after the newest input
+      const ekf & state() const {
+         return count ? at(count - 1).s.f : base.f;
+      }
+
+      // time of the newest input
+      double time() const {
+         return count ? at(count - 1).s.t : base.t;
+      }
+
+      /* add an input; returns false if it is older than the window, and so
+       *  was fused at the oldest state instead of its own time */
+      bool add(filter_input in) {
+         if( count == N ) evict();
+         bool on_time = in.t >= base.t;
+         if( !on_time ) {
+            ++late;
+            in.t = base.t;
+         }
+
+         // insertion point; inputs with equal times keep arrival order
+         unsigned k = count;
+         while( k > 0 && at(k - 1).in.t > in.t ) --k;
+         for( unsigned i = count; i > k; --i ) {
+            at(i).in = at(i - 1).in;
+         }
+         at(k).in = in;
+         ++count;
+         replayed += count - 1 - k;
+
+         // rewind to the state before the new input and replay from there
+         snapshot s = k ? at(k - 1).s : base;
+         for( unsigned i = k; i < count; ++i ) {
+            apply(s, at(i).in);
+            at(i).s = s;
+         }
+
+         // trim the window, always keeping the newest input
+         double cutoff = at(count - 1).in.t - lag;
+         while( count > 1 && at(0).in.t < cutoff ) evict();
+         return on_time;
+      }
+
+      // shift every stored state and GPS input, for moving the filter to a
+      //  new map origin
+      void translate(double dx, double dy) {
+         shift(base, dx, dy);
+         for( unsigned i=0; i<count; ++i ) {
+            shift(at(i).s, dx, dy);
+            if( at(i).in.type == filter_input::GPS ) {
+               at(i).in.a += dx;
+               at(i).in.b += dy;
+            }
+         }
+      }
+
+   private:
+      // filter state and the twist in effect after an input
+      struct snapshot {
+         ekf f;
+         double v;
+         double w;
+         double t;
+      };
+
+      struct slot {
+         filter_input in;
+         snapshot s;
+      };
+
+      snapshot base;
+      slot slots[N];
+      unsigned head; // index of the oldest slot
+      unsigned count;
+
+      // compile-time check that N is a power of two
+      typedef char n_is_power_of_two[(N & (N - 1)) == 0 ? 1 : -1];
+
+      slot & at(unsigned i) { return slots[(head + i) & (N - 1)]; }
+      const slot & at(unsigned i) const { return slots[(head + i) & (N - 1)]; }
+
+      // fold the oldest input into the base state
+      void evict() {
+         base = at(0).s;
+         head = (head + 1) & (N - 1);
+         --count;
+      }
+
+      static void shift(snapshot & s, double dx, double dy) {
+         s.f.x.data[0][0] += dx;
+         s.f.x.data[1][0] += dy;
+      }
+
+      // drive from s.t to the input's time, then apply it
+      static void apply(snapshot & s, const filter_input & in) {
+         if( in.t > s.t ) {
+            s.f.predict(s.v, s.w, in.t - s.t);
+            s.t = in.t;
+         }
+         switch( in.type ) {
+            case filter_input::ODOMETRY:
+               s.v = in.a;
+               s.w = in.b;
+               break;
+            case filter_input::GPS:
+               s.f.update_position(in.a, in.b, in.R);
+               break;
+            case filter_input::COMPASS:
+               s.f.update_heading(in.a, in.R.data[0][0]);
+               break;
+         }
+      }
+};
+
+#endif
@@ -3,63 +3,132 @@
  * A ROS node to fuse GPS and raw odometry data with a kalman filter to produce
  *  better location estimates.
  *
+ * The filter is a three-state (x, y, heading) EKF; see ekf.h. Odometry twist
+ *  drives the prediction step, and GPS fixes and compass headings are fused
+ *  as measurements. Position is published in meters relative to the
+ *  meridian origin used by the global map.
+ *
+ * Inputs are fused at their timestamps through a fixed-lag buffer (see
+ *  fixed_lag.h), so a GPS fix that arrives after newer odometry is applied
+ *  at the time it was taken.
+ *
  * Author: Austin Hendrix
  */
 
 #include <iostream>
 
+#include <boost/thread.hpp>
+
 #include "ros/ros.h"
 #include "nav_msgs/Odometry.h"
 #include "gps_common/GPSFix.h"
-#include "global_map/Offset.h"
-#include "global_map/RevOffset.h"
 #include "global_map/SetMeridian.h"
+#include "global_map/projection.h"
 #include "hardware_interface/Compass.h"
 
 #include "matrix.h"
+#include "ekf.h"
+#include "fixed_lag.h"
 
 using namespace std;
 
-matrix<1, 2> position(0.0);
-matrix<2, 2> p_covariance(0.0);
+/* the pose filter; odometry and compass come in at 50Hz each, so 512
+ *  inputs cover the default 2.5s lag with room to spare */
+fixed_lag_filter<512> filter;
+bool started = false;
 
-double heading = 0;
-double h_variance = 10;
+// measurement noise
+double gps_noise = 2.5*2.5; // m^2, per axis; if the fix doesn't report one
+double compass_noise = 0.100*0.100; // about 6 degrees, in radians
 
-// client for retrieving offsets
+// client for notifying the map server of meridian changes
 ros::ServiceClient set_meridian;
-ros::ServiceClient o_client;
-ros::ServiceClient r_client;
 
 // publisher for filtered position information
 ros::Publisher pos_pub;
 
-// global for storing compass reading when we get it
-double compass = 0.0;
+// the meridian fixes are projected against; a local copy of the map
+//  server's, so projecting a fix needs no service call. starts out invalid
+//  so the first fix sets it
+int16_t meridian = -1000;
+
+// meridian changes are sent to the map server from their own thread, so the
+//  service call never blocks the filter
+boost::mutex meridian_mutex;
+boost::condition_variable meridian_cond;
+int16_t pending_meridian;
+bool meridian_dirty = false;
+
+// don't publish until we've had a GPS fix
+bool valid = false;
+
+// twist of the last odometry message
+geometry_msgs::Twist last_twist;
+
+// send meridian changes to the map server; retries until it succeeds or a
+//  newer meridian replaces it
+void meridianThread() {
+   boost::unique_lock<boost::mutex> lock(meridian_mutex);
+   while( ros::ok() ) {
+      if( !meridian_dirty ) {
+         meridian_cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+         continue;
+      }
+
+      global_map::SetMeridian m;
+      m.request.meridian = pending_meridian;
+      meridian_dirty = false;
 
-int16_t old_meridian;
+      lock.unlock();
+      bool ok = set_meridian.call(m);
+      lock.lock();
 
-#define ODO_CNT 60
-char valid = 0;
+      if( !ok ) {
+         ROS_ERROR("Failed to set meridian; retrying");
+         meridian_dirty = true;
+         meridian_cond.timed_wait(lock, boost::posix_time::seconds(1));
+      }
+   }
+}
+
+// feed an input to the filter
+void add(const filter_input & in) {
+   if( !started ) {
+      filter.reset(filter.state(), in.t);
+      started = true;
+   }
+   if( !filter.add(in) ) {
+      ROS_WARN_THROTTLE(10, "Input %.3fs older than the filter window, "
+            "fused at its start; %u so far", filter.time() - in.t,
+            filter.late);
+   }
+}
 
 void publish() {
+   if( !valid ) return;
+
+   const ekf & f = filter.state();
+
    nav_msgs::Odometry pos;
-   pos.pose.pose.position.x = position.data[0][0];
-   pos.pose.pose.position.y = position.data[0][1];
-   //pos.pose.pose.orientation.x = position.data[0][2];
-   pos.pose.pose.orientation.x = heading;
-
-   pos.pose.covariance[0 + 6*0] = p_covariance.data[0][0]; // x x
-   pos.pose.covariance[0 + 6*1] = p_covariance.data[0][1]; // x y
-   pos.pose.covariance[1 + 6*0] = p_covariance.data[1][0]; // y x
-   pos.pose.covariance[1 + 6*1] = p_covariance.data[1][1]; // y y
-
-   /*pos.pose.covariance[0 + 6*3] = p_covariance.data[0][2]; //  x  rot
-   pos.pose.covariance[1 + 6*3] = p_covariance.data[1][2]; //  y  rot
-   pos.pose.covariance[3 + 6*0] = p_covariance.data[2][0]; // rot  x
-   pos.pose.covariance[3 + 6*1] = p_covariance.data[2][1]; // rot  y
-   */
-   pos.pose.covariance[3 + 6*3] = h_variance; // rot rot
+   pos.header.stamp = ros::Time(filter.time());
+   pos.header.frame_id = "map";
+   pos.child_frame_id = "base_link";
+   pos.pose.pose.position.x = f.x.data[0][0];
+   pos.pose.pose.position.y = f.x.data[1][0];
+   // consumers of position read the heading from orientation.x
+   pos.pose.pose.orientation.x = f.x.data[2][0];
+
+   /* Row-major 6x6 covariance over (x, y, z, roll, pitch, yaw); our state
+    *  maps onto x, y and yaw.
+    */
+   static const int idx[3] = { 0, 1, 5 };
+   for( int i=0; i<3; i++ ) {
+      for( int j=0; j<3; j++ ) {
+         pos.pose.covariance[idx[i]*6 + idx[j]] = f.P.data[i][j];
+      }
+   }
+
+   pos.twist.twist = last_twist;
 
    pos_pub.publish(pos);
 }
@@ -68,60 +137,69 @@ void publish() {
 void gpsCallback(const gps_common::GPSFix::ConstPtr &gps) {
    //ROS_INFO("Got gps message");
 
-   if( valid >= 0 && gps->status.status == 0 ) {
-
-      matrix<2, 2> gain; // kalman filter gain
-      // Kalman filter update step
-
-      // input covariance
-      matrix<2, 2> Q;
-      // diagonal matrix
-      Q.data[0][0] = 25.0*25.0;
-      Q.data[0][1] = 0;
-      Q.data[1][1] = 25.0*25.0;
-      Q.data[1][0] = 0;
-
-      int16_t meridian = round(gps->longitude);
-      if( meridian != old_meridian ) {
-         global_map::SetMeridian m;
-         m.request.meridian = meridian;
-         if( !set_meridian.call(m) ) {
-            ROS_ERROR("Failed to set meridian");
+   if( gps->status.status == 0 ) {
+      int16_t m = global_map::meridian_for(gps->longitude);
+      if( m != meridian ) {
+         if( valid ) {
+            // move the filter onto the new meridian
+            const ekf & f = filter.state();
+            double lat, lon;
+            global_map::unproject(f.x.data[0][0] / global_map::MAP_RES,
+                  f.x.data[1][0] / global_map::MAP_RES, meridian,
+                  lat, lon);
+            double x, y;
+            global_map::project(lat, lon, m, x, y);
+            filter.translate(x * global_map::MAP_RES - f.x.data[0][0],
+                  y * global_map::MAP_RES - f.x.data[1][0]);
          }
-      }
+         meridian = m;
 
-      global_map::Offset offset;
-      offset.request.lat = gps->latitude;
-      offset.request.lon = gps->longitude;
-      if( !o_client.call(offset) ) {
-         ROS_ERROR("Failed to call Offset service");
+         boost::lock_guard<boost::mutex> lock(meridian_mutex);
+         pending_meridian = m;
+         meridian_dirty = true;
+         meridian_cond.notify_one();
       }
-      // input measurement
-      matrix<1, 2> z;
-      z.data[0][0] = offset.response.loc.col; // x; from gps
-      z.data[0][1] = offset.response.loc.row; // y; from gps
-
-      // measurement update step:
-      // C: 2x2 identity matrix
-      // Q: measurement covariance
-      // z: measurement
-      // I: identity matrix
-      // gain = cov * C^T * (C * cov * C^T + Q)^-1
-      // pos = pos + gain*(z - C*pos)
-      // cov = (I - gain*C)*cov
-
-      if( valid > ODO_CNT ) {
-         gain = p_covariance * invert(p_covariance + Q);
-         position = position + (z - position) * gain;
-         p_covariance = (I<2>() - gain) * p_covariance;
+
+      double x, y;
+      global_map::project(gps->latitude, gps->longitude, meridian, x, y);
+      x *= global_map::MAP_RES;
+      y *= global_map::MAP_RES;
+
+      // measurement covariance; from the fix if it has one
+      filter_input in;
+      in.type = filter_input::GPS;
+      in.t = gps->header.stamp.toSec();
+      in.a = x;
+      in.b = y;
+      in.R = matrix<2, 2>(0.0);
+      if( gps->position_covariance_type !=
+            gps_common::GPSFix::COVARIANCE_TYPE_UNKNOWN ) {
+         in.R.data[0][0] = gps->position_covariance[0];
+         in.R.data[0][1] = gps->position_covariance[1];
+         in.R.data[1][0] = gps->position_covariance[3];
+         in.R.data[1][1] = gps->position_covariance[4];
       } else {
-         position = z;
-         p_covariance = Q;
-         valid = ODO_CNT + 1;
+         in.R.data[0][0] = gps_noise;
+         in.R.data[1][1] = gps_noise;
       }
 
-      while( position.data[0][2] >  M_PI ) position.data[0][2] -= M_PI*2;
-      while( position.data[0][2] < -M_PI ) position.data[0][2] += M_PI*2;
+      if( valid ) {
+         add(in);
+      } else {
+         // first fix: take the position outright, keep the heading
+         ekf f = filter.state();
+         f.x.data[0][0] = x;
+         f.x.data[1][0] = y;
+         for( int i=0; i<2; i++ ) {
+            for( int j=0; j<3; j++ ) {
+               f.P.data[i][j] = f.P.data[j][i] =
+                  j < 2 ? in.R.data[i][j] : 0.0;
+            }
+         }
+         filter.reset(f, started ? filter.time() : in.t);
+         started = true;
+         valid = true;
+      }
 
       publish();
    }
@@ -129,23 +207,13 @@ void gpsCallback(const gps_common::GPSFix::ConstPtr &gps) {
 
 void compassCallback(const hardware_interface::Compass::ConstPtr & msg ) {
    //ROS_INFO("Got compass message");
-   compass = msg->heading;
-   // TODO: update compass when we get compass readings
-
-   double z = compass;
-
-   while( z - heading < -M_PI ) z += M_PI*2;
-   while( z - heading >  M_PI ) z -= M_PI*2;
-
-   //double Q = 0.174*0.174; // about 10 degrees, in radians
-   double Q = 0.100*0.100; // about 10 degrees, in radians
-
-   double gain = h_variance / ( h_variance + Q);
-   heading = heading + ((z - heading) * gain);
-   h_variance = (1 - gain) * h_variance;
-
-   while( heading >  M_PI ) heading -= M_PI*2;
-   while( heading < -M_PI ) heading += M_PI*2;
+   // compass messages aren't stamped; use the arrival time
+   filter_input in;
+   in.type = filter_input::COMPASS;
+   in.t = ros::Time::now().toSec();
+   in.a = msg->heading;
+   in.R.data[0][0] = compass_noise;
+   add(in);
 
    publish();
 }
@@ -154,60 +222,38 @@ void compassCallback(const hardware_interface::Compass::ConstPtr & msg ) {
 void odometryCallback(const nav_msgs::Odometry::ConstPtr &odo) {
    //ROS_INFO("Got odometry message");
 
-   matrix<1, 2> update;
-   double h_update;
-
-   update.data[0][0] = odo->pose.pose.position.x; // x
-   update.data[0][1] = odo->pose.pose.position.y; // y
-   h_update = odo->pose.pose.orientation.x; // rot TODO: pick units/normalize
-
-   while( h_update - position.data[0][2] < -M_PI ) h_update += M_PI*2;
-   while( h_update - position.data[0][2] >  M_PI ) h_update -= M_PI*2;
-
-   matrix<2, 2> Rt; // covariance of update noise
-   double h_Rt;
-
-   /* odo->pose->covariance
-      Row-major representation of the 6x6 covariance matrix
-      The orientation parameters use a fixed-axis representation.
-      In order, the parameters are:
-      (x, y, z, rotation about X axis, rotation about Y axis, rotation about Z axis)
-      */
-   // x/y pairings
-   Rt.data[0][0] = odo->pose.covariance[0 + 6*0]; // x x
-   Rt.data[0][1] = odo->pose.covariance[0 + 6*1]; // x y
-   Rt.data[1][0] = odo->pose.covariance[1 + 6*0]; // y x
-   Rt.data[1][1] = odo->pose.covariance[1 + 6*1]; // y y
-
-   h_Rt = odo->pose.covariance[3 + 6*3]; // rot rot
-
-   // Kalman filter prediction step (inputs/odometry)
-   // A and B are identity matrices
-   position = update + position;
-   p_covariance = p_covariance + Rt;
-   heading = h_update + heading;
-   h_variance += h_Rt;
-
-//   if( valid < ODO_CNT ) valid += 1;
-//   if( valid == ODO_CNT ) valid = -1;
+   // the twist drives the filter from this message until the next one
+   filter_input in;
+   in.type = filter_input::ODOMETRY;
+   in.t = odo->header.stamp.toSec();
+   in.a = odo->twist.twist.linear.x;
+   in.b = odo->twist.twist.angular.z;
+   add(in);
+   last_twist = odo->twist.twist;
 
    publish();
 }
 
 int main(int argc, char ** argv) {
-   // initialize uncertainty matrix
-   for( int i=0; i<2; i++ ) {
-      p_covariance.data[i][i] = 1000.0*1000.0;
-   }
-
    ros::init(argc, argv, "gps_odometry");
 
    // subscribe to extended fix data from gps node.
    ros::NodeHandle n;
+   ros::NodeHandle pn("~");
+
+   ekf f;
+   pn.param("gps_noise", gps_noise, gps_noise);
+   pn.param("compass_noise", compass_noise, compass_noise);
+   pn.param("linear_noise", f.linear_noise, f.linear_noise);
+   pn.param("angular_noise", f.angular_noise, f.angular_noise);
+   pn.param("lag", filter.lag, filter.lag);
+
+   // initialize uncertainty; position is unknown until the first fix
+   f.reset(0, 0, 0, 1000.0*1000.0, 10.0);
+   filter.reset(f, 0);
 
-   o_client = n.serviceClient<global_map::Offset>("Offset");
-   r_client = n.serviceClient<global_map::RevOffset>("RevOffset");
    set_meridian = n.serviceClient<global_map::SetMeridian>("SetMeridian");
+   boost::thread meridian_thread(meridianThread);
 
    pos_pub = n.advertise<nav_msgs::Odometry>("position", 10);
 
@@ -219,5 +265,8 @@ int main(int argc, char ** argv) {
 
    ros::spin();
 
+   meridian_cond.notify_one();
+   meridian_thread.join();
+
    return 0;
 }
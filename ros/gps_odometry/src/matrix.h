@@ -2,36 +2,49 @@
  *
  * A simple matrix library for representing position and covariance
  *
+ * Matrices are small and fixed-size, so everything here is inline and loops
+ *  have compile-time bounds; the compiler fully unrolls them. Operands are
+ *  passed by const reference and storage is 16-byte aligned so rows can be
+ *  loaded with SSE.
+ *
+ * Solvers:
+ *  invert()   - closed form for 2x2 and 3x3, Gauss-Jordan with partial
+ *               pivoting otherwise
+ *  cholesky() - LL^T factorization for symmetric positive-definite matrices
+ *  solve()    - solve A*X = B for symmetric positive-definite A (covariance
+ *               updates) without forming the inverse
+ *
  * Author: Austin Hendrix
  */
 
-#include <assert.h>
-#include <iostream>
-
-/*template<int N, int M>
-class matrix;
+#ifndef MATRIX_H
+#define MATRIX_H
 
-template<int N, int M>
-std::ostream & operator<<( std::ostream &, matrix<N, M> m);*/
+#include <math.h>
+#include <iostream>
 
 template<int N, int M>
 class matrix {
    public:
       matrix() {} // explicitly doesn't initialize matrix
-      matrix(double); // explicitly initalize every element to init
-      ~matrix() {}
+      explicit matrix(double); // explicitly initalize every element to init
       // default copy constructor is ok
 
       // addition
-      matrix operator+(matrix o);
+      matrix operator+(const matrix & o) const;
+      matrix & operator+=(const matrix & o);
 
       // subtraction
-      matrix operator-(matrix o);
+      matrix operator-(const matrix & o) const;
+      matrix & operator-=(const matrix & o);
+
+      // scaling
+      matrix operator*(double s) const;
 
       // matrix transpose
-      matrix<M, N> T();
+      matrix<M, N> T() const;
 
-      double data[N][M];
+      double data[N][M] __attribute__((aligned(16)));
 
       // not sure we need these, but they shouldn't hurt.
       static const int n = N;
@@ -39,14 +52,15 @@ class matrix {
 };
 
 // constructor. initialize to value
-template<int N, int M> matrix<N, M>::matrix(double init) {
+template<int N, int M> inline matrix<N, M>::matrix(double init) {
    for( int i=0; i<N; i++ )
       for( int j=0; j<M; j++ )
          data[i][j] = init;
 }
 
 // add matrices
-template<int N, int M> matrix<N, M> matrix<N, M>::operator+(matrix<N, M> o) {
+template<int N, int M>
+inline matrix<N, M> matrix<N, M>::operator+(const matrix<N, M> & o) const {
    matrix<N, M> res; // no initialization needed
    for( int i=0; i<N; i++ ) {
       for( int j=0; j<M; j++ ) {
@@ -57,8 +71,19 @@ template<int N, int M> matrix<N, M> matrix<N, M>::operator+(matrix<N, M> o) {
    return res;
 }
 
+template<int N, int M>
+inline matrix<N, M> & matrix<N, M>::operator+=(const matrix<N, M> & o) {
+   for( int i=0; i<N; i++ ) {
+      for( int j=0; j<M; j++ ) {
+         data[i][j] += o.data[i][j];
+      }
+   }
+   return *this;
+}
+
 // subtract matrices
-template<int N, int M> matrix<N, M> matrix<N, M>::operator-(matrix<N, M> o) {
+template<int N, int M>
+inline matrix<N, M> matrix<N, M>::operator-(const matrix<N, M> & o) const {
    matrix<N, M> res; // no initialization needed
    for( int i=0; i<N; i++ ) {
       for( int j=0; j<M; j++ ) {
@@ -69,17 +94,40 @@ template<int N, int M> matrix<N, M> matrix<N, M>::operator-(matrix<N, M> o) {
    return res;
 }
 
+template<int N, int M>
+inline matrix<N, M> & matrix<N, M>::operator-=(const matrix<N, M> & o) {
+   for( int i=0; i<N; i++ ) {
+      for( int j=0; j<M; j++ ) {
+         data[i][j] -= o.data[i][j];
+      }
+   }
+   return *this;
+}
+
+// scale a matrix
+template<int N, int M>
+inline matrix<N, M> matrix<N, M>::operator*(double s) const {
+   matrix<N, M> res;
+   for( int i=0; i<N; i++ ) {
+      for( int j=0; j<M; j++ ) {
+         res.data[i][j] = data[i][j] * s;
+      }
+   }
+   return res;
+}
+
 // multiply two matrices
 template<int N, int M, int K>
-matrix<N, K> operator*(matrix<N, M> a, matrix<M, K> o) {
-   matrix<N, K> res(0.0);
+inline matrix<N, K> operator*(const matrix<N, M> & a, const matrix<M, K> & o) {
+   matrix<N, K> res;
 
    for( int i=0; i<N; i++ ) {
       for( int j=0; j<K; j++ ) {
-         
+         double sum = 0.0;
          for( int m=0; m<M; m++ ) {
-            res.data[i][j] += a.data[i][m] * o.data[m][j];
+            sum += a.data[i][m] * o.data[m][j];
          }
+         res.data[i][j] = sum;
       }
    }
 
@@ -88,7 +136,7 @@ matrix<N, K> operator*(matrix<N, M> a, matrix<M, K> o) {
 
 // transpose a matrix
 template<int N, int M>
-matrix<M, N> matrix<N, M>::T() {
+inline matrix<M, N> matrix<N, M>::T() const {
    matrix<M, N> ret;
 
    for( int i=0; i<N; i++ ) {
@@ -100,98 +148,179 @@ matrix<M, N> matrix<N, M>::T() {
    return ret;
 }
 
-// inversion
+// generate and identity matrix of the requested size
 template<int K>
-matrix<K, K> invert(matrix<K, K> m) {
-   matrix<K, K*2> tmp;
-   matrix<K, K> res;
-
-   // build temporary matrix
-   //  first half; input matrix
-   for( int i=0; i<K; i++ ) {
-      for( int j=0; j<K; j++ ) {
-         tmp.data[i][j] = m.data[i][j];
-      }
-   }
-   // second half; identity matrix
+inline matrix<K, K> I() {
+   matrix<K, K> ret(0.0);
    for( int i=0; i<K; i++ ) {
-      for( int j=0; j<K; j++ ) {
-         tmp.data[i][j+K] = (i==j)?1.0:0.0;
-      }
+      ret.data[i][i] = 1.0;
    }
 
-   // do gaussian elimination
+   return ret;
+}
+
+// fill a matrix with NaN; the result of inverting a singular matrix
+template<int N, int M>
+inline void set_nan(matrix<N, M> & m) {
+   for( int i=0; i<N; i++ )
+      for( int j=0; j<M; j++ )
+         m.data[i][j] = NAN;
+}
+
+// inversion; Gauss-Jordan elimination with partial pivoting
+//  returns false and leaves res undefined if m is singular
+template<int K>
+inline bool invert(const matrix<K, K> & m, matrix<K, K> & res) {
+   matrix<K, K> tmp = m;
+   res = I<K>();
 
-   // upper triangularize input matrix
    for( int i=0; i<K; i++ ) {
-      // per row:
-      
-      // cancel inital values to 0
-      for( int j=0; j<i; j++ ) {
-         if( tmp.data[i][j] != 0.0 ) {
-            double m = tmp.data[i][j] / tmp.data[j][j];
-            for( int k=j; k<2*K; k++ ) { // we should be able to start at k=j
-               tmp.data[i][k] -= tmp.data[j][k]*m;
-            }
+      // pivot: bring the largest remaining element in column i to row i
+      int p = i;
+      for( int j=i+1; j<K; j++ ) {
+         if( fabs(tmp.data[j][i]) > fabs(tmp.data[p][i]) ) p = j;
+      }
+      if( tmp.data[p][i] == 0.0 ) return false;
+      if( p != i ) {
+         for( int k=0; k<K; k++ ) {
+            double t = tmp.data[i][k];
+            tmp.data[i][k] = tmp.data[p][k];
+            tmp.data[p][k] = t;
+            t = res.data[i][k];
+            res.data[i][k] = res.data[p][k];
+            res.data[p][k] = t;
          }
       }
 
-      // divide row so that initial constant is 1
-      double s = tmp.data[i][i];
-      // avoid divide by 0 (will happen is matrix isn't invertible)
-      // TODO: do something better than an assert here
-      assert( s != 0.0 );
-      for( int j=0; j<K*2; j++ ) {
-         tmp.data[i][j] /= s;
+      // divide row so that the pivot is 1
+      double s = 1.0 / tmp.data[i][i];
+      for( int k=0; k<K; k++ ) {
+         tmp.data[i][k] *= s;
+         res.data[i][k] *= s;
       }
-   }
 
-   // row operations to transform input to identity (no need to do last row)
-   for( int i=K-2; i>=0; i-- ) {
-      // for each row below the current row, subtract a multiple of that row
-      for( int j=K-1; j>i; j-- ) {
-         // multiply the subracted row by the first constant in this row
-         double m = tmp.data[i][j];
-         for( int k=0; k<K*2; k++ ) {
-            tmp.data[i][k] -= tmp.data[j][k]*m;
+      // eliminate column i from every other row
+      for( int j=0; j<K; j++ ) {
+         if( j == i ) continue;
+         double f = tmp.data[j][i];
+         if( f != 0.0 ) {
+            for( int k=0; k<K; k++ ) {
+               tmp.data[j][k] -= tmp.data[i][k] * f;
+               res.data[j][k] -= res.data[i][k] * f;
+            }
          }
       }
    }
 
-   // build result matrix
-   for( int i=0; i<K; i++ ) {
-      for( int j=0; j<K; j++ ) {
-         res.data[i][j] = tmp.data[i][j+K];
-      }
-   }
+   return true;
+}
+
+// closed-form 2x2 inverse
+inline bool invert(const matrix<2, 2> & m, matrix<2, 2> & res) {
+   double det = m.data[0][0] * m.data[1][1] - m.data[0][1] * m.data[1][0];
+   if( det == 0.0 ) return false;
+   double inv = 1.0 / det;
+   res.data[0][0] =  m.data[1][1] * inv;
+   res.data[0][1] = -m.data[0][1] * inv;
+   res.data[1][0] = -m.data[1][0] * inv;
+   res.data[1][1] =  m.data[0][0] * inv;
+   return true;
+}
 
+// closed-form 3x3 inverse (adjugate over determinant)
+inline bool invert(const matrix<3, 3> & m, matrix<3, 3> & res) {
+   const double (*a)[3] = m.data;
+   double c00 = a[1][1]*a[2][2] - a[1][2]*a[2][1];
+   double c01 = a[1][2]*a[2][0] - a[1][0]*a[2][2];
+   double c02 = a[1][0]*a[2][1] - a[1][1]*a[2][0];
+   double det = a[0][0]*c00 + a[0][1]*c01 + a[0][2]*c02;
+   if( det == 0.0 ) return false;
+   double inv = 1.0 / det;
+   res.data[0][0] = c00 * inv;
+   res.data[1][0] = c01 * inv;
+   res.data[2][0] = c02 * inv;
+   res.data[0][1] = (a[0][2]*a[2][1] - a[0][1]*a[2][2]) * inv;
+   res.data[1][1] = (a[0][0]*a[2][2] - a[0][2]*a[2][0]) * inv;
+   res.data[2][1] = (a[0][1]*a[2][0] - a[0][0]*a[2][1]) * inv;
+   res.data[0][2] = (a[0][1]*a[1][2] - a[0][2]*a[1][1]) * inv;
+   res.data[1][2] = (a[0][2]*a[1][0] - a[0][0]*a[1][2]) * inv;
+   res.data[2][2] = (a[0][0]*a[1][1] - a[0][1]*a[1][0]) * inv;
+   return true;
+}
+
+// inversion; the result is all NaN if m is singular
+template<int K>
+inline matrix<K, K> invert(const matrix<K, K> & m) {
+   matrix<K, K> res;
+   if( !invert(m, res) ) set_nan(res);
    return res;
 }
 
-// generate and identity matrix of the requested size
+// Cholesky factorization of a symmetric positive-definite matrix
+//  a = l * l^T, with l lower triangular. only the lower triangle of a is
+//  read. returns false if a is not positive-definite
 template<int K>
-matrix<K, K> I() {
-   matrix<K, K> ret(0.0);
-   // initialization to 0 and then setting the diagonal has complexity 
-   //  O(K*K + K) ~= O(K*K) which is acceptable for now
-   //  if this is really an issue, fix it then
+inline bool cholesky(const matrix<K, K> & a, matrix<K, K> & l) {
    for( int i=0; i<K; i++ ) {
-      ret.data[i][i] = 1.0;
+      for( int j=0; j<=i; j++ ) {
+         double sum = a.data[i][j];
+         for( int k=0; k<j; k++ ) {
+            sum -= l.data[i][k] * l.data[j][k];
+         }
+         if( i == j ) {
+            if( sum <= 0.0 ) return false;
+            l.data[i][i] = sqrt(sum);
+         } else {
+            l.data[i][j] = sum / l.data[j][j];
+         }
+      }
+      for( int j=i+1; j<K; j++ ) {
+         l.data[i][j] = 0.0;
+      }
    }
+   return true;
+}
 
-   return ret;
+// solve a * x = b for symmetric positive-definite a, by Cholesky
+//  factorization and forward/back substitution. returns false if a is not
+//  positive-definite
+template<int K, int M>
+inline bool solve(const matrix<K, K> & a, const matrix<K, M> & b,
+      matrix<K, M> & x) {
+   matrix<K, K> l;
+   if( !cholesky(a, l) ) return false;
+
+   for( int c=0; c<M; c++ ) {
+      // forward substitution: l * y = b
+      for( int i=0; i<K; i++ ) {
+         double sum = b.data[i][c];
+         for( int k=0; k<i; k++ ) {
+            sum -= l.data[i][k] * x.data[k][c];
+         }
+         x.data[i][c] = sum / l.data[i][i];
+      }
+      // back substitution: l^T * x = y
+      for( int i=K-1; i>=0; i-- ) {
+         double sum = x.data[i][c];
+         for( int k=i+1; k<K; k++ ) {
+            sum -= l.data[k][i] * x.data[k][c];
+         }
+         x.data[i][c] = sum / l.data[i][i];
+      }
+   }
+   return true;
 }
 
 // output function
-template<int N, int M> 
-std::ostream & operator<<(std::ostream & out, matrix<N, M> m) {
+template<int N, int M>
+std::ostream & operator<<(std::ostream & out, const matrix<N, M> & m) {
    out << "[ ";
    for( int i=0; i<N; i++ ) {
       if( i != 0 ) out << "  ";
       out << "[ ";
       for( int j=0; j<M; j++ ) {
          out << m.data[i][j];
-         if( j < M-1 ) 
+         if( j < M-1 )
             out << ", ";
       }
       out << " ]";
@@ -200,3 +329,5 @@ std::ostream & operator<<(std::ostream & out, matrix<N, M> m) {
    out << " ]" << std::endl;
    return out;
 }
+
+#endif
@@ -1,15 +1,176 @@
 /* matrix_test.cpp
  *
- * unit tests for the matrix class
+ * unit tests and microbenchmarks for the matrix class
+ *
+ * Accuracy tests compare each solver against the identity on random
+ *  well-conditioned inputs; benchmarks time the operations the filter uses.
+ *  Exits non-zero if any accuracy test fails.
  *
  * Author: Austin Hendrix
  */
 
 #include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include "matrix.h"
 
 using namespace std;
 
+// tolerance for accuracy tests
+#define EPS 1e-9
+
+int failures = 0;
+
+void check(const char * name, double err) {
+   if( err > EPS || err != err ) {
+      printf("FAIL %s: error %g\n", name, err);
+      ++failures;
+   } else {
+      printf("ok   %s: error %g\n", name, err);
+   }
+}
+
+// largest absolute difference from the identity
+template<int K>
+double identity_err(const matrix<K, K> & m) {
+   double err = 0;
+   for( int i=0; i<K; i++ ) {
+      for( int j=0; j<K; j++ ) {
+         double e = fabs(m.data[i][j] - (i==j?1.0:0.0));
+         if( e > err || e != e ) err = e;
+      }
+   }
+   return err;
+}
+
+template<int N, int M>
+double max_diff(const matrix<N, M> & a, const matrix<N, M> & b) {
+   double err = 0;
+   for( int i=0; i<N; i++ ) {
+      for( int j=0; j<M; j++ ) {
+         double e = fabs(a.data[i][j] - b.data[i][j]);
+         if( e > err || e != e ) err = e;
+      }
+   }
+   return err;
+}
+
+template<int N, int M>
+matrix<N, M> random_matrix() {
+   matrix<N, M> r;
+   for( int i=0; i<N; i++ )
+      for( int j=0; j<M; j++ )
+         r.data[i][j] = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+   return r;
+}
+
+// random symmetric positive-definite matrix: A*A^T + K*I
+template<int K>
+matrix<K, K> random_spd() {
+   matrix<K, K> a = random_matrix<K, K>();
+   return a * a.T() + I<K>() * K;
+}
+
+// the general Gauss-Jordan inverse, bypassing the closed-form overloads
+template<int K>
+matrix<K, K> gauss_jordan(const matrix<K, K> & m) {
+   matrix<K, K> res;
+   if( !invert<K>(m, res) ) set_nan(res);
+   return res;
+}
+
+template<int K>
+void test_invert(const char * name) {
+   double err = 0;
+   double gj_err = 0;
+   for( int t=0; t<1000; t++ ) {
+      matrix<K, K> a = random_spd<K>();
+      double e = identity_err(invert(a) * a);
+      if( e > err ) err = e;
+      e = max_diff(invert(a), gauss_jordan(a));
+      if( e > gj_err ) gj_err = e;
+   }
+   char buf[64];
+   snprintf(buf, 64, "%s inverse", name);
+   check(buf, err);
+   snprintf(buf, 64, "%s inverse vs Gauss-Jordan", name);
+   check(buf, gj_err);
+}
+
+template<int K>
+void test_solve(const char * name) {
+   double err = 0;
+   for( int t=0; t<1000; t++ ) {
+      matrix<K, K> a = random_spd<K>();
+      matrix<K, 2> b = random_matrix<K, 2>();
+      matrix<K, 2> x;
+      if( !solve(a, b, x) ) {
+         err = NAN;
+         break;
+      }
+      double e = max_diff(a * x, b);
+      if( e > err ) err = e;
+   }
+   char buf[64];
+   snprintf(buf, 64, "%s Cholesky solve", name);
+   check(buf, err);
+}
+
+double now() {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// keep the optimizer from discarding benchmark results
+volatile double sink;
+
+#define BENCH_ITERS 1000000
+
+template<int K>
+void bench(const char * name) {
+   matrix<K, K> a = random_spd<K>();
+   matrix<K, K> b = random_spd<K>();
+   matrix<K, K> r;
+   double start;
+
+   start = now();
+   for( int i=0; i<BENCH_ITERS; i++ ) {
+      a.data[0][0] += 1e-12;
+      r = a * b;
+      sink = r.data[K-1][K-1];
+   }
+   printf("%s multiply: %.1f ns\n", name, (now() - start) * 1e9 / BENCH_ITERS);
+
+   start = now();
+   for( int i=0; i<BENCH_ITERS; i++ ) {
+      a.data[0][0] += 1e-12;
+      r = invert(a);
+      sink = r.data[K-1][K-1];
+   }
+   printf("%s invert: %.1f ns\n", name, (now() - start) * 1e9 / BENCH_ITERS);
+
+   start = now();
+   for( int i=0; i<BENCH_ITERS; i++ ) {
+      a.data[0][0] += 1e-12;
+      r = gauss_jordan(a);
+      sink = r.data[K-1][K-1];
+   }
+   printf("%s Gauss-Jordan: %.1f ns\n", name,
+         (now() - start) * 1e9 / BENCH_ITERS);
+
+   start = now();
+   for( int i=0; i<BENCH_ITERS; i++ ) {
+      a.data[0][0] += 1e-12;
+      solve(a, b, r);
+      sink = r.data[K-1][K-1];
+   }
+   printf("%s Cholesky solve: %.1f ns\n", name,
+         (now() - start) * 1e9 / BENCH_ITERS);
+}
+
 int main(int argc, char ** argv) {
    matrix<3, 3> a = I<3>();
    matrix<3, 3> b = I<3>();
@@ -34,10 +195,49 @@ int main(int argc, char ** argv) {
    cout << d << endl;
 
    cout << invert(d) << endl;
-   /* ought to be:
-    * [ [ 1, 0, 0]
-    *   [ 0.571, -0.142, 0]
-    *   [ 0.361, 0.056, -0.194] ]
+   /* ought to be, with det(d) = 36:
+    * [ [ -7, 10,  1 ]
+    *   [  2, -8, 10 ]
+    *   [ 13,  2, -7 ] ] / 36
     */
    cout << invert(d) * d << endl;
+
+   // accuracy
+   check("3x3 example inverse", identity_err(invert(d) * d));
+   check("3x3 example inverse, right", identity_err(d * invert(d)));
+   check("3x3 example Gauss-Jordan", identity_err(gauss_jordan(d) * d));
+
+   // p needs a row swap; this failed without pivoting
+   matrix<3, 3> p(0.0);
+   p.data[0][1] = 1.0;
+   p.data[1][0] = 2.0;
+   p.data[2][2] = 3.0;
+   check("Gauss-Jordan zero pivot", identity_err(gauss_jordan(p) * p));
+
+   matrix<3, 3> singular(1.0);
+   check("3x3 singular is NaN", isnan(invert(singular).data[0][0]) ? 0 : 1);
+   check("4x4 singular is NaN",
+         isnan(invert(matrix<4, 4>(1.0)).data[0][0]) ? 0 : 1);
+   matrix<2, 2> l;
+   check("not positive-definite", cholesky(matrix<2, 2>(1.0), l) ? 1 : 0);
+
+   test_invert<2>("2x2");
+   test_invert<3>("3x3");
+   test_invert<6>("6x6");
+   test_solve<2>("2x2");
+   test_solve<3>("3x3");
+   test_solve<6>("6x6");
+
+   // benchmarks
+   if( argc < 2 || string(argv[1]) != "-n" ) {
+      bench<2>("2x2");
+      bench<3>("3x3");
+      bench<6>("6x6");
+   }
+
+   if( failures ) {
+      printf("%d tests failed\n", failures);
+      return 1;
+   }
+   return 0;
 }
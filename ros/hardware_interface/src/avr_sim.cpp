@@ -0,0 +1,481 @@
+/* avr_sim.cpp
+ *
+ * stand-in for the AVR on a pseudo-terminal, for running and load-testing
+ *  hardware_interface without the robot
+ *
+ * Opens a pty and prints the path of its slave end; run hardware_interface
+ *  with _port:=<path> _boot_delay:=0. Like the AVR, it only publishes while
+ *  heartbeats keep arriving, and it publishes odometry at 50 Hz, IMU at
+ *  50 Hz, sonar at 4 Hz and GPS, idle time and task timing at 1 Hz, from a
+ *  robot that drives at the last commanded speed and steering. Output is
+ *  paced to the baud rate, and each message type has a single frame buffer
+ *  as on the AVR, so when the offered load exceeds the link a message is
+ *  skipped while its last frame is still queued. Its clock runs 100 ppm
+ *  fast, to exercise the node's clock estimation; each heartbeat is answered
+ *  with the tick count it arrived at. Noise can be injected as random byte
+ *  errors and bursts of garbage between frames.
+ *
+ * Every second it prints the bytes and frames sent, link utilization,
+ *  frames skipped and corrupted, and the commands and heartbeats received.
+ *  The heartbeat's deviation from its 0.5 s period measures how late the
+ *  node's event loop runs. Compare the counts with the node's "Serial
+ *  Framing" and "Serial Latency" diagnostics.
+ *
+ * Usage: avr_sim [-b baud] [-r rate] [-e byte_error_rate] [-g burst_rate]
+ *                [-t seconds]
+ *  -b baud rate to pace output to (default 115200; 0 for no limit)
+ *  -r multiplies every message rate (default 1)
+ *  -e probability that each byte sent is replaced with a random one
+ *  -g probability that a burst of garbage follows each frame
+ *  -t exit after this many seconds
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <string>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "messages.h"
+#include "frame_parser.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+// messages the AVR publishes
+enum { ODOM, IMU, GPS, SONAR, IDLE, TASKS, TIME, TYPES };
+const char type_names[TYPES] = { 'O', 'U', 'G', 'S', 'I', 'K', 'T' };
+// Hz; 0 for messages that aren't periodic
+const double type_rates[TYPES] = { 50, 50, 1, 4, 1, 1, 0 };
+
+// the AVR's clock runs this much fast
+#define CLOCK_SKEW 100e-6
+
+#define HEARTBEAT_PERIOD 0.5
+// the AVR stops publishing this long after the last heartbeat
+#define HEARTBEAT_TIMEOUT 1.0
+
+double baud = 115200;
+double rate = 1.0;
+double byte_error_rate = 0;
+double burst_rate = 0;
+
+struct counters {
+   uint64_t bytes;
+   uint32_t sent[TYPES];
+   uint32_t skipped[TYPES];
+   uint32_t corrupted;
+   uint32_t bursts;
+   uint32_t stalls; // writes refused because the node isn't reading
+   uint32_t commands;
+   uint32_t heartbeats;
+   uint32_t malformed;
+};
+
+counters total;
+
+// heartbeat lateness (s), over the last second and the whole run
+latency_histogram jitter;
+latency_histogram jitter_total;
+
+volatile sig_atomic_t done = 0;
+
+void stop(int) {
+   done = 1;
+}
+
+double uniform() {
+   return rand() / (RAND_MAX + 1.0);
+}
+
+double boot; // when the simulated AVR started
+
+// the simulated AVR's 1 kHz tick count
+uint32_t sim_ticks() {
+   return (uint32_t)((monotonic() - boot) * 1000 * (1 + CLOCK_SKEW));
+}
+
+double gaussian(double sigma) {
+   double u = uniform() + 1e-12;
+   return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * uniform());
+}
+
+// the simulated robot
+struct robot {
+   double x, y, yaw;
+   double speed;     // m/s
+   double curvature; // 1/m
+   uint8_t seq[TYPES];
+
+   robot() : x(0), y(0), yaw(0), speed(0), curvature(0) {
+      for( int i=0; i<TYPES; i++ ) seq[i] = 0;
+   }
+
+   void step(double dt) {
+      yaw += speed * curvature * dt;
+      x += speed * cos(yaw) * dt;
+      y += speed * sin(yaw) * dt;
+   }
+
+   // follow a command; steering is roughly 1/m at full lock
+   void command(const command_msg & c) {
+      speed = c.speed * 0.016;
+      curvature = -c.steer / 120.0;
+   }
+};
+
+// bytes waiting for the link, one frame per entry
+struct outgoing {
+   int type;
+   string bytes;
+};
+
+deque<outgoing> tx;
+size_t tx_pos = 0;     // bytes of the front frame already written
+double link_free = 0;  // when the link finishes the bytes already written
+bool busy[TYPES];      // a frame of this type is queued
+
+template<class M> void publish(int type, const M & m, uint8_t seq) {
+   uint8_t buf[wire_size<M>::FRAME];
+   uint8_t n = encode(m, seq, buf);
+
+   outgoing o;
+   o.type = type;
+   o.bytes.assign((const char *)buf, n);
+   bool corrupt = false;
+   for( size_t i=0; i<o.bytes.size(); i++ ) {
+      if( uniform() < byte_error_rate ) {
+         o.bytes[i] ^= rand() % 255 + 1;
+         corrupt = true;
+      }
+   }
+   if( corrupt ) ++total.corrupted;
+   if( uniform() < burst_rate ) {
+      int len = rand() % 64 + 1;
+      for( int i=0; i<len; i++ ) o.bytes += (char)rand();
+      ++total.bursts;
+   }
+
+   if( tx.empty() && link_free < monotonic() ) link_free = monotonic();
+   tx.push_back(o);
+   busy[type] = true;
+   ++total.sent[type];
+}
+
+void publish(int type, robot & r) {
+   uint8_t seq = r.seq[type]++;
+   switch( type ) {
+      case ODOM: {
+         odometry_msg m;
+         m.linear = (r.speed + gaussian(0.01)) * 1000;
+         m.angular = (r.speed * r.curvature + gaussian(0.01)) * 1000;
+         m.x = r.x * 1000;
+         m.y = r.y * 1000;
+         m.yaw = atan2(sin(r.yaw), cos(r.yaw)) * 1000;
+         m.ticks = sim_ticks();
+         m.bump = 0;
+         publish(type, m, seq);
+         break;
+      }
+      case IMU: {
+         imu_msg m;
+         m.x = gaussian(0.02);
+         m.y = gaussian(0.02);
+         m.z = r.yaw + gaussian(0.05);
+         m.ticks = sim_ticks();
+         publish(type, m, seq);
+         break;
+      }
+      case GPS: {
+         gps_msg m;
+         // meters to millionths of a degree, near 37.4N 122.1W
+         m.lat = 37400000 + (r.y + gaussian(3.0)) * 9.0;
+         m.lon = -122100000 + (r.x + gaussian(3.0)) * 11.3;
+         m.ticks = sim_ticks();
+         publish(type, m, seq);
+         break;
+      }
+      case SONAR: {
+         sonar_msg m;
+         for( int i=0; i<NUM_SONARS; i++ ) m.range[i] = 40 + rand() % 200;
+         m.ticks = sim_ticks();
+         publish(type, m, seq);
+         break;
+      }
+      case IDLE: {
+         idle_msg m;
+         m.idle = 800 + rand() % 50;
+         m.i2c_fail = 0;
+         m.i2c_resets = 0;
+         // a skipped message is a dropped frame to the node; the simulated
+         //  link has no real-time slots, so nothing is deferred
+         uint32_t dropped = 0;
+         for( int i=0; i<TYPES; i++ ) dropped += total.skipped[i];
+         m.tx_dropped = dropped;
+         m.tx_deferred = 0;
+         publish(type, m, seq);
+         break;
+      }
+      case TASKS: {
+         // typical run times of the AVR's tasks (us)
+         static const uint16_t wcet[NUM_TASKS] = { 300, 150, 450, 0, 350,
+            250, 900, 30 };
+         task_msg m;
+         for( int i=0; i<NUM_TASKS; i++ ) {
+            m.wcet[i] = wcet[i] + rand() % 50;
+            m.overruns[i] = 0;
+         }
+         m.tick_isr = 40 + rand() % 20;
+         publish(type, m, seq);
+         break;
+      }
+   }
+}
+
+// write as much of the queue as the link would have sent by now
+void drain(int fd, double now) {
+   // a link held up by the node not reading catches up with at most 10 ms
+   //  of data at once
+   if( link_free < now - 0.01 ) link_free = now - 0.01;
+   while( !tx.empty() ) {
+      outgoing & o = tx.front();
+      size_t n = o.bytes.size() - tx_pos;
+      if( baud > 0 ) {
+         // bytes the link has finished sending by now, 10 bits each
+         double room = floor((now - link_free) * baud / 10);
+         if( room < 1 ) return;
+         if( n > room ) n = room;
+      }
+      int cnt = write(fd, o.bytes.data() + tx_pos, n);
+      if( cnt < 0 ) {
+         if( errno == EAGAIN ) ++total.stalls;
+         return;
+      }
+      total.bytes += cnt;
+      if( baud > 0 ) link_free += cnt * 10 / baud;
+      tx_pos += cnt;
+      if( tx_pos < o.bytes.size() ) return;
+      busy[o.type] = false;
+      tx.pop_front();
+      tx_pos = 0;
+   }
+}
+
+struct receiver {
+   robot * r;
+   double * last_heartbeat;
+   bool * enabled;
+
+   void operator()(const frame & f) const {
+      command_msg cmd;
+      heartbeat_msg hb;
+      double now = monotonic();
+      if( decode(f, cmd) ) {
+         r->command(cmd);
+         ++total.commands;
+      } else if( decode(f, hb) ) {
+         if( *last_heartbeat > 0 ) {
+            double late = fabs(now - *last_heartbeat - HEARTBEAT_PERIOD);
+            jitter.add(late);
+            jitter_total.add(late);
+         }
+         *last_heartbeat = now;
+         ++total.heartbeats;
+         // answer with the time it arrived
+         if( *enabled && !busy[TIME] ) {
+            time_msg t;
+            t.heartbeat = f.seq;
+            t.ticks = sim_ticks();
+            publish(TIME, t, r->seq[TIME]++);
+         } else if( *enabled ) {
+            ++total.skipped[TIME];
+         }
+      } else {
+         ++total.malformed;
+      }
+   }
+};
+
+void report(const char * label, const counters & c, const counters & last,
+      double dt, const latency_histogram & late,
+      const frame_parser<1024> & rx) {
+   uint32_t sent = 0, skipped = 0;
+   char types[64];
+   int p = 0;
+   for( int i=0; i<TYPES; i++ ) {
+      sent += c.sent[i] - last.sent[i];
+      skipped += c.skipped[i] - last.skipped[i];
+      p += snprintf(types + p, sizeof(types) - p, " %c %u", type_names[i],
+            c.sent[i] - last.sent[i]);
+   }
+   double bps = (c.bytes - last.bytes) / dt;
+   printf("%s tx %7.0f B/s", label, bps);
+   if( baud > 0 ) printf(" (%3.0f%%)", bps * 10 / baud * 100);
+   printf(" frames %u [%s ] skipped %u corrupted %u bursts %u stalls %u | "
+         "rx C %u H %u bad %u | heartbeat late p99 %.1f ms max %.1f ms\n",
+         sent, types + 1, skipped, c.corrupted - last.corrupted,
+         c.bursts - last.bursts, c.stalls - last.stalls,
+         c.commands - last.commands, c.heartbeats - last.heartbeats,
+         rx.cobs_errors + rx.length_errors + rx.crc_errors + c.malformed,
+         late.percentile(0.99) * 1000, late.max() * 1000);
+   fflush(stdout);
+}
+
+int open_pty(string & path) {
+   int master = posix_openpt(O_RDWR | O_NOCTTY);
+   if( master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 ) {
+      perror("Failed to open pty");
+      return -1;
+   }
+   path = ptsname(master);
+   fcntl(master, F_SETFL, O_NONBLOCK);
+   return master;
+}
+
+int main(int argc, char ** argv) {
+   double duration = 0;
+   int opt;
+   while( (opt = getopt(argc, argv, "b:r:e:g:t:")) != -1 ) {
+      switch( opt ) {
+         case 'b': baud = atof(optarg); break;
+         case 'r': rate = atof(optarg); break;
+         case 'e': byte_error_rate = atof(optarg); break;
+         case 'g': burst_rate = atof(optarg); break;
+         case 't': duration = atof(optarg); break;
+         default:
+            fprintf(stderr, "Usage: %s [-b baud] [-r rate] "
+                  "[-e byte_error_rate] [-g burst_rate] [-t seconds]\n",
+                  argv[0]);
+            return 1;
+      }
+   }
+
+   string path;
+   int master = open_pty(path);
+   if( master < 0 ) return 1;
+
+   // raw mode, and hold the slave open so reads on the master don't fail
+   //  while the node isn't connected
+   int slave = open(path.c_str(), O_RDWR | O_NOCTTY);
+   if( slave < 0 ) {
+      perror("Failed to open pty slave");
+      return 1;
+   }
+   struct termios tio;
+   tcgetattr(slave, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(slave, TCSANOW, &tio);
+
+   printf("%s\n", path.c_str());
+   fflush(stdout);
+
+   signal(SIGINT, stop);
+   signal(SIGTERM, stop);
+   srand(time(0));
+
+   robot r;
+   frame_parser<1024> rx;
+   double last_heartbeat = 0;
+   bool enabled = false;
+   receiver handler = { &r, &last_heartbeat, &enabled };
+
+   double start = monotonic();
+   // as if the AVR had been running a while; its tick count has wrapped the
+   //  16 bits sent with sensor messages
+   boot = start - 100 - uniform() * 100;
+   double now = start;
+   double next[TYPES];
+   for( int i=0; i<TYPES; i++ ) {
+      busy[i] = false;
+      if( type_rates[i] > 0 ) {
+         next[i] = start + uniform() / (type_rates[i] * rate);
+      }
+   }
+   double last_step = start;
+   double next_report = start + 1.0;
+   counters last = total;
+
+   while( !done ) {
+      now = monotonic();
+      if( duration > 0 && now - start > duration ) break;
+
+      r.step(now - last_step);
+      last_step = now;
+
+      enabled = last_heartbeat > 0 &&
+         now - last_heartbeat < HEARTBEAT_TIMEOUT;
+      double wake = next_report;
+      for( int i=0; i<TYPES; i++ ) {
+         if( type_rates[i] <= 0 ) continue;
+         double period = 1.0 / (type_rates[i] * rate);
+         // don't try to make up for more than a second
+         if( next[i] < now - 1.0 ) next[i] = now;
+         while( next[i] <= now ) {
+            if( !enabled ) {
+               // not publishing
+            } else if( busy[i] ) {
+               ++total.skipped[i];
+            } else {
+               publish(i, r);
+               drain(master, now);
+            }
+            next[i] += period;
+         }
+         if( next[i] < wake ) wake = next[i];
+      }
+
+      drain(master, now);
+      // come back when the link has room for more
+      if( !tx.empty() && baud > 0 ) {
+         double t = link_free + 10 / baud;
+         if( t < wake ) wake = t;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = master;
+      pfd.events = POLLIN;
+      if( !tx.empty() && baud <= 0 ) pfd.events |= POLLOUT;
+      int timeout = (int)ceil((wake - now) * 1000);
+      if( timeout < 0 ) timeout = 0;
+      if( poll(&pfd, 1, timeout) < 0 && errno != EINTR ) {
+         perror("poll failed");
+         break;
+      }
+
+      if( pfd.revents & POLLIN ) {
+         uint8_t * buf;
+         unsigned space = rx.prepare(&buf);
+         int cnt = read(master, buf, space);
+         if( cnt > 0 ) {
+            rx.commit(cnt);
+            rx.parse(handler);
+         }
+      }
+
+      now = monotonic();
+      if( now >= next_report ) {
+         report("", total, last, 1.0, jitter, rx);
+         last = total;
+         jitter.clear();
+         next_report += 1.0;
+         if( next_report < now ) next_report = now + 1.0;
+      }
+   }
+
+   counters zero;
+   memset(&zero, 0, sizeof(zero));
+   report("total", total, zero, now - start, jitter_total, rx);
+
+   close(slave);
+   close(master);
+   return 0;
+}
@@ -0,0 +1,155 @@
+/* clock_sync.h
+ *
+ * Estimates the AVR's clock in host time from heartbeat round trips.
+ *
+ * The host notes when it sends each heartbeat, and the AVR answers with its
+ *  tick count when the heartbeat arrived. That tick fell somewhere within
+ *  the round trip, so the round trip's midpoint is its host time to within
+ *  half the round trip. Serial buffering and scheduling stretch most round
+ *  trips, but the shortest are nearly symmetric, so only the shortest round
+ *  trip of each window is kept (a min filter), and a line fitted through
+ *  the last few windows gives the offset and skew between the clocks.
+ *  Stamps are good to about half the shortest round trip, plus a tick.
+ *
+ * If the AVR restarts, its ticks no longer fit the line; the history is
+ *  dropped and the estimate starts over.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdint.h>
+#include <math.h>
+#include <deque>
+
+class clock_sync {
+   public:
+      // AVR ticks per second
+      static const int TICK_HZ = 1000;
+
+      // keep the best round trip of each window seconds, for windows windows
+      clock_sync(double window = 10.0, unsigned windows = 30) :
+         resets(0), window(window), windows(windows), have_current(false),
+         offset(0), skew(0), x_mean(0) {}
+
+      uint32_t resets; // times the AVR clock jumped and the history was lost
+
+      bool valid() const { return have_current; }
+
+      /* a round trip: sent at host time t0 and answered at t1; the AVR's
+       *  clock read ticks when the request arrived
+       */
+      void add(double t0, double t1, uint32_t ticks) {
+         double rtt = t1 - t0;
+         if( rtt < 0 ) return;
+         sample s;
+         s.x = ticks / (double)TICK_HZ;
+         s.host = (t0 + t1) / 2;
+         s.rtt = rtt;
+
+         // a jump of more than a second isn't drift
+         if( have_current && fabs(host_time(ticks) - s.host) > 1.0 ) {
+            history.clear();
+            have_current = false;
+            ++resets;
+         }
+
+         if( !have_current || t1 - window_start >= window ) {
+            if( have_current ) {
+               history.push_back(current);
+               if( history.size() > windows ) history.pop_front();
+            }
+            current = s;
+            window_start = t1;
+            have_current = true;
+         } else if( rtt < current.rtt ) {
+            current = s;
+         }
+         fit();
+      }
+
+      // host time of an AVR tick count
+      double host_time(uint32_t ticks) const {
+         double x = ticks / (double)TICK_HZ;
+         return x + offset + skew * (x - x_mean);
+      }
+
+      // AVR tick count at a host time
+      uint32_t ticks_at(double host) const {
+         double x = (host - offset + skew * x_mean) / (1 + skew);
+         return (uint32_t)(x * TICK_HZ);
+      }
+
+      /* the full tick count of a stamp that kept only its low 16 bits,
+       *  taken before host time now (give or take a second)
+       */
+      uint32_t unwrap(uint16_t ticks, double now) const {
+         uint32_t ref = ticks_at(now) + TICK_HZ;
+         return ref - (uint16_t)(ref - ticks);
+      }
+
+      // host minus AVR clock at the latest sample (s)
+      double current_offset() const {
+         return offset + skew * (current.x - x_mean);
+      }
+      // rate of the host clock relative to the AVR's, minus one
+      double current_skew() const { return skew; }
+      // shortest round trip in the current window (s)
+      double current_rtt() const { return current.rtt; }
+      // samples in the fit
+      unsigned samples() const {
+         // the current window's best is only used until there are enough
+         //  finished windows; until its window ends it may be a poor one
+         return history.size() >= 2 ? history.size() :
+            history.size() + have_current;
+      }
+
+   private:
+      struct sample {
+         double x;    // AVR time (s)
+         double host; // host time (s)
+         double rtt;  // round trip (s)
+      };
+
+      double window;
+      unsigned windows;
+      std::deque<sample> history;
+      sample current;
+      double window_start;
+      bool have_current;
+
+      // host = x + offset + skew * (x - x_mean)
+      double offset;
+      double skew;
+      double x_mean;
+
+      void fit() {
+         unsigned n = samples();
+         double sx = 0, sy = 0;
+         for( unsigned i=0; i<n; i++ ) {
+            const sample & s = at(i);
+            sx += s.x;
+            sy += s.host - s.x;
+         }
+         x_mean = sx / n;
+         offset = sy / n;
+
+         double sxx = 0, sxy = 0;
+         for( unsigned i=0; i<n; i++ ) {
+            const sample & s = at(i);
+            double dx = s.x - x_mean;
+            sxx += dx * dx;
+            sxy += dx * (s.host - s.x - offset);
+         }
+         // skew is meaningless until the samples span a few seconds
+         skew = sxx > 1.0 ? sxy / sxx : 0;
+      }
+
+      const sample & at(unsigned i) const {
+         return i < history.size() ? history[i] : current;
+      }
+};
+
+#endif
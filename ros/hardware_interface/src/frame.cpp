@@ -0,0 +1 @@
+../../../protocol/frame.cpp
\ No newline at end of file
@@ -0,0 +1,165 @@
+/* frame_parser.h
+ *
+ * Ring-buffer parser for v2 frames (see frame.h) from the serial port.
+ *
+ * Reads go straight into the ring (prepare()/commit()); parse() finds
+ *  delimiters with memchr, decodes each frame in place and hands it to a
+ *  handler. Only a frame that wraps around the end of the ring is copied,
+ *  into a scratch buffer, so decoding always sees a contiguous span.
+ *
+ * A frame longer than FRAME_MAX_ENCODED can't be valid; as soon as one is
+ *  detected its bytes are released and everything up to the next delimiter
+ *  is discarded, so a lost delimiter can never stall the ring. Frames that
+ *  fail to decode are dropped, and gaps in each type's sequence numbers are
+ *  counted as lost frames. Each case has a counter.
+ *
+ * N is the ring size, and must be a power of two larger than MAX_FRAME.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef FRAME_PARSER_H
+#define FRAME_PARSER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+template<unsigned N>
+class frame_parser {
+   public:
+      // longest frame, without its delimiter
+      static const unsigned MAX_FRAME = FRAME_MAX_ENCODED - 1;
+
+      uint32_t frames;    // frames delivered
+      uint32_t wrapped;   // frames copied because they wrapped the ring
+      uint32_t runts;     // empty frames (back-to-back delimiters)
+      uint32_t overflows; // frames dropped for being longer than MAX_FRAME
+      uint32_t dropped;   // bytes discarded by overflows
+      uint32_t cobs_errors;
+      uint32_t length_errors;
+      uint32_t crc_errors;
+      uint32_t lost;      // frames missing from the sequence numbers
+      uint64_t bytes;     // bytes received
+
+      frame_parser() : frames(0), wrapped(0), runts(0), overflows(0),
+         dropped(0), cobs_errors(0), length_errors(0), crc_errors(0),
+         lost(0), bytes(0), head(0), tail(0), scan(0), discarding(false) {
+         for( int i=0; i<256; i++ ) seen[i] = false;
+      }
+
+      // contiguous free space to read into; returns its size
+      unsigned prepare(uint8_t ** p) {
+         unsigned h = head & (N - 1);
+         unsigned space = N - (head - tail);
+         *p = ring + h;
+         return space < N - h ? space : N - h;
+      }
+
+      // n bytes were written at the pointer from prepare()
+      void commit(unsigned n) {
+         head += n;
+         bytes += n;
+      }
+
+      // deliver every complete, valid frame to handler(const frame &)
+      template<class F> void parse(F handler) {
+         while( scan != head ) {
+            unsigned s = scan & (N - 1);
+            unsigned avail = head - scan;
+            unsigned run = avail < N - s ? avail : N - s;
+            const uint8_t * hit = (const uint8_t *)memchr(ring + s,
+                  FRAME_DELIMITER, run);
+
+            if( !hit ) {
+               scan += run;
+               if( scan - tail > MAX_FRAME ) {
+                  // too long to be a frame; drop it and resync on the next
+                  //  delimiter
+                  if( !discarding ) ++overflows;
+                  discarding = true;
+                  dropped += scan - tail;
+                  tail = scan;
+               }
+               continue;
+            }
+
+            uint32_t end = scan + (hit - (ring + s));
+            unsigned len = end - tail;
+            if( discarding ) {
+               dropped += len + 1;
+               discarding = false;
+            } else if( len > MAX_FRAME ) {
+               dropped += len + 1;
+               ++overflows;
+            } else if( len == 0 ) {
+               ++runts;
+            } else {
+               deliver(tail, len, handler);
+            }
+            tail = scan = end + 1;
+         }
+      }
+
+      // bytes received but not yet part of a complete frame
+      unsigned pending() const { return head - tail; }
+
+   private:
+      uint8_t ring[N];
+      uint8_t scratch[MAX_FRAME];
+
+      // free-running stream positions; masked to index the ring
+      uint32_t head; // end of received data
+      uint32_t tail; // start of the current frame
+      uint32_t scan; // searched up to here without finding a delimiter
+
+      bool discarding;
+
+      // last sequence number of each type
+      uint8_t last_seq[256];
+      bool seen[256];
+
+      // compile-time checks on N
+      typedef char n_is_power_of_two[(N & (N - 1)) == 0 ? 1 : -1];
+      typedef char n_holds_a_frame[N > MAX_FRAME + 1 ? 1 : -1];
+
+      template<class F> void deliver(uint32_t start, unsigned len,
+            F & handler) {
+         unsigned t = start & (N - 1);
+         uint8_t * data = ring + t;
+         if( t + len > N ) {
+            unsigned first = N - t;
+            memcpy(scratch, ring + t, first);
+            memcpy(scratch + first, ring, len - first);
+            data = scratch;
+            ++wrapped;
+         }
+
+         frame f;
+         switch( frame_decode(data, len, f) ) {
+            case FRAME_OK:
+               break;
+            case FRAME_COBS:
+               ++cobs_errors;
+               return;
+            case FRAME_LENGTH:
+               ++length_errors;
+               return;
+            case FRAME_CRC:
+               ++crc_errors;
+               return;
+         }
+
+         if( seen[f.type] ) {
+            lost += (uint8_t)(f.seq - last_seq[f.type] - 1);
+         }
+         seen[f.type] = true;
+         last_seq[f.type] = f.seq;
+
+         ++frames;
+         handler(f);
+      }
+};
+
+#endif
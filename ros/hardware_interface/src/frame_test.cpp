@@ -0,0 +1,389 @@
+/* frame_test.cpp
+ *
+ * fuzz test and throughput benchmark for the serial frame parser
+ *
+ * Byte streams are either captured from the serial port (any files given on
+ *  the command line, e.g. from `cat /dev/ttyACM1 > capture.bin`) or
+ *  synthesized from the messages the AVR sends. Each stream is corrupted at
+ *  random (flipped bytes, lost delimiters, long runs of garbage), fed to the
+ *  parser in random-sized reads, and the delivered frames and counters are
+ *  compared against a simple reference splitter. The benchmark compares the
+ *  parser and v2 decoding against the old copy-and-shift loop, on the same
+ *  messages in the old format. Exits non-zero if any stream disagrees.
+ *
+ * Usage: frame_test [-n] [capture ...]
+ *  -n skips the benchmark
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "messages.h"
+#include "frame_parser.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+typedef frame_parser<1024> parser_type;
+
+int failures = 0;
+
+float rand_float() {
+   return rand() / 1000.0;
+}
+
+template<class M> void append(string & out, const M & m, uint8_t seq) {
+   uint8_t buf[wire_size<M>::FRAME];
+   uint8_t n = encode(m, seq, buf);
+   out.append((const char *)buf, n);
+}
+
+// streams of messages like the ones the AVR sends, in both formats
+void synthesize(size_t packets, string & v2, string & v1) {
+   char buf[64];
+   uint8_t seq[5] = { 0, 0, 0, 0, 0 };
+   for( size_t i=0; i<packets; i++ ) {
+      int r = rand() % 10;
+      if( r < 4 ) {
+         odometry_msg m = { (int16_t)rand(), (int16_t)rand(), rand(), -rand(),
+            (int16_t)(rand() % 6284 - 3142), (uint16_t)rand(),
+            (uint8_t)(rand() & 1) };
+         append(v2, m, seq[0]++);
+         // the old message was five floats
+         Packet p('O', sizeof(buf), buf);
+         p.append(m.linear * 0.001f);
+         p.append(m.angular * 0.001f);
+         p.append(m.x * 0.001f);
+         p.append(m.y * 0.001f);
+         p.append(m.yaw * 0.001f);
+         p.append(m.bump);
+         p.finish();
+         v1.append(p.outbuf(), p.outsz());
+      } else if( r < 7 ) {
+         imu_msg m = { rand_float(), rand_float(), rand_float(),
+            (uint16_t)rand() };
+         append(v2, m, seq[1]++);
+         Packet p('U', sizeof(buf), buf);
+         p.append(m.x);
+         p.append(m.y);
+         p.append(m.z);
+         p.append(m.ticks);
+         p.finish();
+         v1.append(p.outbuf(), p.outsz());
+      } else if( r < 8 ) {
+         gps_msg m = { rand(), -rand(), (uint16_t)rand() };
+         append(v2, m, seq[2]++);
+         Packet p('G', sizeof(buf), buf);
+         p.append(m.lat);
+         p.append(m.lon);
+         p.append(m.ticks);
+         p.finish();
+         v1.append(p.outbuf(), p.outsz());
+      } else if( r < 9 ) {
+         sonar_msg m;
+         Packet p('S', sizeof(buf), buf);
+         for( int k=0; k<NUM_SONARS; k++ ) {
+            m.range[k] = rand();
+            p.append(m.range[k]);
+         }
+         m.ticks = rand();
+         p.append(m.ticks);
+         append(v2, m, seq[3]++);
+         p.finish();
+         v1.append(p.outbuf(), p.outsz());
+      } else {
+         idle_msg m = { (uint16_t)rand(), (uint8_t)rand(), (uint8_t)rand(),
+            (uint16_t)rand(), (uint16_t)rand() };
+         append(v2, m, seq[4]++);
+         Packet p('I', sizeof(buf), buf);
+         p.append(m.idle);
+         p.append(m.i2c_fail);
+         p.append(m.i2c_resets);
+         p.append(m.tx_dropped);
+         p.append(m.tx_deferred);
+         p.finish();
+         v1.append(p.outbuf(), p.outsz());
+      }
+   }
+}
+
+// flip bytes, drop delimiters and insert runs of garbage
+string corrupt(const string & in) {
+   string out;
+   out.reserve(in.size() + in.size() / 8);
+   for( size_t i=0; i<in.size(); i++ ) {
+      int r = rand() % 1000;
+      if( r < 5 ) {
+         out += (char)rand();
+      } else if( r < 8 && in[i] == FRAME_DELIMITER ) {
+         // lost delimiter
+      } else if( r < 9 ) {
+         size_t n = rand() % 700;
+         for( size_t k=0; k<n; k++ ) out += (char)(rand() % 255 + 1);
+         out += in[i];
+      } else {
+         out += in[i];
+      }
+   }
+   return out;
+}
+
+struct counts {
+   uint32_t runts;
+   uint32_t overflows;
+   uint32_t errors;
+};
+
+// a delivered frame, flattened for comparison
+string flatten(const frame & f) {
+   string s;
+   s += (char)f.type;
+   s += (char)f.seq;
+   s.append((const char *)f.payload, f.len);
+   return s;
+}
+
+// split on delimiters and decode with the parser's rules
+vector<string> reference(const string & in, counts & c) {
+   vector<string> frames;
+   c.runts = 0;
+   c.overflows = 0;
+   c.errors = 0;
+   size_t start = 0;
+   while( true ) {
+      size_t end = in.find((char)FRAME_DELIMITER, start);
+      if( end == string::npos ) break;
+      size_t len = end - start;
+      if( len > parser_type::MAX_FRAME ) {
+         c.overflows++;
+      } else if( len == 0 ) {
+         c.runts++;
+      } else {
+         uint8_t buf[FRAME_MAX_ENCODED];
+         memcpy(buf, in.data() + start, len);
+         frame f;
+         if( frame_decode(buf, len, f) == FRAME_OK ) {
+            frames.push_back(flatten(f));
+         } else {
+            c.errors++;
+         }
+      }
+      start = end + 1;
+   }
+   // an unterminated tail that is already too long has been dropped
+   if( in.size() - start > parser_type::MAX_FRAME ) c.overflows++;
+   return frames;
+}
+
+struct collector {
+   vector<string> * frames;
+   void operator()(const frame & f) const {
+      frames->push_back(flatten(f));
+   }
+};
+
+// feed in to a parser in reads of at most chunk bytes (random if 0)
+void feed(parser_type & parser, const string & in, unsigned chunk,
+      collector c) {
+   size_t i = 0;
+   while( i < in.size() ) {
+      uint8_t * buf;
+      unsigned space = parser.prepare(&buf);
+      unsigned n = chunk ? chunk : rand() % 300 + 1;
+      if( n > space ) n = space;
+      if( n > in.size() - i ) n = in.size() - i;
+      memcpy(buf, in.data() + i, n);
+      parser.commit(n);
+      parser.parse(c);
+      i += n;
+   }
+}
+
+void check(const char * name, const string & in, unsigned chunk,
+      bool clean) {
+   counts expect;
+   vector<string> want = reference(in, expect);
+   vector<string> got;
+   collector c = { &got };
+   parser_type * parser = new parser_type();
+   feed(*parser, in, chunk, c);
+
+   uint32_t errors = parser->cobs_errors + parser->length_errors +
+      parser->crc_errors;
+   bool ok = got == want && parser->runts == expect.runts &&
+      parser->overflows == expect.overflows && errors == expect.errors &&
+      parser->frames == want.size() && parser->bytes == in.size();
+   // nothing is lost from an uncorrupted stream
+   if( clean ) ok = ok && errors == 0 && parser->lost == 0;
+   if( !ok ) {
+      printf("FAIL %s: %zu frames (want %zu), %u runts (want %u), "
+            "%u overflows (want %u), %u errors (want %u), %u lost\n", name,
+            got.size(), want.size(), parser->runts, expect.runts,
+            parser->overflows, expect.overflows, errors, expect.errors,
+            parser->lost);
+      ++failures;
+   }
+   delete parser;
+}
+
+// the loop the parser replaced
+struct shift_parser {
+   unsigned char in_buffer[1024];
+   int in_cnt;
+   uint32_t frames;
+
+   shift_parser() : in_cnt(0), frames(0) {}
+
+   void feed(const char * data, int cnt) {
+      memcpy(in_buffer + in_cnt, data, cnt);
+      in_buffer[cnt + in_cnt] = 0;
+      in_cnt += cnt;
+      int start = 0;
+      int i = 0;
+      while( i < in_cnt ) {
+         for( ; i < in_cnt && in_buffer[i] != '\r' ; i++);
+         if( i < in_cnt && in_buffer[i] == '\r' ) {
+            if( i - start > 1 ) {
+               Packet p((char*)(in_buffer+start), i-start);
+               // read the fields, as the handlers did
+               if( in_buffer[start] == 'O' ) {
+                  for( int k=0; k<5; k++ ) p.readfloat();
+               }
+               frames++;
+            }
+            start = i+1;
+         }
+         i++;
+      }
+      for( i=start; i<in_cnt; i++ ) {
+         in_buffer[i-start] = in_buffer[i];
+      }
+      in_cnt -= start;
+   }
+};
+
+struct counter {
+   uint32_t * n;
+   void operator()(const frame & f) const {
+      // decode, as the handlers do
+      if( f.type == 'O' ) {
+         odometry_msg m;
+         decode(f, m);
+      }
+      ++*n;
+   }
+};
+
+void benchmark(const string & v2, const string & v1, unsigned chunk) {
+   const int reps = 20;
+
+   double start = monotonic();
+   uint32_t frames = 0;
+   parser_type * parser = new parser_type();
+   for( int r=0; r<reps; r++ ) {
+      size_t i = 0;
+      while( i < v2.size() ) {
+         uint8_t * buf;
+         unsigned n = parser->prepare(&buf);
+         if( n > chunk ) n = chunk;
+         if( n > v2.size() - i ) n = v2.size() - i;
+         memcpy(buf, v2.data() + i, n);
+         parser->commit(n);
+         counter c = { &frames };
+         parser->parse(c);
+         i += n;
+      }
+   }
+   double ring = monotonic() - start;
+   delete parser;
+
+   start = monotonic();
+   shift_parser * old = new shift_parser();
+   for( int r=0; r<reps; r++ ) {
+      size_t i = 0;
+      while( i < v1.size() ) {
+         // the old loop never read more than its free space
+         size_t n = 1023 - old->in_cnt;
+         if( n > chunk ) n = chunk;
+         if( n > v1.size() - i ) n = v1.size() - i;
+         old->feed(v1.data() + i, n);
+         i += n;
+      }
+   }
+   double shift = monotonic() - start;
+
+   printf("%4u byte reads: ring+v2 %7.1f MB/s %6.2f Mframes/s, "
+         "shift+v1 %7.1f MB/s %6.2f Mframes/s\n", chunk,
+         v2.size() * reps / 1e6 / ring, frames / ring / 1e6,
+         v1.size() * reps / 1e6 / shift, old->frames / shift / 1e6);
+   delete old;
+}
+
+bool read_file(const char * name, string & out) {
+   FILE * f = fopen(name, "rb");
+   if( !f ) return false;
+   char buf[4096];
+   size_t n;
+   while( (n = fread(buf, 1, sizeof(buf), f)) > 0 ) out.append(buf, n);
+   fclose(f);
+   return true;
+}
+
+int main(int argc, char ** argv) {
+   bool bench = true;
+   vector<string> streams;
+   vector<string> names;
+   for( int i=1; i<argc; i++ ) {
+      if( string(argv[i]) == "-n" ) {
+         bench = false;
+      } else {
+         string s;
+         if( !read_file(argv[i], s) ) {
+            printf("Failed to read %s\n", argv[i]);
+            return 1;
+         }
+         streams.push_back(s);
+         names.push_back(argv[i]);
+      }
+   }
+   srand(1);
+   bool synthetic = streams.empty();
+   if( synthetic ) {
+      string v1;
+      streams.push_back("");
+      synthesize(20000, streams.back(), v1);
+      names.push_back("synthetic");
+   }
+
+   for( size_t s=0; s<streams.size(); s++ ) {
+      const char * name = names[s].c_str();
+      check(name, streams[s], 1, synthetic);
+      check(name, streams[s], 1024, synthetic);
+      check(name, streams[s], 0, synthetic);
+      const int iterations = 200;
+      for( int i=0; i<iterations; i++ ) {
+         check(name, corrupt(streams[s]), 0, false);
+      }
+      printf("%s: %zu bytes, %d corrupted variants\n", name,
+            streams[s].size(), iterations);
+   }
+
+   if( bench ) {
+      string v2, v1;
+      synthesize(200000, v2, v1);
+      static const unsigned chunks[] = { 16, 64, 256, 1024 };
+      for( int i=0; i<4; i++ ) benchmark(v2, v1, chunks[i]);
+   }
+
+   if( failures ) {
+      printf("%d failures\n", failures);
+      return 1;
+   }
+   return 0;
+}
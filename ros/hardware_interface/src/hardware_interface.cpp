@@ -1,6 +1,16 @@
 /* a ROS node to act as a bridge between the serial port to the robot hardware
  * and all of the internal ROS messages that will be flying around.
  *
+ * The main thread waits in epoll on the serial port, an eventfd that
+ *  cmdCallback signals when a command is ready, and a 0.5 s timerfd for the
+ *  heartbeat and diagnostics. Incoming frames are dispatched as soon as they
+ *  are read and commands are written as soon as they are produced; ROS
+ *  callbacks run on an AsyncSpinner thread.
+ *
+ * Sensor frames are stamped with the AVR's clock when they were sampled.
+ *  The AVR answers each heartbeat with its clock, and clock_sync.h turns
+ *  those round trips into a mapping onto host time.
+ *
  * Author: Austin Hendrix
  */
 
@@ -11,9 +21,16 @@
 #include <termios.h>
 #include <math.h>
 #include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <set>
 
+#include <boost/thread/mutex.hpp>
+
 #include <ros/ros.h>
 #include <sensor_msgs/LaserScan.h>
 #include <sensor_msgs/Range.h>
@@ -27,19 +44,21 @@
 
 #include <diagnostic_updater/diagnostic_updater.h>
 
+#include <hardware_interface/SonarArray.h>
 
-#include "protocol.h"
+#include "messages.h"
 #include "steer.h"
+#include "latency_histogram.h"
+#include "frame_parser.h"
+#include "clock_sync.h"
 
 using namespace std;
 
-char laser_data[512];
-int laser_ready;
-
 // for publishing odometry and compass data
 float heading;
 ros::Publisher odo_pub;
 ros::Publisher sonar_pub;
+ros::Publisher sonar_array_pub;
 ros::Publisher gps_pub;
 ros::Publisher heading_pub;
 ros::Publisher bump_pub;
@@ -48,9 +67,19 @@ ros::Publisher diagnostics_pub;
 
 #define ROS_PERROR(str) ROS_ERROR("%s: %s", str, strerror(errno))
 
+// command handoff from the spinner thread to the I/O loop
+boost::mutex cmd_mutex;
 int cmd_ready = 0;
-char cmd_buf[12];
-Packet cmd_packet('C', 12, cmd_buf);
+uint8_t cmd_buf[wire_size<command_msg>::FRAME];
+uint8_t cmd_sz;
+uint8_t cmd_seq = 0;
+double cmd_time;   // when cmd_buf was produced
+int cmd_event = -1; // eventfd; written when a command is ready
+
+// end-to-end latencies: bytes read to handler done, and cmd_vel received to
+//  bytes written
+latency_histogram rx_latency;
+latency_histogram cmd_latency;
 
 // TODO: subscribe to ackermann_msgs::AckermannDrive too/instead
 void cmdCallback( const geometry_msgs::Twist::ConstPtr & cmd_vel ) {
@@ -84,46 +113,81 @@ void cmdCallback( const geometry_msgs::Twist::ConstPtr & cmd_vel ) {
       }
    }
 
-   cmd_packet.reset();
-   cmd_packet.append(target_speed);
-   cmd_packet.append(steer);
-   cmd_packet.finish();
-   cmd_ready = 1;
+   {
+      boost::mutex::scoped_lock lock(cmd_mutex);
+      command_msg cmd;
+      cmd.speed = target_speed;
+      cmd.steer = steer;
+      cmd_sz = encode(cmd, cmd_seq++, cmd_buf);
+      cmd_ready = 1;
+      cmd_time = monotonic();
+   }
+   uint64_t one = 1;
+   if( write(cmd_event, &one, sizeof(one)) != sizeof(one) ) {
+      ROS_PERROR("Failed to signal command");
+   }
 }
 
-#define handler(foo) void foo(Packet & p)
-typedef void (*handler_ptr)(Packet & p);
+#define handler(foo) void foo(const frame & f)
+typedef void (*handler_ptr)(const frame & f);
 
 handler_ptr handlers[256];
 
-handler(no_handler) {
-   int l = p.outsz();
-   const char * in = p.outbuf();
-   char * buf = (char*)malloc(l + 1);
-   memcpy(buf, in, l);
-   buf[l] = 0;
+double rx_time; // when the bytes being parsed were read
 
-   char * tmpbuf = (char*)malloc(5*l + 1);
-   int i;
-   for( i=0; i<l; i++ ) {
-      sprintf(tmpbuf + (i*5), "0x%02X ", 0xFF & buf[i+1]);
+// the AVR's clock, from heartbeat round trips
+clock_sync avr_clock;
+double heartbeat_sent[256]; // when each heartbeat was sent; 0 once answered
+
+// when an AVR tick stamp was taken; when its frame was read until the
+//  clocks are synchronized
+ros::Time avr_stamp(uint16_t ticks) {
+   double t = rx_time;
+   if( avr_clock.valid() ) {
+      t = avr_clock.host_time(avr_clock.unwrap(ticks, rx_time));
+   }
+   return ros::Time::now() - ros::Duration(monotonic() - t);
+}
+
+// frames of a known type with the wrong payload size
+uint32_t malformed = 0;
+
+// frames of an unknown type; logged at most once a second
+uint32_t unknown = 0;
+uint32_t unknown_quiet = 0; // not logged since the last report
+double unknown_logged = 0;
+
+handler(no_handler) {
+   ++unknown;
+   double now = monotonic();
+   if( now - unknown_logged < 1.0 ) {
+      ++unknown_quiet;
+      return;
    }
-   tmpbuf[i*5] = 0;
+   unknown_logged = now;
 
-   ROS_INFO("No handler for message: %02X(%d) %s", buf[0], l, tmpbuf);
+   // the start of the payload, in hex
+   char hex[3*16 + 4];
+   int l = f.len < 16 ? f.len : 16;
+   for( int i=0; i<l; i++ ) {
+      snprintf(hex + 3*i, 4, "%02X ", f.payload[i]);
+   }
+   strcpy(hex + 3*l, f.len > l ? "..." : "");
 
-   free(buf);
-   free(tmpbuf);
+   ROS_INFO("No handler for message: %02X(%d) %s (%u more since last report)",
+         f.type, f.len, hex, unknown_quiet);
+   unknown_quiet = 0;
 }
 
 handler(shutdown_h) {
-   int l = p.outsz();
-   const char * in = p.outbuf();
+   int l = f.len;
    int shutdown = 1;
-   if( l == 9 ) {
+   if( l == 8 ) {
       for( int i=0; i<l; i++ ) {
-         if( in[i] != 'Z' ) shutdown = 0;
+         if( f.payload[i] != 'Z' ) shutdown = 0;
       }
+   } else {
+      shutdown = 0;
    }
    if( shutdown ) {
       ROS_INFO("Received shutdown");
@@ -131,32 +195,51 @@ handler(shutdown_h) {
          ROS_ERROR("Failed to execute shutdown command");
       }
    } else {
-      char * buf = (char*)malloc(l + 1);
-      memcpy(buf, in, l);
-      buf[l] = 0;
-      ROS_INFO("Malformed shutdown %s", buf);
-      free(buf);
+      ROS_INFO("Malformed shutdown (%d bytes)", l);
+   }
+}
+
+handler(time_h) {
+   time_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
    }
+   double sent = heartbeat_sent[m.heartbeat];
+   heartbeat_sent[m.heartbeat] = 0;
+   // an answer to a heartbeat from long ago; the sequence has wrapped
+   if( sent == 0 || rx_time - sent > 1.0 ) return;
+   avr_clock.add(sent, rx_time, m.ticks);
 }
 
 ros::Time last_gps;
 
 handler(gps_h) {
-   // message format
-   // int32_t lat
-   // int32_t lon
-   int32_t lat = p.reads32();
-   int32_t lon = p.reads32();
-   //ROS_INFO("GPS lat: %d lon: %d", lat, lon);
+   gps_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   //ROS_INFO("GPS lat: %d lon: %d", m.lat, m.lon);
    sensor_msgs::NavSatFix gps;
-   gps.latitude = lat / 1000000.0;
-   gps.longitude = lon / 1000000.0;
+   gps.header.stamp = avr_stamp(m.ticks);
+   gps.latitude = m.lat / 1000000.0;
+   gps.longitude = m.lon / 1000000.0;
    gps_pub.publish(gps);
    last_gps = ros::Time::now();
 }
 
+// outgoing odometry messages; only the data changes from frame to frame
+nav_msgs::Odometry odo_msg;
+geometry_msgs::TransformStamped odo_transform;
+std_msgs::Bool bump_msg;
+
 // set up odometry handling
 void odometry_setup(void) {
+   odo_msg.header.frame_id = "odom";
+   odo_msg.child_frame_id = "base_link";
+   odo_transform.header.frame_id = odo_msg.header.frame_id;
+   odo_transform.child_frame_id = odo_msg.child_frame_id;
 }
 
 // squares per encoder count
@@ -164,39 +247,32 @@ void odometry_setup(void) {
 
 handler(odometry_h) {
    static tf::TransformBroadcaster odom_tf;
-   // message format:
-   // float linear
-   // float angular
-   // float x
-   // float y
-   // float yaw
-   nav_msgs::Odometry odo_msg;
-   odo_msg.header.stamp = ros::Time::now();
-   odo_msg.header.frame_id = "odom";
-   odo_msg.child_frame_id = "base_link";
-   odo_msg.twist.twist.linear.x = p.readfloat();
-   odo_msg.twist.twist.angular.z = p.readfloat();
-   odo_msg.pose.pose.position.x = p.readfloat();
-   odo_msg.pose.pose.position.y = p.readfloat();
-   float yaw = p.readfloat();
-   odo_msg.pose.pose.orientation = tf::createQuaternionMsgFromYaw(yaw);
+   odometry_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   // fixed point (mm, mrad) to SI units
+   odo_msg.header.stamp = avr_stamp(m.ticks);
+   odo_msg.twist.twist.linear.x = m.linear * 0.001;
+   odo_msg.twist.twist.angular.z = m.angular * 0.001;
+   odo_msg.pose.pose.position.x = m.x * 0.001;
+   odo_msg.pose.pose.position.y = m.y * 0.001;
+   odo_msg.pose.pose.orientation =
+      tf::createQuaternionMsgFromYaw(m.yaw * 0.001);
 
    odo_pub.publish(odo_msg);
 
    // tf transform
-   geometry_msgs::TransformStamped transform;
-   transform.header = odo_msg.header;
-   transform.child_frame_id = odo_msg.child_frame_id;
-   transform.transform.translation.x = odo_msg.pose.pose.position.x;
-   transform.transform.translation.y = odo_msg.pose.pose.position.y;
-   transform.transform.translation.z = odo_msg.pose.pose.position.z;
-   transform.transform.rotation = odo_msg.pose.pose.orientation;
-   odom_tf.sendTransform(transform);
-
-   uint8_t b = p.readu8();
-   std_msgs::Bool bump;
-   bump.data = (b != 0);
-   bump_pub.publish(bump);
+   odo_transform.header.stamp = odo_msg.header.stamp;
+   odo_transform.transform.translation.x = odo_msg.pose.pose.position.x;
+   odo_transform.transform.translation.y = odo_msg.pose.pose.position.y;
+   odo_transform.transform.translation.z = odo_msg.pose.pose.position.z;
+   odo_transform.transform.rotation = odo_msg.pose.pose.orientation;
+   odom_tf.sendTransform(odo_transform);
+
+   bump_msg.data = (m.bump != 0);
+   bump_pub.publish(bump_msg);
 }
 
 FILE * battery_log;
@@ -216,56 +292,139 @@ void battery_setup() {
 }
 
 uint16_t idle_cnt;
+// I2C bus resets, and failed transfers and their change over the last idle
+//  message; the AVR's counts wrap at 256
 uint8_t i2c_resets;
+uint8_t i2c_fail;
+uint8_t i2c_fail_rate;
+
+// frames the AVR dropped or deferred on the way to us: running totals, and
+//  the change over the last idle message
+uint16_t tx_dropped;
+uint16_t tx_deferred;
+uint16_t tx_dropped_rate;
+uint16_t tx_deferred_rate;
+bool have_tx_counts = false;
 
 handler(idle_h) {
-   // idle message format:
-   // uint16_t idle
-   // uint8_t i2c_failures
-   // uint8_t i2c_resets
-   idle_cnt = p.readu16();
-   uint8_t i2c_fail = p.readu8();
-   i2c_resets = p.readu8();
+   idle_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   idle_cnt = m.idle;
+   i2c_resets = m.i2c_resets;
+
+   if( have_tx_counts ) {
+      i2c_fail_rate = m.i2c_fail - i2c_fail;
+      tx_dropped_rate = m.tx_dropped - tx_dropped;
+      tx_deferred_rate = m.tx_deferred - tx_deferred;
+   }
+   i2c_fail = m.i2c_fail;
+   tx_dropped = m.tx_dropped;
+   tx_deferred = m.tx_deferred;
+   have_tx_counts = true;
 }
 
-#define NUM_SONARS 5
-handler(sonar_h) {
-   // sonar message format:
-   // uint8_t[5] sonars
-   char sonar_frames[5][8] = { "sonar_1", "sonar_2", "sonar_3", "sonar_4", "sonar_5" };
-   uint8_t s;
-   ros::Time n = ros::Time::now();
-   sensor_msgs::Range sonar;
+// AVR main loop tasks, in the order of task_msg
+const char * task_names[NUM_TASKS] = { "GPS", "Command receive", "IMU",
+   "Sonar", "Status", "Speed control", "Odometry", "I2C" };
+task_msg tasks;
+uint16_t task_overruns[NUM_TASKS]; // over the last report
+bool have_tasks = false;
+
+handler(task_h) {
+   task_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   for( int i=0; i<NUM_TASKS; i++ ) {
+      task_overruns[i] = have_tasks ? m.overruns[i] - tasks.overruns[i] : 0;
+   }
+   tasks = m;
+   have_tasks = true;
+}
+
+// all sonar readings from a frame; also published one at a time on the
+//  sonar topic if sonar_ranges is set
+hardware_interface::SonarArray sonar_array;
+bool sonar_ranges = true;
+
+void sonar_setup() {
+   sonar_array.sonars.resize(NUM_SONARS);
    for( int i=0; i<NUM_SONARS; ++i ) {
-      s = p.readu8();
-      sonar.range = s * 0.0254; // convert inches to m
+      sensor_msgs::Range & sonar = sonar_array.sonars[i];
       sonar.min_range = 6 * 0.0254;
       sonar.max_range = 255 * 0.0254;
       sonar.field_of_view = 45 * M_PI / 180.0; // approx 45-degree FOV
       sonar.radiation_type = sensor_msgs::Range::ULTRASOUND;
 
-      sonar.header.stamp = n;
-      sonar.header.frame_id = sonar_frames[i];
+      char frame_id[16];
+      snprintf(frame_id, sizeof(frame_id), "sonar_%d", i + 1);
+      sonar.header.frame_id = frame_id;
+   }
+}
 
-      sonar_pub.publish(sonar);
+handler(sonar_h) {
+   sonar_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   ros::Time n = avr_stamp(m.ticks);
+   sonar_array.header.stamp = n;
+   for( int i=0; i<NUM_SONARS; ++i ) {
+      sensor_msgs::Range & sonar = sonar_array.sonars[i];
+      sonar.range = m.range[i] * 0.0254; // convert inches to m
+      sonar.header.stamp = n;
+      if( sonar_ranges ) sonar_pub.publish(sonar);
    }
+   sonar_array_pub.publish(sonar_array);
 }
 
 handler(imu_h) {
-   // imu message format:
-   // float[3]
-   float x, y, z;
-   x = p.readfloat();
-   y = p.readfloat();
-   z = p.readfloat();
-   //ROS_INFO("IMU data: (% 03.7f, % 03.7f, % 03.7f)", x, y, z);
-   heading = z;
+   imu_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   //ROS_INFO("IMU data: (% 03.7f, % 03.7f, % 03.7f)", m.x, m.y, m.z);
+   heading = m.z;
    std_msgs::Float32 h;
-   h.data = z;
+   h.data = m.z;
    heading_pub.publish(h);
 
 }
 
+// raw IMU samples, from an AVR built with IMU_RAW; logged for replaying
+//  through the filter (data/ahrs)
+FILE * imu_log;
+bool imu_log_failed;
+handler(imu_raw_h) {
+   imu_raw_msg m;
+   if( !decode(f, m) ) {
+      ++malformed;
+      return;
+   }
+   if( imu_log_failed ) return;
+   if( imu_log == NULL ) {
+      char logfile[1024];
+      char date[256];
+      time_t now = time(0);
+      strftime(date, 256, "%F-%T", localtime(&now));
+      snprintf(logfile, 1024, "/home/hendrix/log/imu-%s.log", date);
+      imu_log = fopen(logfile, "w");
+      if( imu_log == NULL ) {
+         ROS_PERROR("Failed to open logfile");
+         imu_log_failed = true;
+         return;
+      }
+   }
+   fprintf(imu_log, "%u %d %d %d %d %d %d %d %d %d %d\n", m.ticks,
+         m.ax, m.ay, m.az, m.gx, m.gy, m.gz, m.mx, m.my, m.mz, m.speed);
+}
+
 int bandwidth = 0;
 
 void idle_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
@@ -283,7 +442,39 @@ void idle_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
       stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
             "OK: AVR load normal");
    }
-   stat.addf("Idle Count", "%d", idle_cnt);
+   stat.addf("Idle", "%.1f%%", idle_cnt / 10.0);
+}
+
+void task_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
+   int overruns = 0;
+   for( int i=0; i<NUM_TASKS; i++ ) overruns += task_overruns[i];
+   if( !have_tasks ) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+            "Warning: No AVR task timing");
+   } else if( tasks.tick_isr >= 1000 ) {
+      // the tick interrupt ran into the next tick (the AVR sends 0xFFFF);
+      //  wheel sensor edges may have been missed
+      stat.summary(diagnostic_msgs::DiagnosticStatus::ERROR,
+            "Error: AVR tick interrupt overran a tick");
+   } else if( overruns > 0 ) {
+      stat.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+            "Warning: %d AVR task deadlines missed", overruns);
+   } else {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+            "OK: AVR tasks on time");
+   }
+   if( tasks.tick_isr >= 1000 ) {
+      stat.add("Tick interrupt longest", "over 1000 us");
+   } else {
+      stat.addf("Tick interrupt longest", "%d us", tasks.tick_isr);
+   }
+   for( int i=0; i<NUM_TASKS; i++ ) {
+      char name[48];
+      snprintf(name, sizeof(name), "%s longest run", task_names[i]);
+      stat.addf(name, "%d us", tasks.wcet[i]);
+      snprintf(name, sizeof(name), "%s overruns", task_names[i]);
+      stat.addf(name, "%d", task_overruns[i]);
+   }
 }
 
 void bandwidth_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
@@ -293,7 +484,8 @@ void bandwidth_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
    } else if( bandwidth < 400 ) {
       stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
             "Warning: Low AVR bandwidth");
-   } else if( bandwidth > 1000 ) {
+   } else if( bandwidth > 4000 ) {
+      // about 1700 bytes/sec with 50Hz odometry; a third of the link
       stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
             "Warning: High AVR bandwidth");
    } else {
@@ -303,6 +495,20 @@ void bandwidth_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
    stat.addf("Bandwidth", "%d bytes/sec", bandwidth);
 }
 
+void avr_tx_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
+   if( tx_dropped_rate == 0 ) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+            "OK: No frames dropped");
+   } else {
+      stat.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+            "Warning: AVR dropping %d frames/sec", tx_dropped_rate);
+   }
+   stat.addf("Dropped", "%d/sec", tx_dropped_rate);
+   stat.addf("Deferred for odometry", "%d/sec", tx_deferred_rate);
+   stat.addf("Dropped total", "%d", tx_dropped);
+   stat.addf("Deferred total", "%d", tx_deferred);
+}
+
 void i2c_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
    if( i2c_resets == 0 ) {
       stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
@@ -314,6 +520,8 @@ void i2c_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
       stat.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
             "Error: %d I2C resets", i2c_resets);
    }
+   stat.addf("Bus resets", "%d", i2c_resets);
+   stat.addf("Failed transfers", "%d/sec", i2c_fail_rate);
 }
 
 void gps_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
@@ -327,22 +535,130 @@ void gps_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
    }
 }
 
-#define IN_BUFSZ 1024
+void add_latency(diagnostic_updater::DiagnosticStatusWrapper & stat,
+      const char * name, const latency_histogram & h) {
+   stat.addf(name, "p50 %.3f ms, p99 %.3f ms, max %.3f ms, n %u",
+         h.percentile(0.5) * 1000, h.percentile(0.99) * 1000,
+         h.max() * 1000, h.count());
+}
 
-int main(int argc, char ** argv) {
-   unsigned char in_buffer[IN_BUFSZ];
-   int in_cnt = 0;
-   int cnt = 0;
-   int i;
+// CPU time spent in each frame type's handler
+latency_histogram handler_cpu[256];
+
+void latency_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
+   double rx = rx_latency.percentile(0.99);
+   double cmd;
+   {
+      boost::mutex::scoped_lock lock(cmd_mutex);
+      cmd = cmd_latency.percentile(0.99);
+      add_latency(stat, "Command to write", cmd_latency);
+      cmd_latency.clear();
+   }
+   add_latency(stat, "Receive to publish", rx_latency);
+   rx_latency.clear();
+   for( int i=0; i<256; i++ ) {
+      if( handler_cpu[i].count() == 0 ) continue;
+      char name[32];
+      snprintf(name, sizeof(name), "Handler CPU '%c'",
+            isprint(i) ? i : '?');
+      add_latency(stat, name, handler_cpu[i]);
+      handler_cpu[i].clear();
+   }
+   if( rx > 0.01 || cmd > 0.01 ) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+            "Warning: Serial latency high");
+   } else {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+            "OK: Serial latency normal");
+   }
+}
 
-   char heartbeat_buf[8];
-   Packet heartbeat_packet('H', 8, heartbeat_buf);
+// write the pending command, if there is one
+void send_command(int serial) {
+   boost::mutex::scoped_lock lock(cmd_mutex);
+   if( !cmd_ready ) return;
+   int cnt = write(serial, cmd_buf, cmd_sz);
+   if( cnt != cmd_sz ) {
+      ROS_ERROR("Failed to send cmd_vel data");
+   }
+   cmd_latency.add(monotonic() - cmd_time);
+   cmd_ready = 0;
+}
+
+frame_parser<1024> parser;
+
+// call the handler for a received frame
+void dispatch(const frame & f) {
+   double cpu = thread_cpu();
+   handlers[f.type](f);
+   handler_cpu[f.type].add(thread_cpu() - cpu);
+   rx_latency.add(monotonic() - rx_time);
+}
 
-   laser_ready = 0;
+void clock_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
+   if( avr_clock.valid() ) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+            "OK: AVR clock synchronized");
+   } else {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+            "Warning: AVR clock not synchronized; stamping on receipt");
+   }
+   stat.addf("Offset", "%.6f s", avr_clock.current_offset());
+   stat.addf("Skew", "%.1f ppm", avr_clock.current_skew() * 1e6);
+   stat.addf("Best round trip", "%.3f ms", avr_clock.current_rtt() * 1000);
+   stat.addf("Samples", "%u", avr_clock.samples());
+   stat.addf("Resets", "%u", avr_clock.resets);
+}
 
-   for( i=0; i<512; i++ ) {
-      laser_data[i] = 64;
+void framing_diagnostics(diagnostic_updater::DiagnosticStatusWrapper & stat) {
+   static uint32_t last_errors = 0;
+   uint32_t errors = parser.overflows + parser.cobs_errors +
+      parser.length_errors + parser.crc_errors + malformed;
+   if( errors != last_errors ) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+            "Warning: Corrupt serial frames");
+   } else {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+            "OK: Serial framing normal");
    }
+   last_errors = errors;
+   stat.addf("Frames", "%u", parser.frames);
+   stat.addf("Lost frames", "%u", parser.lost);
+   stat.addf("CRC errors", "%u", parser.crc_errors);
+   stat.addf("COBS errors", "%u", parser.cobs_errors);
+   stat.addf("Length errors", "%u", parser.length_errors);
+   stat.addf("Malformed messages", "%u", malformed);
+   stat.addf("Unknown messages", "%u", unknown);
+   stat.addf("Wrapped frames", "%u", parser.wrapped);
+   stat.addf("Empty frames", "%u", parser.runts);
+   stat.addf("Oversize frames", "%u", parser.overflows);
+   stat.addf("Dropped bytes", "%u", parser.dropped);
+}
+
+// termios constant for a baud rate; B0 if it isn't supported
+speed_t baud_constant(int baud) {
+   switch( baud ) {
+      case 9600: return B9600;
+      case 19200: return B19200;
+      case 38400: return B38400;
+      case 57600: return B57600;
+      case 115200: return B115200;
+      case 230400: return B230400;
+      case 460800: return B460800;
+      case 500000: return B500000;
+      case 576000: return B576000;
+      case 921600: return B921600;
+      case 1000000: return B1000000;
+      default: return B0;
+   }
+}
+
+int main(int argc, char ** argv) {
+   int cnt = 0;
+   int i;
+
+   uint8_t heartbeat_buf[wire_size<heartbeat_msg>::FRAME];
+   uint8_t heartbeat_seq = 0;
 
    // Set up message handler array
    for( i=0; i<256; i++ ) {
@@ -355,19 +671,37 @@ int main(int argc, char ** argv) {
 
    //gps_setup();
    handlers['G'] = gps_h;
+   sonar_setup();
    handlers['S'] = sonar_h;
    handlers['U'] = imu_h;
+   handlers['R'] = imu_raw_h;
+   handlers['T'] = time_h;
+   handlers['K'] = task_h;
 
    ros::init(argc, argv, "hardware_interface");
 
    ros::NodeHandle n;
+   ros::NodeHandle pn("~");
+
+   // the AVR by default; avr_sim prints the pty to use instead
+   string port = "/dev/ttyACM1";
+   int baud = 115200;
+   double boot_delay = 2.0;
+   pn.param("port", port, port);
+   pn.param("baud", baud, baud);
+   pn.param("boot_delay", boot_delay, boot_delay);
+   pn.param("sonar_ranges", sonar_ranges, sonar_ranges);
+
+   speed_t speed = baud_constant(baud);
+   if( speed == B0 ) {
+      ROS_ERROR("Unsupported baud rate %d", baud);
+      return -1;
+   }
 
-   // I'm going to hardcode the port and settings because this is hardware-
-   // specific anyway
    // open serial port
-   int serial = open("/dev/ttyACM1", O_RDWR | O_NOCTTY);
+   int serial = open(port.c_str(), O_RDWR | O_NOCTTY);
    if( serial < 0 ) {
-      perror("Failed to open /dev/ttyACM1");
+      ROS_ERROR("Failed to open %s: %s", port.c_str(), strerror(errno));
       // die. ungracefully.
       return -1;
    }
@@ -383,19 +717,51 @@ int main(int argc, char ** argv) {
    // no input options, just normal input
    tio.c_iflag = 0;
 
+   // raw output; newline translation would corrupt outgoing frames
+   tio.c_oflag = 0;
+
    // set baud rate
-   cfsetospeed(&tio, B115200);
-   cfsetispeed(&tio, B115200);
+   cfsetospeed(&tio, speed);
+   cfsetispeed(&tio, speed);
    
    tcsetattr(serial, TCSANOW, &tio);
 
-   sleep(2); // sleep for two seconds while bootloader runs
+   // wait while the bootloader runs
+   usleep(boot_delay * 1000000);
+
+   cmd_event = eventfd(0, EFD_NONBLOCK);
+   int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+   int ep = epoll_create(3);
+   if( cmd_event < 0 || timer < 0 || ep < 0 ) {
+      ROS_PERROR("Failed to set up event loop");
+      return -1;
+   }
+
+   // heartbeat and bandwidth measurement every 0.5 sec
+   struct itimerspec period;
+   period.it_interval.tv_sec = 0;
+   period.it_interval.tv_nsec = 500000000;
+   period.it_value = period.it_interval;
+   timerfd_settime(timer, 0, &period, 0);
+
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.fd = serial;
+   epoll_ctl(ep, EPOLL_CTL_ADD, serial, &ev);
+   ev.data.fd = cmd_event;
+   epoll_ctl(ep, EPOLL_CTL_ADD, cmd_event, &ev);
+   ev.data.fd = timer;
+   epoll_ctl(ep, EPOLL_CTL_ADD, timer, &ev);
 
    ros::Subscriber cmd_sub = n.subscribe("cmd_vel", 1, cmdCallback);
 
    odo_pub = n.advertise<nav_msgs::Odometry>("odom", 10);
    //goalList_pub = n.advertise<goal_list::GoalList>("goal_list", 2);
-   sonar_pub = n.advertise<sensor_msgs::Range>("sonar", 10);
+   if( sonar_ranges ) {
+      sonar_pub = n.advertise<sensor_msgs::Range>("sonar", 10);
+   }
+   sonar_array_pub = n.advertise<hardware_interface::SonarArray>(
+         "sonar_array", 10);
    gps_pub = n.advertise<sensor_msgs::NavSatFix>("gps", 10);
    heading_pub = n.advertise<std_msgs::Float32>("heading", 10);
    bump_pub = n.advertise<std_msgs::Bool>("bump", 10);
@@ -403,83 +769,80 @@ int main(int argc, char ** argv) {
    diagnostic_updater::Updater updater;
    updater.setHardwareID("Dagny");
    updater.add("AVR Load", idle_diagnostics);
+   updater.add("AVR Tasks", task_diagnostics);
    updater.add("AVR Bandwidth", bandwidth_diagnostics);
    updater.add("I2C Status", i2c_diagnostics);
+   updater.add("AVR Transmit", avr_tx_diagnostics);
    updater.add("GPS Status", gps_diagnostics);
+   updater.add("Serial Latency", latency_diagnostics);
+   updater.add("Serial Framing", framing_diagnostics);
+   updater.add("AVR Clock", clock_diagnostics);
 
-   ROS_INFO("hardware_interface ready");
+   ros::AsyncSpinner spinner(1);
+   spinner.start();
 
-   ros::Rate loop_rate(20);
+   ROS_INFO("hardware_interface ready");
 
-   int itr = 0;
    int bw = 0;
-
-   while( ros::ok() ) {
-      cnt = read(serial, in_buffer + in_cnt, IN_BUFSZ - in_cnt - 1); 
-      if( cnt > 0 ) {
-         // append a null byte
-         in_buffer[cnt + in_cnt] = 0;
-         in_cnt += cnt;
-         // parse out newline-terminated strings and call appropriate functions
-         int start = 0;
-         int i = 0;
-         while( i < in_cnt ) {
-            for( ; i < in_cnt && in_buffer[i] != '\r' ; i++);
-
-            if( i < in_cnt && in_buffer[i] == '\r' ) {
-               // check that our string isn't just the terminating character
-               if( i - start > 1 ) {
-                  // we got a string. call the appropriate function
-                  Packet p((char*)(in_buffer+start), i-start);
-                  handlers[in_buffer[start]](p);
-               }
-               start = i+1;
-            }
-            i++;
-         }
-
-         // shift remaining data to front of buffer
-         for( i=start; i<in_cnt; i++ ) {
-            in_buffer[i-start] = in_buffer[i];
-         }
-
-         in_cnt -= start;
+   struct epoll_event events[3];
+   int ret = 0;
+
+   while( ros::ok() && ret == 0 ) {
+      // wake at least every 100ms to notice shutdown
+      int nev = epoll_wait(ep, events, 3, 100);
+      if( nev < 0 && errno != EINTR ) {
+         ROS_PERROR("epoll_wait failed");
+         ret = -1;
+         break;
       }
-      bw += cnt;
-      
-      ros::spinOnce();
-
-      if( laser_ready ) {
-         cnt = write(serial, "L", 1);
-         cnt = write(serial, laser_data, 512);
-         cnt = write(serial, "\r\r\r\r\r\r\r\r", 1);
-         laser_ready = 0;
-      }
-
-      if( cmd_ready ) {
-         cnt = write(serial, cmd_packet.outbuf(), cmd_packet.outsz());
-         //ROS_INFO("cmd_vel sent");
-         if( cnt != cmd_packet.outsz() ) {
-            ROS_ERROR("Failed to send cmd_vel data");
+      for( int e=0; e<nev; e++ ) {
+         int fd = events[e].data.fd;
+         uint64_t ticks;
+         if( fd == serial ) {
+            uint8_t * buf;
+            unsigned space = parser.prepare(&buf);
+            cnt = read(serial, buf, space);
+            if( cnt > 0 ) {
+               rx_time = monotonic();
+               parser.commit(cnt);
+               parser.parse(dispatch);
+               bw += cnt;
+               continue;
+            }
+            if( cnt < 0 && (errno == EAGAIN || errno == EINTR) &&
+                  !(events[e].events & (EPOLLERR | EPOLLHUP)) ) continue;
+            /* the port stays readable once the AVR is unplugged or the pty
+             *  is closed; give up rather than spin on it */
+            if( cnt < 0 ) {
+               ROS_ERROR("Lost %s: %s", port.c_str(), strerror(errno));
+            } else {
+               ROS_ERROR("Lost %s: hung up", port.c_str());
+            }
+            ret = -1;
+            break;
+         } else if( fd == cmd_event ) {
+            if( read(cmd_event, &ticks, sizeof(ticks)) < 0 ) continue;
+
+            send_command(serial);
+         } else if( fd == timer ) {
+            if( read(timer, &ticks, sizeof(ticks)) < 0 ) continue;
+
+            heartbeat_msg heartbeat;
+            heartbeat_sent[heartbeat_seq] = monotonic();
+            uint8_t sz = encode(heartbeat, heartbeat_seq++, heartbeat_buf);
+            cnt = write(serial, heartbeat_buf, sz);
+            bandwidth = bw * 2;
+            bw = 0;
+
+            updater.update();
          }
-         cmd_ready = 0;
-      }
-
-      // send heartbeat
-      ++itr;
-
-      // heartbeat and bandwidth measurement every 0.5 sec
-      if( itr == 9 ) {
-         heartbeat_packet.reset();
-         heartbeat_packet.finish();
-         cnt =write(serial,heartbeat_packet.outbuf(),heartbeat_packet.outsz());
-         itr = 0;
-         bandwidth = bw * 2;
-         bw = 0;
       }
-
-      updater.update();
-
-      loop_rate.sleep();
    }
+
+   spinner.stop();
+   close(ep);
+   close(timer);
+   close(cmd_event);
+   close(serial);
+   return ret;
 }
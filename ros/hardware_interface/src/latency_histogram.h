@@ -0,0 +1,85 @@
+/* latency_histogram.h
+ *
+ * Log-scale latency histogram. Bucket k counts latencies below 2^k
+ *  microseconds (and at least 2^(k-1)), so 24 buckets cover 1 us to 8 s with
+ *  a constant-time add() and no allocation. Percentiles are reported as the
+ *  upper edge of the bucket they fall in.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+
+// monotonic clock, in seconds
+inline double monotonic() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// CPU time used by the calling thread, in seconds
+inline double thread_cpu() {
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+class latency_histogram {
+   public:
+      static const int BUCKETS = 24;
+
+      latency_histogram() {
+         clear();
+      }
+
+      void clear() {
+         for( int k=0; k<BUCKETS; k++ ) bucket[k] = 0;
+         n = 0;
+         sum = 0;
+         worst = 0;
+      }
+
+      // record a latency (s)
+      void add(double t) {
+         if( t < 0 ) t = 0;
+         uint32_t us = t < 8.0 ? (uint32_t)(t * 1e6) : 8000000;
+         int k = 0;
+         while( us && k < BUCKETS - 1 ) {
+            us >>= 1;
+            k++;
+         }
+         bucket[k]++;
+         n++;
+         sum += t;
+         if( t > worst ) worst = t;
+      }
+
+      uint32_t count() const { return n; }
+      double mean() const { return n ? sum / n : 0; }
+      double max() const { return worst; }
+
+      // upper bound on the p'th fraction of latencies (s)
+      double percentile(double p) const {
+         if( n == 0 ) return 0;
+         uint32_t target = (uint32_t)(p * n);
+         if( target >= n ) target = n - 1;
+         uint32_t c = 0;
+         for( int k=0; k<BUCKETS; k++ ) {
+            c += bucket[k];
+            if( c > target ) return (1 << k) * 1e-6;
+         }
+         return worst;
+      }
+
+   private:
+      uint32_t bucket[BUCKETS];
+      uint32_t n;
+      double sum;
+      double worst;
+};
+
+#endif
@@ -0,0 +1 @@
+../../../protocol/message.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../protocol/messages.h
\ No newline at end of file
@@ -0,0 +1,296 @@
+/* wire_test.cpp
+ *
+ * tests for the v2 wire format, and a comparison against the old one
+ *
+ * Checks the CRC against its published check value and round-trips frames
+ *  of every length. Then, for the packets the AVR sends, reports bytes on
+ *  the wire in each format, and corrupts encoded frames under a few error
+ *  models to count how often each format delivers a wrong frame without
+ *  noticing. For the old format that is reported twice: as the handlers use
+ *  it today (anything terminated is accepted), and as if they checked the
+ *  length. Exits non-zero if a check fails or v2 misses more than 0.01% of
+ *  any kind of error.
+ *
+ * Usage: wire_test [trials]
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "frame.h"
+
+using namespace std;
+
+typedef vector<uint8_t> bytes;
+
+int failures = 0;
+
+void check(const char * name, bool ok) {
+   if( !ok ) {
+      printf("FAIL %s\n", name);
+      ++failures;
+   }
+}
+
+// the body of an old-format packet, without escapes
+bytes unescape(const char * in, size_t n) {
+   bytes out;
+   for( size_t i=0; i<n; i++ ) {
+      if( in[i] == 0x1B && i + 1 < n ) {
+         out.push_back(in[++i] ^ 0x1B);
+      } else {
+         out.push_back(in[i]);
+      }
+   }
+   return out;
+}
+
+float rand_float(float scale) {
+   return (rand() / (float)RAND_MAX - 0.5) * 2 * scale;
+}
+
+// a message the AVR sends, in both formats
+struct message {
+   char type;
+   bytes v1;      // type, escaped payload, '\r'
+   bytes payload; // raw payload
+};
+
+message make_message(int kind) {
+   static const char types[] = { 'O', 'U', 'G', 'S', 'I' };
+   char buf[128];
+   Packet p(types[kind], sizeof(buf), buf);
+   switch( kind ) {
+      case 0:
+         p.append((int16_t)rand_float(2000));
+         p.append((int16_t)rand_float(1000));
+         p.append((int32_t)rand_float(500000));
+         p.append((int32_t)rand_float(500000));
+         p.append((int16_t)rand_float(3142));
+         p.append((uint16_t)rand());
+         p.append((uint8_t)(rand() & 1));
+         break;
+      case 1:
+         for( int k=0; k<3; k++ ) p.append(rand_float(3.14));
+         p.append((uint16_t)rand());
+         break;
+      case 2:
+         p.append((int32_t)(35000000 + rand() % 1000000));
+         p.append((int32_t)(-120000000 + rand() % 1000000));
+         p.append((uint16_t)rand());
+         break;
+      case 3:
+         for( int k=0; k<5; k++ ) p.append((uint8_t)rand());
+         p.append((uint16_t)rand());
+         break;
+      case 4:
+         p.append((uint16_t)rand());
+         p.append((uint8_t)(rand() % 4));
+         p.append((uint8_t)(rand() % 4));
+         p.append((uint16_t)rand());
+         p.append((uint16_t)rand());
+         break;
+   }
+   p.finish();
+   message m;
+   m.type = types[kind];
+   m.v1.assign(p.outbuf(), p.outbuf() + p.outsz());
+   m.payload = unescape(p.outbuf() + 1, p.outsz() - 2);
+   return m;
+}
+
+bytes encode_v2(const message & m, uint8_t seq) {
+   uint8_t out[FRAME_MAX_ENCODED];
+   uint8_t n = frame_encode(m.type, seq, &m.payload[0], m.payload.size(), out);
+   return bytes(out, out + n);
+}
+
+void test_codec() {
+   const char * check_str = "123456789";
+   check("crc16 check value",
+         crc16((const uint8_t *)check_str, 9) == 0x29B1);
+
+   uint8_t payload[FRAME_MAX_PAYLOAD + 1];
+   uint8_t out[FRAME_MAX_ENCODED + 8];
+   for( int fill=0; fill<3; fill++ ) {
+      for( int len=0; len<=FRAME_MAX_PAYLOAD; len++ ) {
+         for( int i=0; i<len; i++ ) {
+            payload[i] = fill == 0 ? 0 : fill == 1 ? 0xFF : rand();
+         }
+         uint8_t n = frame_encode('T', len, payload, len, out);
+         bool ok = n == len + FRAME_OVERHEAD && out[n - 1] == 0;
+         for( int i=0; i<n-1; i++ ) ok = ok && out[i] != 0;
+         frame f;
+         ok = ok && frame_decode(out, n - 1, f) == FRAME_OK;
+         ok = ok && f.type == 'T' && f.seq == len && f.len == len &&
+            memcmp(f.payload, payload, len) == 0;
+         if( !ok ) {
+            printf("FAIL round trip, length %d fill %d\n", len, fill);
+            ++failures;
+         }
+      }
+   }
+   check("oversize payload rejected",
+         frame_encode('T', 0, payload, FRAME_MAX_PAYLOAD + 1, out) == 0);
+}
+
+void report_overhead() {
+   static const char * names[] = { "odometry", "imu", "gps", "sonar", "idle" };
+   printf("bytes on the wire     payload  v1 mean  v1 max  v2\n");
+   for( int kind=0; kind<5; kind++ ) {
+      const int samples = 10000;
+      size_t sum = 0, max = 0, v2 = 0, payload = 0;
+      for( int i=0; i<samples; i++ ) {
+         message m = make_message(kind);
+         sum += m.v1.size();
+         if( m.v1.size() > max ) max = m.v1.size();
+         v2 = encode_v2(m, i).size();
+         payload = m.payload.size();
+      }
+      printf("%-20s %8zu %8.2f %7zu %3zu\n", names[kind], payload,
+            sum / (double)samples, max, v2);
+   }
+}
+
+// error models
+void flip_bits(bytes & b, int n) {
+   for( int i=0; i<n; i++ ) {
+      size_t bit = rand() % (b.size() * 8);
+      b[bit / 8] ^= 1 << (bit % 8);
+   }
+}
+
+void burst(bytes & b, int bits) {
+   size_t start = rand() % (b.size() * 8);
+   for( int i=0; i<bits && start + i < b.size() * 8; i++ ) {
+      // the ends of a burst are always wrong; the middle is random
+      if( i == 0 || i == bits - 1 || rand() & 1 ) {
+         size_t bit = start + i;
+         b[bit / 8] ^= 1 << (bit % 8);
+      }
+   }
+}
+
+void substitute(bytes & b) {
+   size_t i = rand() % b.size();
+   uint8_t old = b[i];
+   while( b[i] == old ) b[i] = rand();
+}
+
+void corrupt(bytes & b, int model) {
+   switch( model ) {
+      case 0: flip_bits(b, 1); break;
+      case 1: flip_bits(b, 2); break;
+      case 2: flip_bits(b, 3); break;
+      case 3: burst(b, 16); break;
+      case 4: burst(b, 32); break;
+      case 5: substitute(b); break;
+   }
+}
+
+// split a received stream on a delimiter
+vector<bytes> split(const bytes & in, uint8_t delim) {
+   vector<bytes> out;
+   bytes cur;
+   for( size_t i=0; i<in.size(); i++ ) {
+      if( in[i] == delim ) {
+         out.push_back(cur);
+         cur.clear();
+      } else {
+         cur.push_back(in[i]);
+      }
+   }
+   return out;
+}
+
+struct outcome {
+   uint32_t accepted; // corrupt frames delivered as-is
+   uint32_t length;   // corrupt frames delivered even with a length check
+};
+
+void receive_v1(const message & m, const bytes & wire, outcome & o) {
+   vector<bytes> frames = split(wire, '\r');
+   bool accepted = false, length = false;
+   for( size_t i=0; i<frames.size(); i++ ) {
+      const bytes & f = frames[i];
+      if( f.size() < 2 ) continue;
+      bytes body = unescape((const char *)&f[1], f.size() - 1);
+      if( f[0] == m.v1[0] && body == m.payload ) continue;
+      accepted = true;
+      if( body.size() == m.payload.size() ) length = true;
+   }
+   o.accepted += accepted;
+   o.length += length;
+}
+
+void receive_v2(const message & m, uint8_t seq, const bytes & wire,
+      outcome & o) {
+   vector<bytes> frames = split(wire, FRAME_DELIMITER);
+   bool accepted = false;
+   for( size_t i=0; i<frames.size(); i++ ) {
+      bytes & b = frames[i];
+      if( b.empty() ) continue;
+      frame f;
+      if( frame_decode(&b[0], b.size(), f) != FRAME_OK ) continue;
+      if( f.type == m.type && f.seq == seq && f.len == m.payload.size() &&
+            memcmp(f.payload, &m.payload[0], f.len) == 0 ) continue;
+      accepted = true;
+   }
+   o.accepted += accepted;
+   o.length += accepted;
+}
+
+void report_errors(int trials) {
+   static const char * names[] = { "1 bit", "2 bits", "3 bits",
+      "16-bit burst", "32-bit burst", "byte" };
+   printf("\nundetected errors     v1 as used  v1 + length       v2\n");
+   for( int model=0; model<6; model++ ) {
+      outcome v1 = { 0, 0 }, v2 = { 0, 0 };
+      for( int i=0; i<trials; i++ ) {
+         message m = make_message(rand() % 5);
+         uint8_t seq = rand();
+
+         // frames arrive after the previous frame's terminator
+         bytes w1(1, '\r');
+         w1.insert(w1.end(), m.v1.begin(), m.v1.end());
+         corrupt(w1, model);
+         receive_v1(m, w1, v1);
+
+         bytes w2(1, FRAME_DELIMITER);
+         bytes e = encode_v2(m, seq);
+         w2.insert(w2.end(), e.begin(), e.end());
+         corrupt(w2, model);
+         receive_v2(m, seq, w2, v2);
+      }
+      printf("%-20s %10.4f%% %10.4f%% %7.4f%%\n", names[model],
+            100.0 * v1.accepted / trials, 100.0 * v1.length / trials,
+            100.0 * v2.accepted / trials);
+      // CRC-16 alone misses about one in 65536 random errors, and none of
+      //  up to three bits or 16-bit bursts within the data it covers
+      if( (int)v2.accepted > trials / 10000 ) {
+         printf("FAIL v2 missed %u errors\n", v2.accepted);
+         ++failures;
+      }
+   }
+}
+
+int main(int argc, char ** argv) {
+   int trials = argc > 1 ? atoi(argv[1]) : 200000;
+   srand(1);
+
+   test_codec();
+   report_overhead();
+   report_errors(trials);
+
+   if( failures ) {
+      printf("%d failures\n", failures);
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,60 @@
+/* likelihood_field.h
+ *
+ * Window of the global map's distance-to-nearest-obstacle field, for scoring
+ *  laser scans.
+ *
+ * The field is built and cached per hunk by the global map server and
+ *  fetched with the Field service: one uint8 per cell holding the distance
+ *  in cells, saturated at 255. Cells outside the window read as 255.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef LIKELIHOOD_FIELD_H
+#define LIKELIHOOD_FIELD_H
+
+#include <stdint.h>
+#include <vector>
+
+class likelihood_field {
+   public:
+      // window origin and size, in global map cells
+      int col;
+      int row;
+      int width;
+      int height;
+
+      likelihood_field() : col(0), row(0), width(0), height(0) {}
+
+      // take a row-major window of the field; d is swapped out
+      void set(std::vector<uint8_t> & d, int w, int h, int c, int r) {
+         col = c;
+         row = r;
+         width = w;
+         height = h;
+         dist.swap(d);
+      }
+
+      // distance at global map cell (c, r)
+      uint8_t get(int c, int r) const {
+         unsigned x = c - col;
+         unsigned y = r - row;
+         if( x < (unsigned)width && y < (unsigned)height ) {
+            return dist[x + y*width];
+         }
+         return 255;
+      }
+
+      // true if the window contains (c, r) at least margin cells from the edge
+      bool covers(int c, int r, int margin) const {
+         return c - col >= margin && r - row >= margin &&
+            col + width - c > margin && row + height - r > margin;
+      }
+
+      const uint8_t * data() const { return dist.empty() ? 0 : &dist[0]; }
+
+   private:
+      std::vector<uint8_t> dist;
+};
+
+#endif
@@ -19,22 +19,211 @@
  *  use GPS data to limit possible test states
  *  in theory, we should be able to get away with a relatively small number of
  *   particles; I'm thinking a few dozen, max
+ *
+ * Implemented as a particle filter; see particle_filter.h. The cloud starts
+ *  around the first GPS fix, odometry drives it, laser scans are scored
+ *  against a window of the global map's likelihood field, and every fix
+ *  gates it. The window is re-fetched when the estimate gets close to its
+ *  edge.
  */
 
-#include "ros/ros.h"
-#include "nav_msgs/Odometry.h"
-#include "sensor_msgs/LaserScan.h"
+#include <math.h>
+#include <vector>
+
+#include <ros/ros.h>
+#include <tf/transform_listener.h>
+#include <nav_msgs/Odometry.h>
+#include <sensor_msgs/LaserScan.h>
+#include <geometry_msgs/PoseArray.h>
+#include <gps_common/GPSFix.h>
+#include <global_map/Field.h>
+#include <global_map/projection.h>
+
+#include "particle_filter.h"
+
+particle_filter * pf;
+bool initialized = false;
+
+tf::TransformListener * listener;
+
+// likelihood field window
+likelihood_field field;
+ros::ServiceClient field_client;
+int map_size = 1000;   // cells
+int map_margin = 200;  // cells; re-fetch when the estimate is this close
+int16_t meridian;
+
+// laser
+int max_beams = 60;
+
+// only score scans after moving this far (m) or turning this much (rad)
+double update_min_d = 0.1;
+double update_min_a = 0.2;
+double moved_d = 0;
+double moved_a = 0;
+
+// GPS noise, if the fix doesn't report it (m^2)
+double gps_noise = 2.5*2.5;
+
+// last odometry pose
+bool have_odom = false;
+double odom_x;
+double odom_y;
+double odom_t;
+
+ros::Publisher pose_pub;
+ros::Publisher cloud_pub;
+
+void publish(const ros::Time & stamp) {
+   double x, y, t, cov[9];
+   pf->estimate(x, y, t, cov);
+
+   nav_msgs::Odometry pose;
+   pose.header.stamp = stamp;
+   pose.header.frame_id = "map";
+   pose.child_frame_id = "base_link";
+   pose.pose.pose.position.x = x;
+   pose.pose.pose.position.y = y;
+   pose.pose.pose.orientation = tf::createQuaternionMsgFromYaw(t);
+   static const int idx[3] = { 0, 1, 5 };
+   for( int i=0; i<3; i++ ) {
+      for( int j=0; j<3; j++ ) {
+         pose.pose.covariance[idx[i]*6 + idx[j]] = cov[i*3 + j];
+      }
+   }
+   pose_pub.publish(pose);
+
+   if( cloud_pub.getNumSubscribers() > 0 ) {
+      geometry_msgs::PoseArray cloud;
+      cloud.header = pose.header;
+      cloud.poses.resize(pf->size());
+      for( unsigned i=0; i<pf->size(); i++ ) {
+         cloud.poses[i].position.x = pf->px()[i];
+         cloud.poses[i].position.y = pf->py()[i];
+         cloud.poses[i].orientation =
+            tf::createQuaternionMsgFromYaw(pf->ptheta()[i]);
+      }
+      cloud_pub.publish(cloud);
+   }
+}
+
+// make sure the map window covers the current estimate
+bool update_map() {
+   double x, y, t, cov[9];
+   pf->estimate(x, y, t, cov);
+   int c = round(x / global_map::MAP_RES);
+   int r = round(y / global_map::MAP_RES);
+   if( field.width > 0 && field.covers(c, r, map_margin) ) return true;
+
+   global_map::Field f;
+   f.request.width = map_size;
+   f.request.height = map_size;
+   f.request.offset_col = c - map_size/2;
+   f.request.offset_row = r - map_size/2;
+   ros::WallTime start = ros::WallTime::now();
+   if( !field_client.call(f) ) {
+      ROS_ERROR("Failed to call Field service");
+      return field.width > 0;
+   }
+   if( f.response.field.size() != (size_t)(map_size * map_size) ) {
+      ROS_ERROR("Field service returned %zu cells; expected %d",
+            f.response.field.size(), map_size * map_size);
+      return field.width > 0;
+   }
+   field.set(f.response.field, map_size, map_size,
+         f.request.offset_col, f.request.offset_row);
+   ROS_INFO("Fetched likelihood field at (%d, %d) in %lf s",
+         f.request.offset_col, f.request.offset_row,
+         (ros::WallTime::now() - start).toSec());
+   return true;
+}
 
 // callback for receiving odometry messages
 void odometryCallback(const nav_msgs::Odometry::ConstPtr &odo) {
+   double x = odo->pose.pose.position.x;
+   double y = odo->pose.pose.position.y;
+   double t = tf::getYaw(odo->pose.pose.orientation);
+
+   if( have_odom && initialized ) {
+      pf->motion(odom_x, odom_y, odom_t, x, y, t);
+      moved_d += hypot(x - odom_x, y - odom_y);
+      moved_a += fabs(pf_wrap(t - odom_t));
+   }
+   odom_x = x;
+   odom_y = y;
+   odom_t = t;
+   have_odom = true;
 }
 
 // callback for receiving laser scans
 void laserCallback(const sensor_msgs::LaserScan::ConstPtr &scan) {
+   if( !initialized ) return;
+   if( moved_d < update_min_d && moved_a < update_min_a ) return;
+
+   // laser pose on the robot
+   tf::StampedTransform laser;
+   try {
+      listener->lookupTransform("base_link", scan->header.frame_id,
+            ros::Time(0), laser);
+   } catch( tf::TransformException ex ) {
+      ROS_WARN_THROTTLE(10, "No laser transform: %s", ex.what());
+      return;
+   }
+   double lx = laser.getOrigin().x();
+   double ly = laser.getOrigin().y();
+   double lt = tf::getYaw(laser.getRotation());
+
+   // beam endpoints in the robot frame, subsampled
+   static std::vector<float> bx;
+   static std::vector<float> by;
+   bx.clear();
+   by.clear();
+   size_t step = scan->ranges.size() / max_beams + 1;
+   for( size_t i=0; i<scan->ranges.size(); i += step ) {
+      float r = scan->ranges[i];
+      if( r >= scan->range_min && r < scan->range_max ) {
+         double a = lt + scan->angle_min + i * scan->angle_increment;
+         bx.push_back(lx + r * cos(a));
+         by.push_back(ly + r * sin(a));
+      }
+   }
+
+   if( !update_map() ) return;
+
+   pf->scan(bx, by, field);
+   pf->resample();
+   moved_d = 0;
+   moved_a = 0;
+
+   publish(scan->header.stamp);
 }
 
 // callback for receiving GPS data
-void gpsCallback(void) {
+void gpsCallback(const gps_common::GPSFix::ConstPtr &gps) {
+   if( gps->status.status != 0 ) return;
+
+   if( !initialized ) meridian = global_map::meridian_for(gps->longitude);
+   double x, y;
+   global_map::project(gps->latitude, gps->longitude, meridian, x, y);
+   x *= global_map::MAP_RES;
+   y *= global_map::MAP_RES;
+
+   double var = gps_noise;
+   if( gps->position_covariance_type !=
+         gps_common::GPSFix::COVARIANCE_TYPE_UNKNOWN ) {
+      var = (gps->position_covariance[0] + gps->position_covariance[4]) / 2;
+   }
+
+   if( !initialized ) {
+      // no idea which way we're facing yet
+      pf->init(pf->max_particles, x, y, 0, sqrt(var), M_PI);
+      initialized = true;
+      ROS_INFO("Localization initialized at (%lf, %lf)", x, y);
+   } else {
+      pf->gps(x, y, var);
+      pf->resample();
+   }
+   publish(gps->header.stamp);
 }
 
 int main(int argc, char ** argv) {
@@ -42,12 +231,57 @@ int main(int argc, char ** argv) {
    ros::init(argc, argv, "localization");
 
    ros::NodeHandle n;
+   ros::NodeHandle pn("~");
+
+   int threads;
+   pn.param("threads", threads, (int)boost::thread::hardware_concurrency());
+   pf = new particle_filter(threads > 0 ? threads : 1);
+
+   int min_particles = pf->min_particles;
+   int max_particles = pf->max_particles;
+   pn.param("min_particles", min_particles, min_particles);
+   pn.param("max_particles", max_particles, max_particles);
+   pf->min_particles = min_particles;
+   pf->max_particles = max_particles;
+   pn.param("kld_err", pf->kld_err, pf->kld_err);
+   pn.param("kld_z", pf->kld_z, pf->kld_z);
+   pn.param("alpha1", pf->alpha1, pf->alpha1);
+   pn.param("alpha2", pf->alpha2, pf->alpha2);
+   pn.param("alpha3", pf->alpha3, pf->alpha3);
+   pn.param("alpha4", pf->alpha4, pf->alpha4);
+   pn.param("gps_gate", pf->gps_gate, pf->gps_gate);
+   pn.param("gps_noise", gps_noise, gps_noise);
+   pn.param("sigma_hit", pf->sigma_hit, pf->sigma_hit);
+   pn.param("z_hit", pf->z_hit, pf->z_hit);
+   pn.param("z_rand", pf->z_rand, pf->z_rand);
+   pf->update_table();
+   pn.param("max_beams", max_beams, max_beams);
+   pn.param("update_min_d", update_min_d, update_min_d);
+   pn.param("update_min_a", update_min_a, update_min_a);
+   pn.param("map_size", map_size, map_size);
+   pn.param("map_margin", map_margin, map_margin);
+
+   listener = new tf::TransformListener();
+
+   field_client = n.serviceClient<global_map::Field>("Field");
+
+   pose_pub = n.advertise<nav_msgs::Odometry>("localization", 10);
+   cloud_pub = n.advertise<geometry_msgs::PoseArray>("particlecloud", 1);
 
    // subscribe to laser scan data
    ros::Subscriber laser_sub = n.subscribe("scan", 10, laserCallback);
 
-   // subscribe to 
+   // subscribe to
    ros::Subscriber odom_sub = n.subscribe("odometry", 10, odometryCallback);
 
+   ros::Subscriber gps_sub = n.subscribe("extended_fix", 10, gpsCallback);
+
+   ROS_INFO("localization running with %u threads", pf->threads());
+
+   ros::spin();
+
+   delete pf;
+   delete listener;
+
    return 0;
 }
@@ -0,0 +1,361 @@
+/* particle_filter.h
+ *
+ * GPS-constrained particle filter over the robot pose (x, y, heading), in
+ *  meters and radians in the global map frame.
+ *
+ * Particles are stored as separate arrays (x, y, heading, weight) so the
+ *  scan scoring loop runs over contiguous data. Each step:
+ *    motion(): sample the odometry motion model for every particle
+ *    gps():    weight by the fix, and discard particles outside the gate;
+ *              if none are left, the cloud is redrawn around the fix
+ *    scan():   weight by the likelihood field at each beam endpoint; split
+ *              across the worker pool
+ *    resample(): low-variance resampling, when the effective sample size
+ *              falls below a threshold. The particle count is chosen by
+ *              KLD-sampling from the number of occupied histogram bins
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef PARTICLE_FILTER_H
+#define PARTICLE_FILTER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/random.hpp>
+
+#include "likelihood_field.h"
+#include "worker_pool.h"
+
+// size of a global map cell (m)
+#define PF_MAP_RES 0.1
+
+inline double pf_wrap(double a) {
+   while( a >  M_PI ) a -= M_PI*2;
+   while( a < -M_PI ) a += M_PI*2;
+   return a;
+}
+
+class particle_filter {
+   public:
+      // odometry motion model noise (Thrun's alpha1-4): rotation from
+      //  rotation, rotation from translation, translation from translation,
+      //  translation from rotation
+      double alpha1;
+      double alpha2;
+      double alpha3;
+      double alpha4;
+
+      // GPS gate, in standard deviations
+      double gps_gate;
+
+      // laser model: standard deviation of the endpoint error (m), and the
+      //  mixture of hits and random readings
+      double sigma_hit;
+      double z_hit;
+      double z_rand;
+
+      // KLD-sampling: particle count bounds, error bound, upper standard
+      //  normal quantile and histogram bin sizes
+      unsigned min_particles;
+      unsigned max_particles;
+      double kld_err;
+      double kld_z;
+      double bin_xy;
+      double bin_theta;
+
+      // resample when the effective sample size falls below this fraction
+      //  of the particle count
+      double resample_threshold;
+
+      explicit particle_filter(unsigned threads = 1) : alpha1(0.2),
+         alpha2(0.2), alpha3(0.2), alpha4(0.2), gps_gate(3.0), sigma_hit(0.2),
+         z_hit(0.95), z_rand(0.05), min_particles(100), max_particles(5000),
+         kld_err(0.01), kld_z(3.0), bin_xy(0.5), bin_theta(10.0*M_PI/180.0),
+         resample_threshold(0.5), pool(threads), rng(42),
+         normal(rng, boost::normal_distribution<double>(0.0, 1.0)), n(0) {
+         // bound once, so that scan() doesn't build a new job every update
+         score_job = boost::bind(&particle_filter::score, this, _1, _2);
+         update_table();
+      }
+
+      // recompute the laser model lookup table; call after changing
+      //  sigma_hit, z_hit or z_rand
+      void update_table() {
+         for( int d=0; d<256; d++ ) {
+            double e = d * PF_MAP_RES / sigma_hit;
+            table[d] = log(z_hit * exp(-0.5 * e * e) + z_rand);
+         }
+      }
+
+      // draw n particles around (px, py, heading)
+      void init(unsigned count, double px, double py, double heading,
+            double sigma_xy, double sigma_theta) {
+         reserve();
+         n = count < max_particles ? count : max_particles;
+         for( unsigned i=0; i<n; ++i ) {
+            x[i] = px + gauss() * sigma_xy;
+            y[i] = py + gauss() * sigma_xy;
+            theta[i] = pf_wrap(heading + gauss() * sigma_theta);
+            w[i] = 1.0 / n;
+         }
+      }
+
+      // draw particles around a fix, keeping their headings
+      void redraw(double px, double py, double sigma_xy) {
+         for( unsigned i=0; i<n; ++i ) {
+            x[i] = px + gauss() * sigma_xy;
+            y[i] = py + gauss() * sigma_xy;
+            w[i] = 1.0 / n;
+         }
+      }
+
+      // odometry moved from (x0, y0, t0) to (x1, y1, t1) in the odometry frame
+      void motion(double x0, double y0, double t0, double x1, double y1,
+            double t1) {
+         double dx = x1 - x0;
+         double dy = y1 - y0;
+         double trans = hypot(dx, dy);
+         double rot1 = trans < 0.01 ? 0.0 : pf_wrap(atan2(dy, dx) - t0);
+         // driving backwards
+         if( fabs(rot1) > M_PI/2 ) {
+            rot1 = pf_wrap(rot1 - M_PI);
+            trans = -trans;
+         }
+         double rot2 = pf_wrap(t1 - t0 - rot1);
+
+         double s_rot1 = sqrt(alpha1*rot1*rot1 + alpha2*trans*trans);
+         double s_trans = sqrt(alpha3*trans*trans +
+               alpha4*(rot1*rot1 + rot2*rot2));
+         double s_rot2 = sqrt(alpha1*rot2*rot2 + alpha2*trans*trans);
+
+         for( unsigned i=0; i<n; ++i ) {
+            double r1 = rot1 + gauss() * s_rot1;
+            double tr = trans + gauss() * s_trans;
+            double r2 = rot2 + gauss() * s_rot2;
+            double h = theta[i] + r1;
+            x[i] += tr * cos(h);
+            y[i] += tr * sin(h);
+            theta[i] = pf_wrap(h + r2);
+         }
+      }
+
+      // weight by a GPS fix at (px, py) with variance var (m^2, per axis)
+      void gps(double px, double py, double var) {
+         double gate = gps_gate * gps_gate;
+         double total = 0;
+         for( unsigned i=0; i<n; ++i ) {
+            double dx = x[i] - px;
+            double dy = y[i] - py;
+            double d = (dx*dx + dy*dy) / var;
+            w[i] = d > gate ? 0.0 : w[i] * exp(-0.5 * d);
+            total += w[i];
+         }
+         if( total > 0 ) {
+            normalize(total);
+         } else {
+            // the whole cloud is outside the gate
+            redraw(px, py, sqrt(var));
+         }
+      }
+
+      /* weight by a laser scan. bx and by are the beam endpoints in the
+       *  robot frame (m)
+       */
+      void scan(const std::vector<float> & bx, const std::vector<float> & by,
+            const likelihood_field & f) {
+         if( n == 0 ) return;
+         // endpoints in cells
+         beam_x.resize(bx.size());
+         beam_y.resize(by.size());
+         for( size_t k=0; k<bx.size(); ++k ) {
+            beam_x[k] = bx[k] / PF_MAP_RES;
+            beam_y[k] = by[k] / PF_MAP_RES;
+         }
+         field = &f;
+
+         pool.run(score_job, n);
+
+         double max = lw[0];
+         for( unsigned i=1; i<n; ++i ) {
+            if( lw[i] > max ) max = lw[i];
+         }
+         double total = 0;
+         for( unsigned i=0; i<n; ++i ) {
+            w[i] *= exp(lw[i] - max);
+            total += w[i];
+         }
+         if( total > 0 ) normalize(total);
+      }
+
+      // effective sample size
+      double neff() const {
+         double s = 0;
+         for( unsigned i=0; i<n; ++i ) s += w[i] * w[i];
+         return s > 0 ? 1.0 / s : 0;
+      }
+
+      // resample if the effective sample size is low; returns true if it
+      //  did
+      bool resample() {
+         if( n == 0 || neff() >= resample_threshold * n ) return false;
+
+         // KLD bound from the bins occupied by the weighted set: sort the
+         //  particles' bins in place and count the distinct ones
+         reserve();
+         double floor_w = 0.1 / n;
+         unsigned k = 0;
+         for( unsigned i=0; i<n; ++i ) {
+            if( w[i] >= floor_w ) bins[k++] = bin(i);
+         }
+         std::sort(bins.begin(), bins.begin() + k);
+         unsigned m = kld_bound(std::unique(bins.begin(), bins.begin() + k) -
+               bins.begin());
+
+         // low-variance resampling into the back buffer
+         double step = 1.0 / m;
+         double r = uniform() * step;
+         double c = w[0];
+         unsigned i = 0;
+         for( unsigned j=0; j<m; ++j ) {
+            double u = r + j * step;
+            while( u > c && i < n - 1 ) c += w[++i];
+            nx[j] = x[i];
+            ny[j] = y[i];
+            ntheta[j] = theta[i];
+         }
+         x.swap(nx);
+         y.swap(ny);
+         theta.swap(ntheta);
+         n = m;
+         for( unsigned j=0; j<n; ++j ) w[j] = 1.0 / n;
+         return true;
+      }
+
+      // weighted mean and covariance of the cloud; cov is row-major 3x3
+      void estimate(double & mx, double & my, double & mt, double cov[9])
+         const {
+         mx = my = 0;
+         double sc = 0, ss = 0;
+         for( unsigned i=0; i<n; ++i ) {
+            mx += w[i] * x[i];
+            my += w[i] * y[i];
+            sc += w[i] * cos(theta[i]);
+            ss += w[i] * sin(theta[i]);
+         }
+         mt = atan2(ss, sc);
+         for( int k=0; k<9; ++k ) cov[k] = 0;
+         for( unsigned i=0; i<n; ++i ) {
+            double d[3] = { x[i] - mx, y[i] - my, pf_wrap(theta[i] - mt) };
+            for( int a=0; a<3; ++a ) {
+               for( int b=0; b<3; ++b ) {
+                  cov[a*3 + b] += w[i] * d[a] * d[b];
+               }
+            }
+         }
+      }
+
+      unsigned size() const { return n; }
+      unsigned threads() const { return pool.size(); }
+      const double * px() const { return &x[0]; }
+      const double * py() const { return &y[0]; }
+      const double * ptheta() const { return &theta[0]; }
+
+   private:
+      worker_pool pool;
+      boost::mt19937 rng;
+      boost::variate_generator<boost::mt19937 &,
+         boost::normal_distribution<double> > normal;
+
+      // particle store; front and back buffers for resampling
+      unsigned n;
+      std::vector<double> x, y, theta, w;
+      std::vector<double> nx, ny, ntheta;
+      // per-particle scan log-likelihood
+      std::vector<double> lw;
+
+      // current scan, for the workers
+      std::vector<float> beam_x, beam_y;
+      const likelihood_field * field;
+
+      // log-likelihood by endpoint distance (cells)
+      double table[256];
+
+      // histogram bins of the particles, for KLD-sampling
+      std::vector<uint64_t> bins;
+
+      worker_pool::job_type score_job;
+
+      void reserve() {
+         if( x.size() >= max_particles ) return;
+         x.resize(max_particles);
+         y.resize(max_particles);
+         theta.resize(max_particles);
+         w.resize(max_particles);
+         nx.resize(max_particles);
+         ny.resize(max_particles);
+         ntheta.resize(max_particles);
+         lw.resize(max_particles);
+         bins.resize(max_particles);
+      }
+
+      double gauss() {
+         return normal();
+      }
+
+      double uniform() {
+         boost::uniform_01<boost::mt19937 &> u(rng);
+         return u();
+      }
+
+      void normalize(double total) {
+         for( unsigned i=0; i<n; ++i ) w[i] /= total;
+      }
+
+      // score particles [begin, end) against the current scan
+      void score(size_t begin, size_t end) {
+         const float * bx = &beam_x[0];
+         const float * by = &beam_y[0];
+         const size_t beams = beam_x.size();
+         const likelihood_field & f = *field;
+
+         for( size_t i=begin; i<end; ++i ) {
+            // particle pose in cells, relative to the field origin
+            float c = cos(theta[i]);
+            float s = sin(theta[i]);
+            float ox = x[i] / PF_MAP_RES;
+            float oy = y[i] / PF_MAP_RES;
+            double sum = 0;
+            for( size_t k=0; k<beams; ++k ) {
+               float ex = ox + c * bx[k] - s * by[k];
+               float ey = oy + s * bx[k] + c * by[k];
+               sum += table[f.get(lrintf(ex), lrintf(ey))];
+            }
+            lw[i] = sum;
+         }
+      }
+
+      uint64_t bin(unsigned i) const {
+         uint64_t bx = (uint32_t)(int32_t)floor(x[i] / bin_xy) & 0xFFFFFF;
+         uint64_t by = (uint32_t)(int32_t)floor(y[i] / bin_xy) & 0xFFFFFF;
+         uint64_t bt = (uint32_t)(int32_t)floor(theta[i] / bin_theta) & 0xFFFF;
+         return (bx << 40) | (by << 16) | bt;
+      }
+
+      // number of particles needed for k occupied bins (Fox, 2003)
+      unsigned kld_bound(size_t k) const {
+         if( k <= 1 ) return min_particles;
+         double a = 2.0 / (9.0 * (k - 1));
+         double b = 1.0 - a + sqrt(a) * kld_z;
+         double m = (k - 1) / (2.0 * kld_err) * b * b * b;
+         if( m < min_particles ) return min_particles;
+         if( m > max_particles ) return max_particles;
+         return (unsigned)ceil(m);
+      }
+};
+
+#endif
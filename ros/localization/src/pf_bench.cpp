@@ -0,0 +1,128 @@
+/* pf_bench.cpp
+ *
+ * Measure particle filter update throughput on recorded scans.
+ *
+ * Usage: pf_bench <bagfile> [topic] [max beams]
+ *
+ * Scans from the bag are scored against a synthetic 100m square map of
+ *  walls and cone-sized obstacles, for a range of particle counts and
+ *  thread counts. Each update is a motion step and a scan weighting;
+ *  resampling is left out so the particle count stays fixed.
+ *
+ * Author: Austin Hendrix
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/LaserScan.h>
+
+#include <global_map/distance_field.h>
+
+#include "particle_filter.h"
+
+#define MAP_SIDE 1000
+
+int main(int argc, char ** argv) {
+   if( argc < 2 ) {
+      fprintf(stderr, "Usage: pf_bench <bagfile> [topic] [max beams]\n");
+      return -1;
+   }
+   std::string topic = argc > 2 ? argv[2] : "scan";
+   unsigned max_beams = argc > 3 ? atoi(argv[3]) : 60;
+
+   // load all scans up front so we only time the processing; keep only
+   //  the beam endpoints, subsampled the same way the node does
+   std::vector<std::vector<float> > scan_x;
+   std::vector<std::vector<float> > scan_y;
+   rosbag::Bag bag(argv[1]);
+   rosbag::View view(bag, rosbag::TopicQuery(topic));
+   BOOST_FOREACH(rosbag::MessageInstance const m, view) {
+      sensor_msgs::LaserScan::ConstPtr s =
+         m.instantiate<sensor_msgs::LaserScan>();
+      if( !s ) continue;
+      std::vector<float> bx;
+      std::vector<float> by;
+      size_t step = s->ranges.size() / max_beams + 1;
+      for( size_t i=0; i<s->ranges.size(); i += step ) {
+         float r = s->ranges[i];
+         if( r >= s->range_min && r < s->range_max ) {
+            float a = s->angle_min + i * s->angle_increment;
+            bx.push_back(r * cos(a));
+            by.push_back(r * sin(a));
+         }
+      }
+      scan_x.push_back(bx);
+      scan_y.push_back(by);
+   }
+   bag.close();
+
+   if( scan_x.size() == 0 ) {
+      fprintf(stderr, "No scans on topic %s\n", topic.c_str());
+      return -1;
+   }
+
+   // synthetic map: a walled square with scattered obstacles
+   std::vector<int8_t> map(MAP_SIDE * MAP_SIDE, 0);
+   for( int i=0; i<MAP_SIDE; i++ ) {
+      map[i] = map[i + (MAP_SIDE-1)*MAP_SIDE] = 100;
+      map[i*MAP_SIDE] = map[MAP_SIDE-1 + i*MAP_SIDE] = 100;
+   }
+   srand(1);
+   for( int k=0; k<500; k++ ) {
+      int c = rand() % (MAP_SIDE - 6) + 3;
+      int r = rand() % (MAP_SIDE - 6) + 3;
+      for( int i=-2; i<=2; i++ )
+         for( int j=-2; j<=2; j++ )
+            map[(c+i) + (r+j)*MAP_SIDE] = 100;
+   }
+   std::vector<uint8_t> dist(MAP_SIDE * MAP_SIDE);
+   global_map::distance_transform transform;
+   ros::WallTime start = ros::WallTime::now();
+   transform.compute(&map[0], MAP_SIDE, MAP_SIDE, &dist[0]);
+   likelihood_field field;
+   field.set(dist, MAP_SIDE, MAP_SIDE, 0, 0);
+   printf("likelihood field %dx%d: %lf s\n", MAP_SIDE, MAP_SIDE,
+         (ros::WallTime::now() - start).toSec());
+
+   unsigned cores = boost::thread::hardware_concurrency();
+   if( cores < 1 ) cores = 1;
+   static const unsigned counts[] = { 100, 300, 1000, 3000, 10000 };
+
+   // thread counts: powers of two below the core count, then all cores
+   std::vector<unsigned> thread_counts;
+   for( unsigned t = 1; t < cores; t *= 2 ) thread_counts.push_back(t);
+   thread_counts.push_back(cores);
+
+   for( size_t tc=0; tc<thread_counts.size(); ++tc ) {
+      unsigned threads = thread_counts[tc];
+      particle_filter pf(threads);
+      pf.max_particles = 10000;
+      for( unsigned c=0; c<sizeof(counts)/sizeof(counts[0]); ++c ) {
+         double center = MAP_SIDE * PF_MAP_RES / 2;
+         pf.init(counts[c], center, center, 0, 2.0, 0.5);
+
+         double t = 0;
+         start = ros::WallTime::now();
+         for( size_t i=0; i<scan_x.size(); ++i ) {
+            pf.motion(t, 0, 0, t + 0.05, 0, 0);
+            t += 0.05;
+            pf.scan(scan_x[i], scan_y[i], field);
+         }
+         double elapsed = (ros::WallTime::now() - start).toSec();
+         printf("%u threads, %5u particles: %8.1f updates/s, %8.1f us/update"
+               "\n", threads, counts[c], scan_x.size() / elapsed,
+               elapsed * 1e6 / scan_x.size());
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,82 @@
+/* worker_pool.h
+ *
+ * A fixed pool of threads for splitting a loop across cores.
+ *
+ * run(job, n) calls job(begin, end) on contiguous slices of [0, n), one per
+ *  thread, and returns when all of them are done. The calling thread does
+ *  the first slice itself. Threads are started once and wait on a barrier
+ *  between jobs, so a job costs two barrier crossings rather than thread
+ *  creation.
+ *
+ * Author: Austin Hendrix
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+class worker_pool {
+   public:
+      typedef boost::function<void(size_t, size_t)> job_type;
+
+      // threads is the total, including the caller
+      explicit worker_pool(unsigned threads) :
+         count(threads > 0 ? threads : 1), start(count), done(count),
+         job(0), n(0), stop(false) {
+         for( unsigned i=1; i<count; ++i ) {
+            workers.create_thread(boost::bind(&worker_pool::worker, this, i));
+         }
+      }
+
+      ~worker_pool() {
+         stop = true;
+         if( count > 1 ) start.wait();
+         workers.join_all();
+      }
+
+      unsigned size() const { return count; }
+
+      void run(const job_type & j, size_t items) {
+         if( count == 1 ) {
+            j(0, items);
+            return;
+         }
+         job = &j;
+         n = items;
+         start.wait();
+         slice(0);
+         done.wait();
+      }
+
+   private:
+      unsigned count;
+      boost::barrier start;
+      boost::barrier done;
+      boost::thread_group workers;
+
+      // the current job; only written while the workers wait on start
+      const job_type * job;
+      size_t n;
+      bool stop;
+
+      void slice(unsigned i) {
+         size_t begin = n * i / count;
+         size_t end = n * (i + 1) / count;
+         if( begin < end ) (*job)(begin, end);
+      }
+
+      void worker(unsigned i) {
+         while( true ) {
+            start.wait();
+            if( stop ) return;
+            slice(i);
+            done.wait();
+         }
+      }
+};
+
+#endif
@@ -28,6 +28,7 @@
 #include <stdio.h>
 
 #include <set>
+#include <deque>
 #include <list>
 #include <map>
 #include <vector>
@@ -74,7 +75,9 @@ double cone_dist = 6.0;
 double max_speed = 1.5;
 double min_speed = 0.1;
 double planner_lookahead = 4.0;
-// TODO: use proper units
+/* acceleration limit: the most the commanded speed may lead the measured
+ *  speed (m/s). Being a lead over the measurement rather than a step from
+ *  the last command, it doesn't depend on the odometry rate */
 double max_accel = 0.3;
 
 // planner timeouts
@@ -461,6 +464,36 @@ void goalCallback(const geometry_msgs::Point::ConstPtr & msg) {
 //  used as the center point for our local map
 loc last_loc;
 geometry_msgs::Pose last_pose;
+
+// recent locations, so that laser scans are placed where we were when they
+//  were taken rather than where we are when they arrive
+struct stamped_loc {
+   ros::Time stamp;
+   loc l;
+};
+deque<stamped_loc> loc_history;
+// seconds of history to keep
+#define LOC_HISTORY 1.0
+
+// where we were at time t, interpolated between odometry updates; the
+//  nearest end of the history if t is outside it
+loc loc_at(const ros::Time & t) {
+   if( loc_history.empty() || t >= loc_history.back().stamp ) return last_loc;
+   if( t <= loc_history.front().stamp ) return loc_history.front().l;
+
+   int i = loc_history.size() - 1;
+   while( loc_history[i-1].stamp > t ) i--;
+   const stamped_loc & a = loc_history[i-1];
+   const stamped_loc & b = loc_history[i];
+   double f = (t - a.stamp).toSec() / (b.stamp - a.stamp).toSec();
+
+   loc l;
+   l.x = a.l.x + f * (b.l.x - a.l.x);
+   l.y = a.l.y + f * (b.l.y - a.l.y);
+   double dyaw = atan2(sin(b.l.pose - a.l.pose), cos(b.l.pose - a.l.pose));
+   l.pose = a.l.pose + f * dyaw;
+   return l;
+}
    
 void odomCallback(const nav_msgs::Odometry::ConstPtr & msg) {
    loc here;
@@ -470,6 +503,18 @@ void odomCallback(const nav_msgs::Odometry::ConstPtr & msg) {
 
    last_loc = here;
    last_pose = msg->pose.pose;
+
+   // stamps that go backwards mean the hardware restarted; start over
+   if( !loc_history.empty() && msg->header.stamp <= loc_history.back().stamp ) {
+      loc_history.clear();
+   }
+   stamped_loc s;
+   s.stamp = msg->header.stamp;
+   s.l = here;
+   loc_history.push_back(s);
+   while( (s.stamp - loc_history.front().stamp).toSec() > LOC_HISTORY ) {
+      loc_history.pop_front();
+   }
    if( active ) {
       geometry_msgs::Twist cmd;
 
@@ -518,9 +563,9 @@ void odomCallback(const nav_msgs::Odometry::ConstPtr & msg) {
 void laserCallback(const sensor_msgs::LaserScan::ConstPtr & msg) {
    //map_center_x = last_loc.x;
    //map_center_y = last_loc.y;
-   loc here = last_loc;
+   loc here = loc_at(msg->header.stamp);
 
-   double theta_base = last_loc.pose;
+   double theta_base = here.pose;
 
    double theta = theta_base + msg->angle_min;
    double x;
@@ -11,6 +11,7 @@
 #include <nav_msgs/Odometry.h>
 #include <hardware_interface/Control.h>
 #include <goal_list/GoalList.h>
+#include <global_map/projection.h>
 
 double dist = 0.0;
 bool done = false;
@@ -19,6 +20,12 @@ ros::Publisher goalList_pub;
 
 ros::Subscriber pos;
 
+// position is in meters; goals are map cells
+void set_goal(global_map::Location & loc, double x, double y) {
+   loc.col = round(x / global_map::MAP_RES);
+   loc.row = round(y / global_map::MAP_RES);
+}
+
 // callback on position
 void posCallback(const nav_msgs::Odometry::ConstPtr & msg) {
    double x = msg->pose.pose.position.x;
@@ -35,26 +42,22 @@ void posCallback(const nav_msgs::Odometry::ConstPtr & msg) {
 
    x1 = x + dist*cos(t);
    y1 = y + dist*sin(t);
-   loc.col = x1;
-   loc.row = y1;
+   set_goal(loc, x1, y1);
    list.goals.push_back(loc);
 
    x1 = x + dist*cos(t) + dist*cos(t + M_PI/2.0);
    y1 = y + dist*sin(t) + dist*sin(t + M_PI/2.0);
-   loc.col = x1;
-   loc.row = y1;
+   set_goal(loc, x1, y1);
    list.goals.push_back(loc);
 
    x1 = x + dist*cos(t + M_PI/2.0);
    y1 = y + dist*sin(t + M_PI/2.0);
-   loc.col = x1;
-   loc.row = y1;
+   set_goal(loc, x1, y1);
    list.goals.push_back(loc);
 
    x1 = x;
    y1 = y;
-   loc.col = x1;
-   loc.row = y1;
+   set_goal(loc, x1, y1);
    list.goals.push_back(loc);
 
    // publish a goal list with points in a square (I hope)
@@ -70,7 +73,7 @@ int main(int argc, char ** argv) {
 
    if( argc == 2 ) {
       sscanf(argv[1], "%lf", &dist);
-      ROS_INFO("Driving in square with side length %lf units", dist);
+      ROS_INFO("Driving in square with side length %lf m", dist);
    } else {
       return 0;
    }